@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "cozyfs.h"
+#include "histogram.h"
+
+// Benchmarks the public API with 1..N processes sharing one arena.
+// Each case starts from a fresh arena and prints one JSON object per
+// line, so results can be compared between releases with any tool.
+//
+//   ./bench [-p max_procs] [-t seconds_per_case] [-m arena_mb] [-f filter]
+
+#define COUNT(X) (int) (sizeof(X) / sizeof((X)[0]))
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
+
+#define MAX_PROCS 64
+
+typedef struct {
+	u64       errors;
+	Histogram latency; // Of the successful operations
+} Results;
+
+// Lives in the shared mapping next to the arena
+typedef struct {
+	volatile int ready;
+	volatile int go;
+	Results      results[MAX_PROCS];
+} Shared;
+
+typedef struct {
+	const char *name;
+	int (*setup)(CozyFS *fs, int procs, int dir_size, int file_size);
+	int (*op)   (CozyFS *fs, int proc, u64 iter, int dir_size, int file_size);
+	int  dir_sizes;  // Sweeps directory sizes
+	int  file_sizes; // Sweeps file sizes
+	int  backup;
+} Case;
+
+static int   max_procs = 0;
+static int   seconds   = 1;
+static u64   arena_len = 256ULL << 20;
+static char *filter    = NULL;
+
+static char  payload[1<<20];
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Utilities
+
+static void name_of(char *dst, int len, int proc, u64 index)
+{
+	snprintf(dst, len, "/d/p%d_%llu", proc, index);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Cases
+
+// Fills "/d" with "dir_size" files of "file_size" bytes. The ones each
+// process works on are "/d/p<proc>_<index>".
+static int setup_dir(CozyFS *fs, int procs, int dir_size, int file_size)
+{
+	int code = cozyfs_mkdir(fs, "/d");
+	if (code < 0)
+		return code;
+
+	for (int i = 0; i < dir_size; i++) {
+		char path[64];
+		name_of(path, sizeof(path), i % procs, i / procs);
+		int fd = cozyfs_create(fs, path);
+		if (fd < 0)
+			return fd;
+		int written = 0;
+		while (written < file_size) {
+			int num = cozyfs_write(fs, fd, payload, MIN(file_size - written, (int) sizeof(payload)));
+			if (num < 0) {
+				cozyfs_close(fs, fd);
+				return num;
+			}
+			written += num;
+		}
+		cozyfs_close(fs, fd);
+	}
+	return 0;
+}
+
+static int setup_empty(CozyFS *fs, int procs, int dir_size, int file_size)
+{
+	(void) dir_size;
+	return setup_dir(fs, procs, 0, file_size);
+}
+
+// Files owned by the process, cycling over the ones created by setup
+static void pick(char *dst, int len, int proc, u64 iter, int dir_size, int procs)
+{
+	int per_proc = dir_size / procs;
+	name_of(dst, len, proc, per_proc ? iter % per_proc : 0);
+}
+
+static int num_procs; // Of the running case
+
+static int op_open(CozyFS *fs, int proc, u64 iter, int dir_size, int file_size)
+{
+	(void) file_size;
+	char path[64];
+	pick(path, sizeof(path), proc, iter, dir_size, num_procs);
+	int fd = cozyfs_open(fs, path);
+	if (fd < 0)
+		return fd;
+	return cozyfs_close(fs, fd);
+}
+
+static int op_stat(CozyFS *fs, int proc, u64 iter, int dir_size, int file_size)
+{
+	(void) file_size;
+	char path[64];
+	pick(path, sizeof(path), proc, iter, dir_size, num_procs);
+	CozyFSStat buf;
+	return cozyfs_stat(fs, path, &buf);
+}
+
+static int op_read(CozyFS *fs, int proc, u64 iter, int dir_size, int file_size)
+{
+	static char dst[1<<16];
+	char path[64];
+	pick(path, sizeof(path), proc, iter, dir_size, num_procs);
+	int fd = cozyfs_open(fs, path);
+	if (fd < 0)
+		return fd;
+	int total = 0;
+	while (total < file_size) {
+		int num = cozyfs_read(fs, fd, dst, sizeof(dst));
+		if (num <= 0)
+			break;
+		total += num;
+	}
+	cozyfs_close(fs, fd);
+	return total == file_size ? 0 : -COZYFS_EINVAL;
+}
+
+static int op_write(CozyFS *fs, int proc, u64 iter, int dir_size, int file_size)
+{
+	(void) dir_size;
+	static int fd = -1;
+	if (iter == 0) {
+		char path[64];
+		name_of(path, sizeof(path), proc, 0);
+		fd = cozyfs_create(fs, path);
+	}
+	if (fd < 0)
+		return fd;
+	return cozyfs_write(fs, fd, payload, file_size);
+}
+
+static int op_mkdir(CozyFS *fs, int proc, u64 iter, int dir_size, int file_size)
+{
+	(void) dir_size;
+	(void) file_size;
+	char path[64];
+	name_of(path, sizeof(path), proc, iter);
+	return cozyfs_mkdir(fs, path);
+}
+
+static int op_unlink(CozyFS *fs, int proc, u64 iter, int dir_size, int file_size)
+{
+	(void) file_size;
+	char path[64];
+	name_of(path, sizeof(path), proc, iter);
+	if ((int) iter >= dir_size / num_procs)
+		return -COZYFS_ENOENT; // Ran out of files
+	return cozyfs_unlink(fs, path);
+}
+
+static int op_txn_small(CozyFS *fs, int proc, u64 iter, int dir_size, int file_size)
+{
+	(void) dir_size;
+	(void) file_size;
+	char path[64];
+	name_of(path, sizeof(path), proc, iter);
+
+	int code = cozyfs_transaction_begin(fs);
+	if (code < 0)
+		return code;
+	int fd = cozyfs_create(fs, path);
+	if (fd < 0) {
+		cozyfs_transaction_rollback(fs);
+		return fd;
+	}
+	cozyfs_write(fs, fd, payload, 64);
+	cozyfs_close(fs, fd);
+	return cozyfs_transaction_commit(fs);
+}
+
+static int op_txn_large(CozyFS *fs, int proc, u64 iter, int dir_size, int file_size)
+{
+	(void) dir_size;
+	(void) file_size;
+	int code = cozyfs_transaction_begin(fs);
+	if (code < 0)
+		return code;
+	for (int i = 0; i < 32; i++) {
+		char path[64];
+		name_of(path, sizeof(path), proc, iter * 32 + i);
+		code = cozyfs_mkdir(fs, path);
+		if (code < 0) {
+			cozyfs_transaction_rollback(fs);
+			return code;
+		}
+	}
+	return cozyfs_transaction_commit(fs);
+}
+
+static Case cases[] = {
+	{ "open",        setup_dir,   op_open,      1, 0, 0 },
+	{ "stat",        setup_dir,   op_stat,      1, 0, 0 },
+	{ "read",        setup_dir,   op_read,      0, 1, 0 },
+	{ "write",       setup_empty, op_write,     0, 1, 0 },
+	{ "mkdir",       setup_empty, op_mkdir,     0, 0, 0 },
+	{ "unlink",      setup_dir,   op_unlink,    1, 0, 0 },
+	{ "txn_small",   setup_empty, op_txn_small, 0, 0, 0 },
+	{ "txn_large",   setup_empty, op_txn_large, 0, 0, 0 },
+	{ "txn_backup",  setup_empty, op_txn_small, 0, 0, 1 },
+};
+
+static int dir_sizes[]  = { 16, 1024, 16384 };
+static int file_sizes[] = { 64, 4096, 1<<16, 1<<20 };
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Runner
+
+static void run_proc(Case *c, void *mem, Shared *shared, int proc, int dir_size, int file_size)
+{
+	CozyFS fs;
+	cozyfs_attach(&fs, mem, NULL, cozyfs_callback_impl, NULL);
+
+	Results *r = &shared->results[proc];
+	__atomic_add_fetch(&shared->ready, 1, __ATOMIC_SEQ_CST);
+	while (!shared->go);
+
+	u64 end = now_ns() + (u64) seconds * 1000000000;
+	for (u64 iter = 0;; iter++) {
+		u64 start = now_ns();
+		if (start >= end)
+			break;
+		int code = c->op(&fs, proc, iter, dir_size, file_size);
+		u64 elapsed = now_ns() - start;
+		if (code == -COZYFS_ENOMEM || code == -COZYFS_ENOENT)
+			break; // The arena filled up or the files ran out
+		if (code < 0) {
+			r->errors++;
+			continue;
+		}
+		record(&r->latency, elapsed);
+	}
+	_exit(0);
+}
+
+// Returns -1 if the case couldn't run or one of its processes didn't
+// exit cleanly, in which case no results are printed
+static int run_case(Case *c, void *mem, Shared *shared, int procs, int dir_size, int file_size)
+{
+	int code = cozyfs_init(mem, c->backup ? 2 * arena_len : arena_len, c->backup, 0);
+	if (code < 0) {
+		fprintf(stderr, "Error: Couldn't initialize the arena (error %d)\n", -code);
+		return -1;
+	}
+
+	CozyFS fs;
+	cozyfs_attach(&fs, mem, NULL, cozyfs_callback_impl, NULL);
+	num_procs = procs;
+	code = c->setup(&fs, procs, dir_size, file_size);
+	if (code < 0) {
+		fprintf(stderr, "Error: Couldn't set up %s (error %d)\n", c->name, -code);
+		return -1;
+	}
+
+	memset(shared, 0, sizeof(Shared));
+	pid_t pids[MAX_PROCS];
+	int started = 0;
+	for (int i = 0; i < procs; i++) {
+		pid_t pid = fork();
+		if (pid == 0)
+			run_proc(c, mem, shared, i, dir_size, file_size);
+		if (pid < 0)
+			break;
+		pids[started++] = pid;
+	}
+	while (shared->ready < started);
+
+	u64 start = now_ns();
+	shared->go = 1;
+	int crashed = 0;
+	for (int i = 0; i < started; i++) {
+		int status;
+		if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			if (!crashed && WIFSIGNALED(status))
+				fprintf(stderr, "Error: %s with %d processes failed (signal %d)\n", c->name, procs, WTERMSIG(status));
+			else if (!crashed)
+				fprintf(stderr, "Error: %s with %d processes failed\n", c->name, procs);
+			crashed = 1;
+		}
+	}
+	u64 elapsed = now_ns() - start;
+	if (crashed)
+		return -1;
+
+	Results total;
+	memset(&total, 0, sizeof(total));
+	for (int i = 0; i < started; i++) {
+		total.errors += shared->results[i].errors;
+		merge(&total.latency, &shared->results[i].latency);
+	}
+
+	printf("{\"op\":\"%s\",\"procs\":%d,\"dir_size\":%d,\"file_size\":%d,"
+		"\"ops\":%llu,\"errors\":%llu,\"ops_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu}\n",
+		c->name, started, dir_size, file_size, total.latency.count, total.errors,
+		total.latency.count * 1e9 / elapsed, percentile(&total.latency, 0.50), percentile(&total.latency, 0.99));
+	fflush(stdout);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-p") && i+1 < argc)
+			max_procs = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-t") && i+1 < argc)
+			seconds = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-m") && i+1 < argc)
+			arena_len = (u64) atoi(argv[++i]) << 20;
+		else if (!strcmp(argv[i], "-f") && i+1 < argc)
+			filter = argv[++i];
+		else {
+			fprintf(stderr, "Usage: %s [-p max_procs] [-t seconds_per_case] [-m arena_mb] [-f filter]\n", argv[0]);
+			return -1;
+		}
+	}
+	if (max_procs <= 0)
+		max_procs = sysconf(_SC_NPROCESSORS_ONLN);
+	max_procs = MIN(MAX(max_procs, 1), MAX_PROCS);
+
+	// The arena (twice as large with backups) and the results
+	// are shared by all processes of a case
+	void *mem = mmap(NULL, 2 * arena_len + sizeof(Shared), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		fprintf(stderr, "Error: Couldn't map the arena\n");
+		return -1;
+	}
+	Shared *shared = (Shared*) ((char*) mem + 2 * arena_len);
+
+	int failed = 0;
+	for (int i = 0; i < COUNT(cases); i++) {
+		Case *c = &cases[i];
+		if (filter && !strstr(c->name, filter))
+			continue;
+
+		// Powers of two, then the maximum
+		for (int procs = 1; procs <= max_procs; procs = (procs < max_procs) ? MIN(2 * procs, max_procs) : procs + 1) {
+
+			if (c->dir_sizes)
+				for (int j = 0; j < COUNT(dir_sizes); j++)
+					failed |= run_case(c, mem, shared, procs, MAX(dir_sizes[j], procs), 0);
+			else if (c->file_sizes)
+				for (int j = 0; j < COUNT(file_sizes); j++)
+					failed |= run_case(c, mem, shared, procs, procs, file_sizes[j]);
+			else
+				failed |= run_case(c, mem, shared, procs, 0, 0);
+		}
+	}
+	return failed ? 1 : 0;
+}
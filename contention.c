@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "cozyfs.h"
+#include "histogram.h"
+
+// Measures how the lock behaves when N processes share one arena.
+// Each process runs a weighted mix of plain operations. Wait and hold
+// times come from the lock statistics of the arena, while lock trace
+// events show the handoffs:
+//
+//   wait    From starting to wait for the lock to acquiring it
+//   hold    From acquiring the lock to releasing it
+//   handoff From a release to the acquisition by a process that was
+//           already waiting for it
+//
+// With -s, every critical section is stretched by spinning while the
+// lock is held. With -k, a process is killed while holding the lock
+// and the time until another one gets through is reported. Tickets
+// are in whole seconds and plain operations take the lock for
+// LOCK_TIMEOUT_SEC, so nearly all of it is waiting for the ticket to
+// expire (5 to 6 seconds) rather than restoring the backup. Output is
+// one JSON object per line, and runs where a process didn't exit
+// cleanly are reported as errors instead.
+//
+//   ./contention [-p max_procs] [-t seconds] [-m mix] [-s hold_us] [-k]
+//
+// The mix is a list like "stat:60,open:20,write:15,mkdir:5".
+
+#define COUNT(X) (int) (sizeof(X) / sizeof((X)[0]))
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
+
+#define MAX_PROCS 64
+#define ARENA_LEN (64ULL << 20)
+
+// How long plain operations hold a ticket, see enter_critical_section
+#define LOCK_TIMEOUT_SEC 5
+
+typedef struct {
+	u64       ops;
+	u64       errors;
+	Histogram handoff;
+} Results;
+
+typedef struct {
+	volatile int ready;
+	volatile int go;
+	volatile u64 released_at; // Last time the lock was released
+	volatile int holding;     // Set by the victim once it holds the lock
+	Results      results[MAX_PROCS];
+} Shared;
+
+// Passed to the callback of each process
+typedef struct {
+	Shared  *shared;
+	Results *results;
+	int      victim;
+} Worker;
+
+typedef enum {
+	OP_STAT,
+	OP_OPEN,
+	OP_WRITE,
+	OP_MKDIR,
+	OP_NOOP,
+} Op;
+
+static const char *op_names[] = { "stat", "open", "write", "mkdir", "noop" };
+
+static int max_procs = 0;
+static int seconds   = 1;
+static int hold_us   = 0;
+static int kill_test = 0;
+static int weights[COUNT(op_names)] = { 60, 20, 15, 5, 0 };
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Utilities
+
+// Bucket "i" of the arena's histograms holds values in [2^(i-1), 2^i)
+static u64 stats_percentile(const CozyFSHistogram *h, double p)
+{
+	u64 target = h->count * p;
+	u64 seen = 0;
+	for (int i = 0; i < COZYFS_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > target)
+			return i ? 1ULL << (i-1) : 0;
+	}
+	return 0;
+}
+
+static int parse_mix(char *src)
+{
+	memset(weights, 0, sizeof(weights));
+	for (char *item = strtok(src, ","); item; item = strtok(NULL, ",")) {
+		char *colon = strchr(item, ':');
+		if (colon == NULL)
+			return -1;
+		*colon = '\0';
+		int i = 0;
+		while (i < COUNT(op_names) && strcmp(op_names[i], item))
+			i++;
+		if (i == COUNT(op_names))
+			return -1;
+		weights[i] = atoi(colon + 1);
+	}
+	return 0;
+}
+
+static Op pick_op(unsigned int *seed)
+{
+	int total = 0;
+	for (int i = 0; i < COUNT(weights); i++)
+		total += weights[i];
+	if (total == 0)
+		return OP_NOOP;
+	int r = rand_r(seed) % total;
+	int i = 0;
+	while (r >= weights[i])
+		r -= weights[i++];
+	return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Workers
+
+static int run_op(CozyFS *fs, Op op, int proc, u64 iter)
+{
+	static char payload[256];
+	char path[64];
+	snprintf(path, sizeof(path), "/p%d", proc);
+
+	switch (op) {
+
+		case OP_STAT:
+		{
+			CozyFSStat buf;
+			return cozyfs_stat(fs, path, &buf);
+		}
+
+		case OP_OPEN:
+		{
+			int fd = cozyfs_create(fs, path);
+			if (fd < 0)
+				return fd;
+			return cozyfs_close(fs, fd);
+		}
+
+		case OP_WRITE:
+		{
+			int fd = cozyfs_create(fs, path);
+			if (fd < 0)
+				return fd;
+			int code = cozyfs_write(fs, fd, payload, sizeof(payload));
+			cozyfs_close(fs, fd);
+			return code;
+		}
+
+		case OP_MKDIR:
+		{
+			snprintf(path, sizeof(path), "/d%d_%llu", proc, iter);
+			return cozyfs_mkdir(fs, path);
+		}
+
+		case OP_NOOP:
+		break;
+	}
+	return 0;
+}
+
+static void spin_until(u64 deadline)
+{
+	while (now_ns() < deadline);
+}
+
+// Lock events are reported by the process taking or releasing
+// the lock, while it holds it
+static u64 worker_callback(int sysop, void *userptr, void *p, int n)
+{
+	if (sysop != COZYFS_SYSOP_TRACE)
+		return cozyfs_callback_impl(sysop, userptr, p, n);
+
+	CozyFSTraceEvent *event = p;
+	if (event == NULL)
+		return 1; // Ask for events
+
+	Worker *w = userptr;
+	switch (event->type) {
+
+		case COZYFS_TRACE_LOCK_ACQUIRE:
+		{
+			if (w->victim) {
+				w->shared->holding = 1;
+				for (;;)
+					pause();
+			}
+
+			// Only releases that happened while this process
+			// was waiting are handoffs
+			u64 released = w->shared->released_at;
+			if (released > event->time - event->value && released <= event->time)
+				record(&w->results->handoff, event->time - released);
+
+			if (hold_us > 0)
+				spin_until(now_ns() + (u64) hold_us * 1000);
+		}
+		break;
+
+		case COZYFS_TRACE_LOCK_RELEASE:
+		w->shared->released_at = event->time;
+		break;
+	}
+	return 0;
+}
+
+static void run_worker(void *mem, Shared *shared, int proc)
+{
+	Worker w = { shared, &shared->results[proc], 0 };
+
+	CozyFS fs;
+	cozyfs_attach(&fs, mem, NULL, worker_callback, &w);
+
+	Results *r = w.results;
+	unsigned int seed = proc + 1;
+
+	__atomic_add_fetch(&shared->ready, 1, __ATOMIC_SEQ_CST);
+	while (!shared->go);
+
+	u64 end = now_ns() + (u64) seconds * 1000000000;
+	for (u64 iter = 0; now_ns() < end; iter++) {
+		int code = run_op(&fs, pick_op(&seed), proc, iter);
+		if (code < 0)
+			r->errors++;
+		else
+			r->ops++;
+	}
+	_exit(0);
+}
+
+// Takes the lock with a plain operation and waits
+// to be killed while holding it
+static void run_victim(void *mem, Shared *shared)
+{
+	Worker w = { shared, &shared->results[0], 1 };
+
+	CozyFS fs;
+	cozyfs_attach(&fs, mem, NULL, worker_callback, &w);
+
+	CozyFSStat buf;
+	cozyfs_stat(&fs, "/", &buf);
+	for (;;)
+		pause();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Runner
+
+static void print_histogram(const char *name, const Histogram *h)
+{
+	printf(",\"%s_p50_ns\":%llu,\"%s_p99_ns\":%llu", name, percentile(h, 0.50), name, percentile(h, 0.99));
+}
+
+static void print_stats_histogram(const char *name, const CozyFSHistogram *h)
+{
+	printf(",\"%s_p50_ns\":%llu,\"%s_p99_ns\":%llu", name, stats_percentile(h, 0.50), name, stats_percentile(h, 0.99));
+}
+
+static int run_scaling(void *mem, Shared *shared, int procs)
+{
+	int code = cozyfs_init(mem, ARENA_LEN, 0, 0);
+	if (code < 0) {
+		fprintf(stderr, "Error: Couldn't initialize the arena (error %d)\n", -code);
+		return -1;
+	}
+	memset(shared, 0, sizeof(Shared));
+
+	pid_t pids[MAX_PROCS];
+	int started = 0;
+	for (int i = 0; i < procs; i++) {
+		pid_t pid = fork();
+		if (pid == 0)
+			run_worker(mem, shared, i);
+		if (pid < 0)
+			break;
+		pids[started++] = pid;
+	}
+	while (shared->ready < started);
+
+	u64 start = now_ns();
+	shared->go = 1;
+	int crashed = 0;
+	for (int i = 0; i < started; i++) {
+		int status;
+		if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			crashed = 1;
+	}
+	u64 elapsed = now_ns() - start;
+	if (crashed) {
+		fprintf(stderr, "Error: A process of the run with %d processes didn't exit cleanly\n", procs);
+		return -1;
+	}
+
+	Results total;
+	memset(&total, 0, sizeof(total));
+	for (int i = 0; i < started; i++) {
+		total.ops    += shared->results[i].ops;
+		total.errors += shared->results[i].errors;
+		merge(&total.handoff, &shared->results[i].handoff);
+	}
+
+	// The arena is fresh, so its statistics only cover this run
+	CozyFS fs;
+	cozyfs_attach(&fs, mem, NULL, cozyfs_callback_impl, NULL);
+	static CozyFSStats stats;
+	if (cozyfs_stats(&fs, &stats) < 0) {
+		fprintf(stderr, "Error: The arena has no statistics\n");
+		return -1;
+	}
+
+	printf("{\"procs\":%d,\"ops\":%llu,\"errors\":%llu,\"ops_per_sec\":%.0f,\"handoffs\":%llu",
+		started, total.ops, total.errors, total.ops * 1e9 / elapsed, total.handoff.count);
+	print_stats_histogram("wait", &stats.lock_wait);
+	print_stats_histogram("hold", &stats.lock_hold);
+	print_histogram("handoff", &total.handoff);
+	printf("}\n");
+	fflush(stdout);
+	return 0;
+}
+
+// The survivor uses a plain operation, since those restore the
+// backup when they find the lock was abandoned
+static int run_kill(void *mem, Shared *shared)
+{
+	int code = cozyfs_init(mem, 2 * ARENA_LEN, 1, 0);
+	if (code < 0) {
+		fprintf(stderr, "Error: Couldn't initialize the arena (error %d)\n", -code);
+		return -1;
+	}
+	memset(shared, 0, sizeof(Shared));
+
+	pid_t victim = fork();
+	if (victim == 0)
+		run_victim(mem, shared);
+	if (victim < 0)
+		return -1;
+	while (!shared->holding);
+
+	kill(victim, SIGKILL);
+	int status;
+	if (waitpid(victim, &status, 0) < 0 || !WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL) {
+		fprintf(stderr, "Error: The victim exited before it was killed\n");
+		return -1;
+	}
+	u64 killed = now_ns();
+
+	CozyFS fs;
+	cozyfs_attach(&fs, mem, NULL, cozyfs_callback_impl, NULL);
+	CozyFSStat buf;
+	code = cozyfs_stat(&fs, "/", &buf);
+	u64 recovered = now_ns();
+
+	if (code < 0) {
+		fprintf(stderr, "Error: The survivor failed after the crash (error %d)\n", -code);
+		return -1;
+	}
+
+	printf("{\"crash_recovery_ns\":%llu,\"lock_timeout_sec\":%d,\"lock_granularity_sec\":1}\n",
+		recovered - killed, LOCK_TIMEOUT_SEC);
+	fflush(stdout);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-p") && i+1 < argc)
+			max_procs = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-t") && i+1 < argc)
+			seconds = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-s") && i+1 < argc)
+			hold_us = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-m") && i+1 < argc) {
+			if (parse_mix(argv[++i]) < 0) {
+				fprintf(stderr, "Error: Invalid mix\n");
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "-k"))
+			kill_test = 1;
+		else {
+			fprintf(stderr, "Usage: %s [-p max_procs] [-t seconds] [-m mix] [-s hold_us] [-k]\n", argv[0]);
+			return -1;
+		}
+	}
+	if (max_procs <= 0)
+		max_procs = sysconf(_SC_NPROCESSORS_ONLN);
+	max_procs = MIN(MAX(max_procs, 1), MAX_PROCS);
+
+	void *mem = mmap(NULL, 2 * ARENA_LEN + sizeof(Shared), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		fprintf(stderr, "Error: Couldn't map the arena\n");
+		return -1;
+	}
+	Shared *shared = (Shared*) ((char*) mem + 2 * ARENA_LEN);
+
+	// Powers of two, then the maximum
+	int failed = 0;
+	for (int procs = 1; procs <= max_procs; procs = (procs < max_procs) ? MIN(2 * procs, max_procs) : procs + 1)
+		if (run_scaling(mem, shared, procs) < 0)
+			failed = 1;
+
+	if (kill_test && run_kill(mem, shared) < 0)
+		failed = 1;
+	return failed ? 1 : 0;
+}
@@ -55,7 +55,7 @@ typedef long long          s64;
 
 #define COUNT(X) ((int) (sizeof(X)/sizeof((X)[0])))
 
-#define OFFSETOF(TYPE, MEMBER) (((TYPE*) 0)->MEMBER)
+#define OFFSETOF(TYPE, MEMBER) ((unsigned long) &((TYPE*) 0)->MEMBER)
 #define MEMBER_SIZEOF(TYPE, MEMBER) sizeof(((TYPE*) 0)->MEMBER)
 
 #define ASSERT(X) if (!(X)) __builtin_trap();
@@ -70,9 +70,14 @@ typedef u32 Offset;
 
 #define INVALID_OFFSET ((Offset) -1LL)
 
+// Statistics slots shared by all processes, see cozyfs_stats
+#define STATS_SLOTS 8
+STATIC_ASSERT(sizeof(CozyFSStats) % sizeof(u64) == 0);
+
 enum {
 	ENTITY_DIR = 1 << 0,
 	ENTITY_FILE = 1 << 1,
+	ENTITY_KEPT = 1 << 2, // Removed directory whose pages still hold entities in use
 };
 
 enum {
@@ -103,11 +108,14 @@ typedef struct {
 	u32    owner;
 	u16    head_start;
 	u16    tail_end;
+	u32    size;
+	u32    gen;   // Changes whenever the contents do
+	u32    mtime; // Seconds since the epoch
 } Entity;
-STATIC_ASSERT(sizeof(Entity) == 24);
+STATIC_ASSERT(sizeof(Entity) == 36);
 
 // 4072
-// 24+132=156
+// 36+132=168
 
 typedef struct {
 
@@ -121,15 +129,18 @@ typedef struct {
 	Offset prev;
 	Offset next;
 
+	// Entity of the directory the page belongs to
+	Offset dir;
+
 	// List of links for this directory
-	Link links[26];
+	Link links[24];
 
 	// List of entities. This may or may not be associated
 	// to the directory
-	Entity ents[26];
+	Entity ents[24];
 
 	// Make sure the page struct is 4K
-	char pad[16];
+	char pad[36];
 
 } DPage;
 STATIC_ASSERT(sizeof(DPage) == 4096);
@@ -151,12 +162,19 @@ typedef struct {
 	u16    gen;
 	Offset entity;
 	Offset cursor;
+
+	// Page holding the byte at the cursor and how many of its
+	// bytes come before it. Sequential reads resume from here
+	// instead of walking the page list from the start.
+	Offset cursor_page;
+	u16    cursor_skip;
 } Handle;
-STATIC_ASSERT(sizeof(Handle) == 12);
+STATIC_ASSERT(sizeof(Handle) == 20);
 
 typedef struct {
 	Offset next;
-	Handle handles[341];
+	Handle handles[204];
+	char   pad[12];
 } HPage;
 STATIC_ASSERT(sizeof(HPage) == 4096);
 
@@ -181,11 +199,16 @@ typedef struct {
 	u32 gen;
 
 	volatile u64 lock;
+	volatile u64 changes; // Bumped when a critical section that modified the file system ends
+	volatile u64 stats_next_slot;
+	Offset       stats; // Past the arena and its backup, so never restored
+	int          stats_slots;
 	volatile int backup; // All volatile fields must come before "backup"
 
 	u64 last_backup_time;
 
 	u32 next_account_id;
+	u32 next_entity_gen;
 
 	Offset dpages;
 	Offset hpages;
@@ -201,17 +224,35 @@ typedef struct {
 
 	Entity root;
 
-	Handle handles[333];
-
-	char pad[8];
+	Handle handles[198];
+	int    num_free_pages; // Pages in the "free_pages" list
 } RPage;
 STATIC_ASSERT(sizeof(RPage) == 4096);
 
+// Free pages are linked through the same field as file pages, so that
+// the pages of a file can join the free list as a whole chain
 typedef struct {
+	u32    pad0[2];
 	Offset next;
-	char   pad[4092];
+	char   pad1[4084];
 } XPage;
 STATIC_ASSERT(sizeof(XPage) == 4096);
+STATIC_ASSERT(OFFSETOF(XPage, next) == OFFSETOF(FPage, next));
+
+#define INSPECT_MAX_PATH  4096
+#define INSPECT_MAX_DEPTH 256
+
+typedef struct {
+	CozyFSReport          *report;
+	cozyfs_report_callback visit;
+	void                  *userptr;
+	int                    path_len;
+	char                   path[INSPECT_MAX_PATH];
+
+	// Directories being walked, to detect loops in corrupted arenas
+	int                    depth;
+	const Entity          *ancestors[INSPECT_MAX_DEPTH];
+} Inspection;
 
 ////////////////////////////////////////////////////////////////////////
 // FILE OVERVIEW
@@ -225,6 +266,7 @@ static int          memeq               (const void *p1, const void *p2, int len
 // Atomic operations
 static u64           atomic_load        (volatile u64 *ptr);
 static void          atomic_store       (volatile u64 *ptr, u64 val);
+static u64           atomic_add         (volatile u64 *ptr, u64 val);
 static int           atomic_compare_exchange(volatile u64 *ptr, u64 expect, u64 new_value);
 static u64           load               (u64 *ptr);
 static void          fence              (void);
@@ -239,6 +281,8 @@ static int           sys_wait           (CozyFS *fs, u64 *word, u64 old_word, in
 static int           sys_wake           (CozyFS *fs, u64 *word);
 static int           sys_sync           (CozyFS *fs);
 static u64           sys_time           (CozyFS *fs);
+static u64           sys_clock          (CozyFS *fs);
+static void          sys_trace          (CozyFS *fs, int type, int op, int code, u64 value, u64 time, const CozyFSTraceArgs *args);
 
 // Relative pointer management
 static const RPage*  get_root           (CozyFS *fs);
@@ -247,10 +291,16 @@ static Offset        ptr2off            (CozyFS *fs, const void *ptr);
 static void*         writable_addr      (CozyFS *fs, const void *ptr);
 
 // Directory and file management
-static Entity*       find_unused_entity (CozyFS *fs);
+static const Entity* find_unused_entity (CozyFS *fs, const Entity *dir);
+static DPage*        append_dpage       (CozyFS *fs, const Entity *dir);
+static int           free_pages         (CozyFS *fs, const Entity *entity);
 static int           free_entity        (CozyFS *fs, const Entity *entity);
+static int           holds_entities     (CozyFS *fs, const Entity *dir);
+static int           release_entity     (CozyFS *fs, const Entity *entity);
 static const Entity* find_entity        (CozyFS *fs, const Entity *parent, string name);
 static int           create_entity      (CozyFS *fs, const Entity *parent, const Entity *target, string name, u32 flags);
+static int           touch_entity       (CozyFS *fs, Entity *writable_entity);
+static void          note_change        (CozyFS *fs);
 static int           remove_entity      (CozyFS *fs, const Entity *parent, string name, u32 flags);
 
 // User management
@@ -260,6 +310,7 @@ static int           remove_user        (CozyFS *fs, const char *name);
 
 // File system functions
 static int           parse_path         (string path, string *comps, int max);
+static int           resolve_path       (CozyFS *fs, const char *path, const Entity **entity);
 static int           pack_fd            (CozyFS *fs, const Handle *handle);
 static const Handle* unpack_fd          (CozyFS *fs, int fd);
 static int           link_              (CozyFS *fs, const char *oldpath, const char *newpath);
@@ -270,10 +321,22 @@ static int           mkusr              (CozyFS *fs, const char *name);
 static int           rmusr              (CozyFS *fs, const char *name);
 static int           chown_             (CozyFS *fs, const char *path, const char *new_owner);
 static int           chmod_             (CozyFS *fs, const char *path, int mode);
+static int           open_entity        (CozyFS *fs, const Entity *entity);
 static int           open_              (CozyFS *fs, const char *path);
+static int           create_            (CozyFS *fs, const char *path);
 static int           close_             (CozyFS *fs, int fd);
 static string        fpage_bytes        (const Entity *entity, const FPage *fpage);
+static const FPage*  seek_fpage         (CozyFS *fs, const Handle *handle, const Entity *entity, Offset cursor, int *skip);
+static int           advance_cursor     (CozyFS *fs, const Handle *handle, Offset advance, const FPage *fpage, int skip);
 static int           read_              (CozyFS *fs, int fd, void       *dst, int max);
+static int           read_spans_        (CozyFS *fs, int fd, CozyFSSpan *spans, int max);
+static int           read_path_         (CozyFS *fs, const char *path, void *dst, int max);
+static int           seek_              (CozyFS *fs, int fd, unsigned int offset);
+static void          stat_entity        (CozyFS *fs, const Entity *entity, CozyFSStat *buf);
+static int           fstat_             (CozyFS *fs, int fd, CozyFSStat *buf);
+static int           stat_              (CozyFS *fs, const char *path, CozyFSStat *buf);
+static int           count_links        (const DPage *dpage);
+static int           readdir_           (CozyFS *fs, const char *path, unsigned int *cursor, CozyFSDirEntry *entries, int max);
 static int           write_             (CozyFS *fs, int fd, const void *src, int num);
 
 // File system lock
@@ -282,9 +345,22 @@ static int           unlock             (CozyFS *fs);
 static int           refresh_lock       (CozyFS *fs, int postpone_sec);
 
 // Backup
+static void          copy_half          (RPage *dst, const RPage *src);
 static void          perform_backup     (CozyFS *fs, int not_before_sec);
 static int           restore_backup     (CozyFS *fs);
 
+// Statistics
+static void          hist_add           (CozyFSHistogram *hist, u64 value);
+static u64           stats_begin        (CozyFS *fs, int op, const CozyFSTraceArgs *args);
+static int           stats_end          (CozyFS *fs, int op, u64 start, int code);
+
+// Inspection
+static int           valid_page         (CozyFS *fs, Offset off);
+static int           inspect_chain      (CozyFS *fs, Offset head, int next_field, int *count);
+static int           inspect_file       (CozyFS *fs, Inspection *ins, const Entity *file);
+static int           inspect_dir        (CozyFS *fs, Inspection *ins, const Entity *dir);
+static int           inspect_           (CozyFS *fs, CozyFSReport *report, cozyfs_report_callback visit, void *userptr);
+
 // Public and thread-safe interface
 static int           enter_critical_section(CozyFS *fs, int wait_timeout_ms);
 static void          leave_critical_section(CozyFS *fs);
@@ -298,12 +374,23 @@ int                  cozyfs_rmdir       (CozyFS *fs, const char *path);
 int                  cozyfs_mkusr       (CozyFS *fs, const char *name);
 int                  cozyfs_rmusr       (CozyFS *fs, const char *name);
 int                  cozyfs_open        (CozyFS *fs, const char *path);
+int                  cozyfs_create      (CozyFS *fs, const char *path);
 int                  cozyfs_close       (CozyFS *fs, int fd);
 int                  cozyfs_read        (CozyFS *fs, int fd, void       *dst, int max);
+int                  cozyfs_read_spans  (CozyFS *fs, int fd, CozyFSSpan *spans, int max);
+int                  cozyfs_seek        (CozyFS *fs, int fd, unsigned int offset);
+int                  cozyfs_fstat       (CozyFS *fs, int fd, CozyFSStat *buf);
+int                  cozyfs_stat        (CozyFS *fs, const char *path, CozyFSStat *buf);
+int                  cozyfs_readdir     (CozyFS *fs, const char *path, unsigned int *cursor, CozyFSDirEntry *entries, int max);
 int                  cozyfs_write       (CozyFS *fs, int fd, const void *src, int num);
+int                  cozyfs_stats       (CozyFS *fs, CozyFSStats *stats);
+int                  cozyfs_usage       (CozyFS *fs, CozyFSUsage *usage);
+int                  cozyfs_inspect     (CozyFS *fs, CozyFSReport *report, cozyfs_report_callback visit, void *userptr);
 int                  cozyfs_transaction_begin   (CozyFS *fs);
 int                  cozyfs_transaction_commit  (CozyFS *fs);
 int                  cozyfs_transaction_rollback(CozyFS *fs);
+unsigned long long   cozyfs_changes     (CozyFS *fs);
+int                  cozyfs_wait_change (CozyFS *fs, unsigned long long seen, int timeout_ms);
 
 ////////////////////////////////////////////////////////////////////////
 // Basic utilities
@@ -362,6 +449,16 @@ static void atomic_store(volatile u64 *ptr, u64 val)
 #endif
 }
 
+// Returns the previous value
+static u64 atomic_add(volatile u64 *ptr, u64 val)
+{
+#if COMPILER_MSVC
+	return _InterlockedExchangeAdd64((volatile s64*) ptr, val);
+#elif COMPILER_GCC || COMPILER_CLANG
+	return __atomic_fetch_add(ptr, val, __ATOMIC_RELAXED);
+#endif
+}
+
 static int atomic_compare_exchange(volatile u64 *ptr, u64 expect, u64 new_value)
 {
 #if COMPILER_MSVC
@@ -430,7 +527,8 @@ static int sys_free(CozyFS *fs, void *ptr, int len)
 
 static int sys_wait(CozyFS *fs, u64 *word, u64 old_word, int timeout_ms)
 {
-	int code = fs->callback(COZYFS_SYSOP_WAIT, fs->userptr, ???);
+	CozyFSWait wait = { word, old_word, timeout_ms };
+	int code = fs->callback(COZYFS_SYSOP_WAIT, fs->userptr, &wait, sizeof(wait));
 	if (code != COZYFS_SYSRES_OK)
 		return -COZYFS_ESYSWAIT;
 	return COZYFS_OK;
@@ -438,7 +536,7 @@ static int sys_wait(CozyFS *fs, u64 *word, u64 old_word, int timeout_ms)
 
 static int sys_wake(CozyFS *fs, u64 *word)
 {
-	int code = fs->callback(COZYFS_SYSOP_WAKE, fs->userptr, ???);
+	int code = fs->callback(COZYFS_SYSOP_WAKE, fs->userptr, word, 0);
 	if (code != COZYFS_SYSRES_OK)
 		return -COZYFS_ESYSWAKE;
 	return COZYFS_OK;
@@ -456,16 +554,25 @@ static u64 sys_time(CozyFS *fs)
 	return fs->callback(COZYFS_SYSOP_TIME, fs->userptr, NULL, 0);
 }
 
+static u64 sys_clock(CozyFS *fs)
+{
+	return fs->callback(COZYFS_SYSOP_CLOCK, fs->userptr, NULL, 0);
+}
+
+// Only called when "fs->trace" is set
+static void sys_trace(CozyFS *fs, int type, int op, int code, u64 value, u64 time, const CozyFSTraceArgs *args)
+{
+	CozyFSTraceEvent event = { type, op, code, value, time, args };
+	fs->callback(COZYFS_SYSOP_TRACE, fs->userptr, &event, sizeof(event));
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Relative pointer management
 
-// TODO: Use this instead of accessing the root page directly
+// Returns the root page, or its patch during transactions
 static const RPage *get_root(CozyFS *fs)
 {
-	const RPage *root = fs->mem;
-	if (root->backup == BACKUP_HALF_INACTIVE)
-		root += root->tot_pages;
-	return root;
+	return off2ptr(fs, 0);
 }
 
 static const void *off2ptr(CozyFS *fs, Offset off)
@@ -501,14 +608,18 @@ static void *writable_addr(CozyFS *fs, const void *ptr)
 {
 	if (fs->transaction != TRANSACTION_OFF) {
 
-		// If we already have a patch for this pointer, return it
-		int i = 0;
-		while (i < fs->patch_count && (fs->patch_ptrs[i] > ptr || fs->patch_ptrs[i] + 4096 <= ptr))
-			i++;
+		// Pointers into a patch are already writable
+		for (int i = 0; i < fs->patch_count; i++)
+			if ((char*) ptr >= (char*) fs->patch_ptrs[i] && (char*) ptr < (char*) fs->patch_ptrs[i] + 4096)
+				return (void*) ptr; // Unconst the pointer
 
-		// Patch found. Return the pointer as-is
-		if (i < fs->patch_count)
-			return (void*) ptr; // Unconst the pointer
+		// The page may have been copied after the pointer
+		// was taken, in which case the copy is returned
+		Offset byte_off = ((char*) ptr - (char*) fs->mem) & (4096 - 1);
+		Offset page_off = ((char*) ptr - (char*) fs->mem) - byte_off;
+		for (int i = 0; i < fs->patch_count; i++)
+			if (fs->patch_offs[i] == page_off)
+				return (char*) fs->patch_ptrs[i] + byte_off;
 
 		// We need to create a new patch
 		if (fs->patch_count == COUNT(fs->patch_offs))
@@ -520,17 +631,18 @@ static void *writable_addr(CozyFS *fs, const void *ptr)
 			return NULL;
 
 		// Copy the page
-		Offset byte_off = (ptr - fs->mem) & (4096 - 1);
-		void  *page_ptr = ptr - byte_off;
-
+		void *page_ptr = (char*) fs->mem + page_off;
 		my_memcpy(page_copy, page_ptr, 4096);
 
 		// Make the patch
 		fs->patch_ptrs[fs->patch_count] = page_copy;
-		fs->patch_offs[fs->patch_count] = byte_off;
+		fs->patch_offs[fs->patch_count] = page_off;
 		fs->patch_count++;
 
-		ptr = page_copy + byte_off;
+		if (fs->trace)
+			sys_trace(fs, COZYFS_TRACE_PATCH, -1, 0, page_off, sys_clock(fs), NULL);
+
+		ptr = (char*) page_copy + byte_off;
 	}
 
 	return (void*) ptr;
@@ -539,12 +651,102 @@ static void *writable_addr(CozyFS *fs, const void *ptr)
 ////////////////////////////////////////////////////////////////////////
 // Directory and file management
 
-static Entity *find_unused_entity(CozyFS *fs)
+// Returns an entity slot of "dir" that isn't used by anything
+static const Entity *find_unused_entity(CozyFS *fs, const Entity *dir)
 {
-	// First, look in the already modified pages
-	for (int i = 0; i < fs->patch_count; i++) {
-		// TODO
+	const DPage *dpage = off2ptr(fs, dir->head);
+	while (dpage) {
+		for (int i = 0; i < COUNT(dpage->ents); i++)
+			if (dpage->ents[i].refs == 0 && (dpage->ents[i].flags & ENTITY_KEPT) == 0)
+				return &dpage->ents[i];
+		dpage = off2ptr(fs, dpage->next);
+	}
+	return NULL;
+}
+
+// Appends an empty page to the page list of "dir"
+static DPage *append_dpage(CozyFS *fs, const Entity *dir)
+{
+	Entity *writable_dir = writable_addr(fs, dir);
+	if (writable_dir == NULL)
+		return NULL;
+
+	// Get the tail before allocating so that
+	// a failure doesn't lose the new page
+	DPage *writable_tail = NULL;
+	if (writable_dir->tail != INVALID_OFFSET) {
+		writable_tail = writable_addr(fs, off2ptr(fs, writable_dir->tail));
+		if (writable_tail == NULL)
+			return NULL;
+	}
+
+	DPage *dpage = allocate_page(fs);
+	if (dpage == NULL)
+		return NULL;
+
+	my_memset(dpage, 0, sizeof(DPage));
+	dpage->global_prev = INVALID_OFFSET;
+	dpage->global_next = INVALID_OFFSET;
+	dpage->prev = writable_dir->tail;
+	dpage->next = INVALID_OFFSET;
+	dpage->dir  = ptr2off(fs, writable_dir);
+	for (int i = 0; i < COUNT(dpage->links); i++)
+		dpage->links[i].off = INVALID_OFFSET;
+
+	Offset off = ptr2off(fs, dpage);
+	if (writable_tail)
+		writable_tail->next = off;
+	else
+		writable_dir->head = off;
+	writable_dir->tail = off;
+	return dpage;
+}
+
+// Returns the pages of a file, or of a directory whose entity slots
+// are no longer used, to the free list. The pages of a file are already
+// linked the way free pages are, so only the last one is written. That
+// keeps freeing a large file within a transaction from using a patch
+// per page.
+static int free_pages(CozyFS *fs, const Entity *entity)
+{
+	if (entity->flags & ENTITY_DIR) {
+		const DPage *dpage = off2ptr(fs, entity->head);
+		while (dpage) {
+			Offset next = dpage->next;
+
+			RPage *writable_root  = writable_addr(fs, get_root(fs));
+			XPage *writable_xpage = writable_addr(fs, dpage);
+			if (writable_root == NULL || writable_xpage == NULL)
+				return -COZYFS_ENOMEM;
+
+			writable_xpage->next = writable_root->free_pages;
+			writable_root->free_pages = ptr2off(fs, writable_xpage);
+			writable_root->num_free_pages++;
+
+			dpage = off2ptr(fs, next);
+		}
+		return COZYFS_OK;
+	}
+
+	const FPage *tail = off2ptr(fs, entity->head);
+	if (tail == NULL)
+		return COZYFS_OK;
+
+	int count = 1;
+	while (tail->next != INVALID_OFFSET) {
+		tail = off2ptr(fs, tail->next);
+		count++;
 	}
+
+	RPage *writable_root = writable_addr(fs, get_root(fs));
+	FPage *writable_tail = writable_addr(fs, tail);
+	if (writable_root == NULL || writable_tail == NULL)
+		return -COZYFS_ENOMEM;
+
+	writable_tail->next = writable_root->free_pages;
+	writable_root->free_pages = entity->head;
+	writable_root->num_free_pages += count;
+	return COZYFS_OK;
 }
 
 static int free_entity(CozyFS *fs, const Entity *entity)
@@ -557,13 +759,70 @@ static int free_entity(CozyFS *fs, const Entity *entity)
 	if (writable_entity->refs > 0)
 		return COZYFS_OK;
 
-	// TODO
+	return release_entity(fs, writable_entity);
+}
+
+// Returns 1 if the pages of "dir" hold entities that are still in use
+static int holds_entities(CozyFS *fs, const Entity *dir)
+{
+	const DPage *dpage = off2ptr(fs, dir->head);
+	while (dpage) {
+		for (int i = 0; i < COUNT(dpage->ents); i++)
+			if (dpage->ents[i].refs > 0 || (dpage->ents[i].flags & ENTITY_KEPT))
+				return 1;
+		dpage = off2ptr(fs, dpage->next);
+	}
+	return 0;
+}
+
+// Frees the pages of an entity nothing refers to anymore. Directories
+// are only removed when empty, but their pages may still hold entities
+// linked from somewhere else, in which case they are kept until the
+// last of those is released.
+static int release_entity(CozyFS *fs, const Entity *entity)
+{
+	Offset entity_off = ptr2off(fs, entity);
+
+	if ((entity->flags & ENTITY_DIR) && holds_entities(fs, entity)) {
+		Entity *writable_entity = writable_addr(fs, entity);
+		if (writable_entity == NULL)
+			return -COZYFS_ENOMEM;
+		writable_entity->flags |= ENTITY_KEPT;
+		return COZYFS_OK;
+	}
 
+	int code = free_pages(fs, entity);
+	if (code != COZYFS_OK)
+		return code;
+
+	Entity *writable_entity = writable_addr(fs, off2ptr(fs, entity_off));
+	if (writable_entity == NULL)
+		return -COZYFS_ENOMEM;
+	writable_entity->flags &= ~ENTITY_KEPT;
+	writable_entity->head = INVALID_OFFSET;
+	writable_entity->tail = INVALID_OFFSET;
+	writable_entity->head_start = 0;
+	writable_entity->tail_end = 0;
+	writable_entity->size = 0;
+
+	// The root entity isn't in a directory page
+	Offset page_off = entity_off & ~(Offset) (4096-1);
+	if (page_off == 0)
+		return COZYFS_OK;
+
+	// Release the removed directory this was the last entity of
+	const DPage *home = off2ptr(fs, page_off);
+	const Entity *dir = off2ptr(fs, home->dir);
+	if (dir->refs == 0 && (dir->flags & ENTITY_KEPT))
+		return release_entity(fs, dir);
 	return COZYFS_OK;
 }
 
 static const Entity *find_entity(CozyFS *fs, const Entity *parent, string name)
 {
+	if ((parent->flags & ENTITY_DIR) == 0)
+		return NULL;
+
 	const DPage *dpage = off2ptr(fs, parent->head);
 	while (dpage) {
 
@@ -582,28 +841,46 @@ static const Entity *find_entity(CozyFS *fs, const Entity *parent, string name)
 	return NULL;
 }
 
+// Links "target" in "parent" with the given name, or a new
+// empty entity when "target" is NULL. Pages are appended to
+// the directory when it has no free link or entity slot.
 static int create_entity(CozyFS *fs, const Entity *parent, const Entity *target, string name, u32 flags)
 {
-	if (name.size > MAX_NAME)
-		return -COZYFS_EINVAL;
+	if (name.size == 0 || name.size >= (int) MAX_NAME)
+		return -COZYFS_ENAMETOOLONG;
 
-	// TODO: Check that the entity is a directory
+	if ((parent->flags & ENTITY_DIR) == 0)
+		return -COZYFS_ENOTDIR;
 
-	const Entity *entity = find_entity(fs, parent, name);
-	if (entity) {
-		// TODO: Entity exists already
-	}
+	if (find_entity(fs, parent, name))
+		return -COZYFS_EEXIST;
 
-	// TODO: Check if the directory is empty
+	// Writes to the parent may move it to a patch, so
+	// it's looked up again through its offset
+	Offset parent_off = ptr2off(fs, parent);
 
-	const DPage *tail = off2ptr(fs, parent->tail);
+	Entity *ent = NULL;
+	if (target == NULL) {
+		const Entity *unused = find_unused_entity(fs, parent);
+		if (unused == NULL) {
+			DPage *dpage = append_dpage(fs, parent);
+			if (dpage == NULL)
+				return -COZYFS_ENOMEM;
+			unused = &dpage->ents[0];
+		}
+		ent = writable_addr(fs, unused);
+		if (ent == NULL)
+			return -COZYFS_ENOMEM;
+		parent = off2ptr(fs, parent_off);
+	}
 
-	int i = 0;
-	while (i < COUNT(tail->links) && tail->links[i].off != INVALID_OFFSET)
-		i++;
-	
+	const DPage *tail = off2ptr(fs, parent->tail);
+	int i = tail ? count_links(tail) : COUNT(tail->links);
 	if (i == COUNT(tail->links)) {
-		// TODO: Tail is full
+		tail = append_dpage(fs, parent);
+		if (tail == NULL)
+			return -COZYFS_ENOMEM;
+		i = 0;
 	}
 
 	DPage *writable_tail = writable_addr(fs, tail);
@@ -617,41 +894,68 @@ static int create_entity(CozyFS *fs, const Entity *parent, const Entity *target,
 			return -COZYFS_ENOMEM;
 
 		writable_target->refs++;
-		writable_tail->links[i].off = ptr2off(fs, target);
+		writable_tail->links[i].off = ptr2off(fs, writable_target);
 
 	} else {
-		int j = 0;
-		while (j < COUNT(writable_tail->ents) && writable_tail->ents[j].refs > 0)
-			j++;
-
-		Entity *ent;
-		if (j == COUNT(writable_tail->ents)) {
-			// TODO: Current dpage is full of entities. Find them somewhere else
-			ent = find_unused_entity(fs);
-			if (ent == NULL)
-				return -COZYFS_ENOMEM;
-		} else {
-			ent = &writable_tail->ents[j];
-		}
 
-		writable_tail->links[i].off = ptr2off(fs, ent);
+		// The entity may live in the tail page, which
+		// could have been copied after "ent" was
+		ent = writable_addr(fs, ent);
+		if (ent == NULL)
+			return -COZYFS_ENOMEM;
 
 		ent->refs = 1;
+		ent->flags = flags;
 		ent->head = INVALID_OFFSET;
 		ent->tail = INVALID_OFFSET;
+		ent->owner = 0;
 		ent->head_start = 0;
 		ent->tail_end = 0;
+		ent->size = 0;
+
+		int code = touch_entity(fs, ent);
+		if (code != COZYFS_OK)
+			return code;
+
+		writable_tail->links[i].off = ptr2off(fs, ent);
 	}
 
 	my_memset(writable_tail->links[i].name, 0, MAX_NAME);
 	my_memcpy(writable_tail->links[i].name, name.data, name.size);
 
+	Entity *writable_parent = writable_addr(fs, off2ptr(fs, parent_off));
+	if (writable_parent == NULL)
+		return -COZYFS_ENOMEM;
+	return touch_entity(fs, writable_parent);
+}
+
+// Marks the entity as modified. Generations are drawn from a
+// counter shared by all entities, so an entity reusing the slot
+// of a removed one never repeats its generation.
+static int touch_entity(CozyFS *fs, Entity *writable_entity)
+{
+	RPage *writable_root = writable_addr(fs, fs->mem);
+	if (writable_root == NULL)
+		return -COZYFS_ENOMEM;
+
+	writable_entity->gen = ++writable_root->next_entity_gen;
+	writable_entity->mtime = sys_time(fs);
+	note_change(fs);
 	return COZYFS_OK;
 }
 
+// Watchers are notified once the lock is released, see unlock
+static void note_change(CozyFS *fs)
+{
+	fs->changed = 1;
+}
+
+// Removes the link called "name" from "parent". The last link
+// of the directory is moved in its place so that links are
+// always packed at the start of each page.
 static int remove_entity(CozyFS *fs, const Entity *parent, string name, u32 flags)
 {
-	int i;
+	int i = 0;
 	const DPage *dpage = off2ptr(fs, parent->head);
 	while (dpage) {
 
@@ -660,9 +964,11 @@ static int remove_entity(CozyFS *fs, const Entity *parent, string name, u32 flag
 
 			int link_name_len = my_strlen(dpage->links[i].name);
 			if (name.size == link_name_len && memeq(name.data, dpage->links[i].name, name.size))
-				return off2ptr(fs, dpage->links[i].off);
+				break;
 			i++;
 		}
+		if (i < COUNT(dpage->links) && dpage->links[i].off != INVALID_OFFSET)
+			break;
 
 		dpage = off2ptr(fs, dpage->next);
 	}
@@ -670,25 +976,50 @@ static int remove_entity(CozyFS *fs, const Entity *parent, string name, u32 flag
 	if (dpage == NULL)
 		return -COZYFS_ENOENT;
 
-	const Link *link = &dpage->links[i];
-	const Entity *entity = off2ptr(fs, link->off);
+	const Entity *entity = off2ptr(fs, dpage->links[i].off);
+	if (flags == ENTITY_DIR) {
+		if ((entity->flags & ENTITY_DIR) == 0)
+			return -COZYFS_ENOTDIR;
+		const DPage *first = off2ptr(fs, entity->head);
+		while (first) {
+			if (count_links(first) > 0)
+				return -COZYFS_ENOTEMPTY;
+			first = off2ptr(fs, first->next);
+		}
+	} else {
+		if (entity->flags & ENTITY_DIR)
+			return -COZYFS_EISDIR;
+	}
 
-	Entity *writable_parent = writable_addr(fs, parent);
-	if (writable_parent == NULL)
-		return COZYFS_ENOMEM;
+	// The last link is in the last page that isn't empty
+	const DPage *last = off2ptr(fs, parent->tail);
+	int num_last = count_links(last);
+	while (num_last == 0) {
+		last = off2ptr(fs, last->prev);
+		num_last = count_links(last);
+	}
+
+	Offset parent_off = ptr2off(fs, parent);
+	Offset entity_off = ptr2off(fs, entity);
 
+	// Both pages are made writable before either is written
+	// since they may be the same page
 	DPage *writable_dpage = writable_addr(fs, dpage);
-	if (writable_dpage == NULL)
+	DPage *writable_last  = writable_addr(fs, last);
+	if (writable_dpage == NULL || writable_last == NULL)
 		return -COZYFS_ENOMEM;
 
-	int code = free_entity(fs, entity);
+	writable_dpage->links[i] = writable_last->links[num_last-1];
+	writable_last->links[num_last-1].off = INVALID_OFFSET;
+
+	int code = free_entity(fs, off2ptr(fs, entity_off));
 	if (code != COZYFS_OK)
 		return code;
 
-	const DPage *tail = off2ptr(fs, parent->tail);
-	writable_dpage->links[i] = tail->links[--writable_parent->tail_end];
-
-	return COZYFS_OK;
+	Entity *writable_parent = writable_addr(fs, off2ptr(fs, parent_off));
+	if (writable_parent == NULL)
+		return -COZYFS_ENOMEM;
+	return touch_entity(fs, writable_parent);
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -706,15 +1037,17 @@ static void *allocate_page(CozyFS *fs)
 		return NULL;
 
 	XPage *xpage;
-	if (root->free_pages == INVALID_OFFSET) {
-		xpage = (XPage*) get_root(fs) + writable_root->num_pages++;
+	if (writable_root->free_pages == INVALID_OFFSET) {
+		// Pages never handed out aren't part of any patch
+		xpage = (XPage*) fs->mem + writable_root->num_pages++;
 	} else {
 		xpage = writable_addr(fs, off2ptr(fs, writable_root->free_pages));
+		if (xpage == NULL)
+			return NULL;
 		writable_root->free_pages = xpage->next;
+		writable_root->num_free_pages--;
 	}
 
-	// TODO: The page here should be copied if a transaction is happening
-
 	return xpage;
 }
 
@@ -803,6 +1136,7 @@ static int remove_user(CozyFS *fs, const char *name)
 		XPage *writable_xpage = (XPage*) writable_tail_upage;
 		writable_xpage->next = writable_root->free_pages;
 		writable_root->free_pages = ptr2off(fs, writable_xpage);
+		writable_root->num_free_pages++;
 	}
 
 	return 0;
@@ -856,9 +1190,30 @@ static int parse_path(string path, string *comps, int max)
 	return num;
 }
 
+// Follows the path from the root to the entity it refers to
+static int resolve_path(CozyFS *fs, const char *path, const Entity **entity)
+{
+	string pathstr = { path, my_strlen(path) };
+
+	string pathcomps[32];
+	int pathnum = parse_path(pathstr, pathcomps, COUNT(pathcomps));
+	if (pathnum < 0) return pathnum;
+
+	const RPage *root = get_root(fs);
+	const Entity *current = &root->root;
+	for (int i = 0; i < pathnum; i++) {
+		current = find_entity(fs, current, pathcomps[i]);
+		if (current == NULL)
+			return -COZYFS_ENOENT;
+	}
+
+	*entity = current;
+	return COZYFS_OK;
+}
+
 static int pack_fd(CozyFS *fs, const Handle *handle)
 {
-	const RPage *root = fs->mem;
+	const RPage *root = get_root(fs);
 	int i = handle - root->handles;
 	int fd = (handle->gen << 16) | i;
 	ASSERT(fd >= 0);
@@ -870,7 +1225,7 @@ static const Handle *unpack_fd(CozyFS *fs, int fd)
 	u32 gen = (u32) fd >> 16;
 	u32 idx = fd & 0xFFFF;
 
-	const RPage *root = fs->mem;
+	const RPage *root = get_root(fs);
 	if (idx >= COUNT(root->handles))
 		return NULL;
 
@@ -894,7 +1249,7 @@ static int link_(CozyFS *fs, const char *oldpath, const char *newpath)
 	int newpathnum = parse_path(newpathstr, newpathcomps, COUNT(newpathcomps));
 	if (newpathnum < 0) return newpathnum;
 
-	const RPage *root = fs->mem;
+	const RPage *root = get_root(fs);
 
 	// Resolve the old path
 	const Entity *target = &root->root;
@@ -932,7 +1287,7 @@ static int unlink_(CozyFS *fs, const char *path)
 	if (pathnum == 0)
 		return -COZYFS_EPERM; // Trying to unlink root
 
-	const RPage *root = fs->mem;
+	const RPage *root = get_root(fs);
 
 	const Entity *parent = &root->root;
 	for (int i = 0; i < pathnum-1; i++) {
@@ -952,7 +1307,7 @@ static int mkdir_(CozyFS *fs, const char *path)
 	int pathnum = parse_path(pathstr, pathcomps, COUNT(pathcomps));
 	if (pathnum < 0) return pathnum;
 
-	const RPage *root = fs->mem;
+	const RPage *root = get_root(fs);
 
 	if (pathnum == 0)
 		return -COZYFS_EPERM;
@@ -978,7 +1333,7 @@ static int rmdir_(CozyFS *fs, const char *path)
 	if (pathnum == 0)
 		return -COZYFS_EPERM; // Trying to unlink root
 
-	const RPage *root = fs->mem;
+	const RPage *root = get_root(fs);
 
 	const Entity *parent = &root->root;
 	for (int i = 0; i < pathnum-1; i++) {
@@ -1012,28 +1367,14 @@ static int chmod_(CozyFS *fs, const char *path, int mode)
 	// TODO
 }
 
-static int open_(CozyFS *fs, const char *path)
+static int open_entity(CozyFS *fs, const Entity *entity)
 {
-	string pathstr = { path, my_strlen(path) };
-
-	string pathcomps[32];
-	int pathnum = parse_path(pathstr, pathcomps, COUNT(pathcomps));
-	if (pathnum < 0) return pathnum;
-
-	// Follow the path to the entity
-	const RPage *root = fs->mem;
-	const Entity *entity = &root->root;
-	for (int i = 0; i < pathnum-1; i++) {
-		entity = find_entity(fs, entity, pathcomps[i]);
-		if (entity == NULL)
-			return -COZYFS_ENOENT;
-	}
-
 	// "open" only works on files
 	if (entity->flags & ENTITY_DIR)
 		return -COZYFS_EISDIR;
 
 	// Find an unused handle
+	const RPage *root = get_root(fs);
 	int i = 0;
 	while (i < COUNT(root->handles) && root->handles[i].used)
 		i++;
@@ -1042,17 +1383,76 @@ static int open_(CozyFS *fs, const char *path)
 	if (i == COUNT(root->handles) || i >= 1 << 16)
 		return -COZYFS_ENFILE;
 
+	// The handle keeps the entity alive until it's closed
+	Entity *writable_entity = writable_addr(fs, entity);
+	if (writable_entity == NULL)
+		return -COZYFS_ENOMEM;
+
 	Handle *handle = writable_addr(fs, &root->handles[i]);
 	if (handle == NULL)
 		return -COZYFS_ENOMEM;
 
+	// The entity may be in the root page, which was
+	// just copied for the handle
+	writable_entity = writable_addr(fs, writable_entity);
+	if (writable_entity == NULL)
+		return -COZYFS_ENOMEM;
+	writable_entity->refs++;
+
 	// TODO: Handles should have an expiration or crashing processes will fill up the array
-	handle->entity = ptr2off(fs, entity);
+	handle->entity = ptr2off(fs, writable_entity);
+	handle->cursor = 0;
+	handle->cursor_page = INVALID_OFFSET;
+	handle->cursor_skip = 0;
 	handle->used = 1;
 
 	return pack_fd(fs, handle);
 }
 
+static int open_(CozyFS *fs, const char *path)
+{
+	const Entity *entity;
+	int code = resolve_path(fs, path, &entity);
+	if (code != COZYFS_OK)
+		return code;
+
+	return open_entity(fs, entity);
+}
+
+// Like open_ but missing files are created first
+static int create_(CozyFS *fs, const char *path)
+{
+	string pathstr = { path, my_strlen(path) };
+
+	string pathcomps[32];
+	int pathnum = parse_path(pathstr, pathcomps, COUNT(pathcomps));
+	if (pathnum < 0) return pathnum;
+
+	if (pathnum == 0)
+		return -COZYFS_EISDIR;
+
+	// Follow the path to the parent of the entity
+	const RPage *root = get_root(fs);
+	const Entity *parent = &root->root;
+	for (int i = 0; i < pathnum-1; i++) {
+		parent = find_entity(fs, parent, pathcomps[i]);
+		if (parent == NULL)
+			return -COZYFS_ENOENT;
+	}
+
+	const Entity *entity = find_entity(fs, parent, pathcomps[pathnum-1]);
+	if (entity == NULL) {
+		Offset parent_off = ptr2off(fs, parent);
+		int code = create_entity(fs, parent, NULL, pathcomps[pathnum-1], ENTITY_FILE);
+		if (code != COZYFS_OK)
+			return code;
+		entity = find_entity(fs, off2ptr(fs, parent_off), pathcomps[pathnum-1]);
+		ASSERT(entity);
+	}
+
+	return open_entity(fs, entity);
+}
+
 static int close_(CozyFS *fs, int fd)
 {
 	const Handle *handle = unpack_fd(fs, fd);
@@ -1071,9 +1471,11 @@ static int close_(CozyFS *fs, int fd)
 	if (code != COZYFS_OK)
 		return code;
 
+	// The generation is the upper half of the descriptor, so it
+	// wraps within 15 bits to keep descriptors positive
 	writable_handle->used = 0;
-	writable_handle->gen++;
-	if (writable_handle->gen == 0 || writable_handle->gen == (u64) -1)
+	writable_handle->gen = (writable_handle->gen + 1) & 0x7FFF;
+	if (writable_handle->gen == 0)
 		writable_handle->gen = 1;
 
 	return COZYFS_OK;
@@ -1095,6 +1497,67 @@ static string fpage_bytes(const Entity *entity, const FPage *fpage)
 	return (string) { src, num };
 }
 
+// Returns the page containing the byte at position "cursor"
+// of the file and stores in "skip" how many of its bytes come
+// before it. Returns NULL if the cursor is at the end.
+//
+// The walk starts from whichever is closest between the head,
+// the tail and the position cached in the handle. Files only
+// grow by appending so the cached page never moves.
+static const FPage *seek_fpage(CozyFS *fs, const Handle *handle, const Entity *entity, Offset cursor, int *skip)
+{
+	*skip = 0;
+	if (cursor >= entity->size)
+		return NULL;
+
+	const FPage *fpage = off2ptr(fs, entity->head);
+	Offset       start = 0;
+	Offset       dist  = cursor;
+
+	const FPage *hint = off2ptr(fs, handle->cursor_page);
+	Offset hint_start = handle->cursor - handle->cursor_skip;
+	if (hint && hint_start <= cursor && cursor - hint_start < dist) {
+		fpage = hint;
+		start = hint_start;
+		dist  = cursor - hint_start;
+	}
+
+	const FPage *tail = off2ptr(fs, entity->tail);
+	Offset tail_start = entity->size - fpage_bytes(entity, tail).size;
+	if (cursor >= tail_start || tail_start - cursor < dist) {
+		// Walk backwards from the tail
+		fpage = tail;
+		start = tail_start;
+		while (cursor < start) {
+			fpage = off2ptr(fs, fpage->prev);
+			start -= fpage_bytes(entity, fpage).size;
+		}
+	} else {
+		while (cursor - start >= (Offset) fpage_bytes(entity, fpage).size) {
+			start += fpage_bytes(entity, fpage).size;
+			fpage = off2ptr(fs, fpage->next);
+		}
+	}
+
+	*skip = cursor - start;
+	return fpage;
+}
+
+// Moves the handle's cursor forward by "advance" bytes, to byte
+// "skip" of "fpage". When reads stop at the end of the file,
+// "fpage" is the last page and "skip" its size.
+static int advance_cursor(CozyFS *fs, const Handle *handle, Offset advance, const FPage *fpage, int skip)
+{
+	Handle *writable_handle = writable_addr(fs, handle);
+	if (writable_handle == NULL)
+		return -COZYFS_ENOMEM;
+	writable_handle->cursor += advance;
+	writable_handle->cursor_page = ptr2off(fs, fpage);
+	writable_handle->cursor_skip = skip;
+	return COZYFS_OK;
+}
+
+// TODO: Support COZYFS_FCONSUME
 static int read_(CozyFS *fs, int fd, void *dst, int max)
 {
 	const Handle *handle = unpack_fd(fs, fd);
@@ -1105,63 +1568,329 @@ static int read_(CozyFS *fs, int fd, void *dst, int max)
 	if ((entity->flags & ENTITY_FILE) == 0)
 		return -COZYFS_EINVAL;
 
-	const FPage *fpage = off2ptr(fs, entity->head);
-	Offset       start = entity->head_start;
-
-	if ((flags & READ_START) == 0) {
-
-		Offset skipped = 0;
-		while (fpage && skipped < handle->cursor) {
-			skipped += fpage_bytes(entity, fpage).size;
-			fpage = off2ptr(fs, fpage);
-		}
-
-		if (skipped < handle->cursor) {
-			???
-			handle->cursor = skipped;
-		}
-	}
+	int skip;
+	const FPage *fpage = seek_fpage(fs, handle, entity, handle->cursor, &skip);
 
 	int copied = 0;
 	while (fpage && copied < max) {
 
 		string src = fpage_bytes(entity, fpage);
 
-		if (src.size > max - copied)
-			src.size = max - copied;
+		int num = src.size - skip;
+		if (num > max - copied)
+			num = max - copied;
 
-		my_memcpy(dst + copied, src.data, src.size);
+		my_memcpy((char*) dst + copied, src.data + skip, num);
+		copied += num;
+		skip   += num;
+
+		if (skip < src.size || fpage->next == INVALID_OFFSET)
+			break;
 
-		copied += src.size;
 		fpage = off2ptr(fs, fpage->next);
+		skip = 0;
 	}
 
-	if (flags & COZYFS_FCONSUME) {
-		if (handle->cursor > 0)
-			return -COZYFS_EINVAL;
-
-		// TODO
+	if (copied > 0) {
+		int code = advance_cursor(fs, handle, copied, fpage, skip);
+		if (code != COZYFS_OK)
+			return code;
 	}
 
 	return copied;
 }
 
-static int write_(CozyFS *fs, int fd, const void *src, int len)
+// Like read_ but instead of copying the file contents it
+// returns pointers to the pages holding them.
+static int read_spans_(CozyFS *fs, int fd, CozyFSSpan *spans, int max)
 {
-	// TODO
-}
-
-////////////////////////////////////////////////////////////////////////
-// File system lock
+	const Handle *handle = unpack_fd(fs, fd);
+	if (handle == NULL)
+		return -COZYFS_EBADF;
 
-static int lock(CozyFS *fs, int wait_timeout_ms, int acquire_timeout_sec, int *crash)
+	const Entity *entity = off2ptr(fs, handle->entity);
+	if ((entity->flags & ENTITY_FILE) == 0)
+		return -COZYFS_EINVAL;
+
+	int skip;
+	const FPage *fpage = seek_fpage(fs, handle, entity, handle->cursor, &skip);
+
+	int num = 0;
+	Offset advance = 0;
+	while (fpage && num < max) {
+
+		string src = fpage_bytes(entity, fpage);
+		spans[num].ptr = src.data + skip;
+		spans[num].len = src.size - skip;
+		advance += src.size - skip;
+		num++;
+
+		skip = src.size;
+		if (fpage->next == INVALID_OFFSET || num == max)
+			break;
+
+		fpage = off2ptr(fs, fpage->next);
+		skip = 0;
+	}
+
+	if (advance > 0) {
+		int code = advance_cursor(fs, handle, advance, fpage, skip);
+		if (code != COZYFS_OK)
+			return code;
+	}
+
+	return num;
+}
+
+// Like read_ from the start of the file, but without a handle, so
+// nothing is written to the arena
+static int read_path_(CozyFS *fs, const char *path, void *dst, int max)
+{
+	const Entity *entity;
+	int code = resolve_path(fs, path, &entity);
+	if (code != COZYFS_OK)
+		return code;
+
+	if (entity->flags & ENTITY_DIR)
+		return -COZYFS_EISDIR;
+
+	const FPage *fpage = entity->size > 0 ? off2ptr(fs, entity->head) : NULL;
+
+	int copied = 0;
+	while (fpage && copied < max) {
+
+		string src = fpage_bytes(entity, fpage);
+
+		int num = src.size;
+		if (num > max - copied)
+			num = max - copied;
+
+		my_memcpy((char*) dst + copied, src.data, num);
+		copied += num;
+
+		fpage = off2ptr(fs, fpage->next);
+	}
+
+	return copied;
+}
+
+static int seek_(CozyFS *fs, int fd, unsigned int offset)
+{
+	const Handle *handle = unpack_fd(fs, fd);
+	if (handle == NULL)
+		return -COZYFS_EBADF;
+
+	const Entity *entity = off2ptr(fs, handle->entity);
+	if ((entity->flags & ENTITY_FILE) == 0)
+		return -COZYFS_EINVAL;
+
+	if (offset > entity->size)
+		return -COZYFS_EINVAL;
+
+	int skip;
+	const FPage *fpage = seek_fpage(fs, handle, entity, offset, &skip);
+
+	Handle *writable_handle = writable_addr(fs, handle);
+	if (writable_handle == NULL)
+		return -COZYFS_ENOMEM;
+
+	// The end of the file isn't cached since the
+	// tail is just as close
+	writable_handle->cursor = offset;
+	writable_handle->cursor_page = ptr2off(fs, fpage);
+	writable_handle->cursor_skip = skip;
+	return COZYFS_OK;
+}
+
+static void stat_entity(CozyFS *fs, const Entity *entity, CozyFSStat *buf)
+{
+	buf->id     = ptr2off(fs, entity);
+	buf->is_dir = (entity->flags & ENTITY_DIR) != 0;
+	buf->size   = entity->size;
+	buf->gen    = entity->gen;
+	buf->mtime  = entity->mtime;
+}
+
+static int fstat_(CozyFS *fs, int fd, CozyFSStat *buf)
+{
+	const Handle *handle = unpack_fd(fs, fd);
+	if (handle == NULL)
+		return -COZYFS_EBADF;
+
+	stat_entity(fs, off2ptr(fs, handle->entity), buf);
+	return COZYFS_OK;
+}
+
+static int stat_(CozyFS *fs, const char *path, CozyFSStat *buf)
+{
+	const Entity *entity;
+	int code = resolve_path(fs, path, &entity);
+	if (code != COZYFS_OK)
+		return code;
+
+	stat_entity(fs, entity, buf);
+
+	const RPage *root = get_root(fs);
+	if (entity == &root->root)
+		buf->is_dir = 1;
+	return COZYFS_OK;
+}
+
+static int count_links(const DPage *dpage)
+{
+	// Only the last page of a directory isn't full
+	if (dpage->links[COUNT(dpage->links)-1].off != INVALID_OFFSET)
+		return COUNT(dpage->links);
+
+	int i = 0;
+	while (i < COUNT(dpage->links) && dpage->links[i].off != INVALID_OFFSET)
+		i++;
+	return i;
+}
+
+// The cursor is the position of the next entry in the directory.
+// Entries removed while listing may cause others to be skipped,
+// since the last entry is moved in place of the removed one.
+static int readdir_(CozyFS *fs, const char *path, unsigned int *cursor, CozyFSDirEntry *entries, int max)
+{
+	const Entity *dir;
+	int code = resolve_path(fs, path, &dir);
+	if (code != COZYFS_OK)
+		return code;
+
+	const RPage *root = get_root(fs);
+	if (dir != &root->root && (dir->flags & ENTITY_DIR) == 0)
+		return -COZYFS_ENOTDIR;
+
+	// Skip whole pages to get to the cursor
+	unsigned int skip = *cursor;
+	const DPage *dpage = off2ptr(fs, dir->head);
+	while (dpage) {
+		int num_links = count_links(dpage);
+		if (skip < (unsigned int) num_links)
+			break;
+		skip -= num_links;
+		dpage = off2ptr(fs, dpage->next);
+	}
+
+	int num = 0;
+	int i = skip;
+	while (dpage && num < max) {
+
+		if (i == COUNT(dpage->links) || dpage->links[i].off == INVALID_OFFSET) {
+			dpage = off2ptr(fs, dpage->next);
+			i = 0;
+			continue;
+		}
+
+		const Link *link = &dpage->links[i];
+
+		int len = 0;
+		while (len < (int) MAX_NAME && link->name[len])
+			len++;
+
+		CozyFSDirEntry *entry = &entries[num++];
+		my_memcpy(entry->name, link->name, len);
+		entry->name[len] = '\0';
+		stat_entity(fs, off2ptr(fs, link->off), &entry->stat);
+		i++;
+	}
+
+	*cursor += num;
+	return num;
+}
+
+// Writes always append to the file, regardless of the cursor.
+// Returns the number of bytes written, which is less than "len"
+// if the file system ran out of pages.
+static int write_(CozyFS *fs, int fd, const void *src, int len)
+{
+	const Handle *handle = unpack_fd(fs, fd);
+	if (handle == NULL)
+		return -COZYFS_EBADF;
+
+	const Entity *entity = off2ptr(fs, handle->entity);
+	if ((entity->flags & ENTITY_FILE) == 0)
+		return -COZYFS_EINVAL;
+
+	Entity *writable_entity = writable_addr(fs, entity);
+	if (writable_entity == NULL)
+		return -COZYFS_ENOMEM;
+
+	int written = 0;
+	while (written < len) {
+
+		const FPage *tail = off2ptr(fs, writable_entity->tail);
+		if (tail == NULL || writable_entity->tail_end == sizeof(tail->data)) {
+
+			// Get the tail before allocating so that
+			// a failure doesn't lose the new page
+			FPage *writable_tail = NULL;
+			if (tail) {
+				writable_tail = writable_addr(fs, tail);
+				if (writable_tail == NULL)
+					break;
+			}
+
+			FPage *fpage = allocate_page(fs);
+			if (fpage == NULL)
+				break;
+
+			fpage->prev = writable_entity->tail;
+			fpage->next = INVALID_OFFSET;
+
+			Offset off = ptr2off(fs, fpage);
+			if (writable_tail)
+				writable_tail->next = off;
+			else {
+				writable_entity->head = off;
+				writable_entity->head_start = 0;
+			}
+			writable_entity->tail = off;
+			writable_entity->tail_end = 0;
+			tail = fpage;
+		}
+
+		FPage *writable_tail = writable_addr(fs, tail);
+		if (writable_tail == NULL)
+			break;
+
+		int num = sizeof(tail->data) - writable_entity->tail_end;
+		if (num > len - written)
+			num = len - written;
+
+		my_memcpy(writable_tail->data + writable_entity->tail_end, (const char*) src + written, num);
+		writable_entity->tail_end += num;
+		writable_entity->size += num;
+		written += num;
+	}
+
+	if (written == 0 && len > 0)
+		return -COZYFS_ENOMEM;
+
+	if (written > 0) {
+		int code = touch_entity(fs, writable_entity);
+		if (code != COZYFS_OK)
+			return code;
+	}
+
+	return written;
+}
+
+////////////////////////////////////////////////////////////////////////
+// File system lock
+
+static int lock(CozyFS *fs, int wait_timeout_ms, int acquire_timeout_sec, int *crash)
 {
 	u64 start = sys_time(fs);
 	if (start == 0)
 		return -COZYFS_ESYSTIME;
 
+	int timed = fs->stats || fs->trace;
+	u64 wait_start = timed ? sys_clock(fs) : 0;
+
 	RPage *root = fs->mem;
-	u64   *word = root->lock;
+	u64   *word = (u64*) &root->lock;
 	u64 old_word;
 	u64 new_word;
 	for (;;) {
@@ -1171,7 +1900,7 @@ static int lock(CozyFS *fs, int wait_timeout_ms, int acquire_timeout_sec, int *c
 			return -COZYFS_ESYSTIME;
 
 		old_word = load(word);
-		new_word = now + acquire_timeout_sec * 1000;
+		new_word = now + acquire_timeout_sec;
 
 		if (old_word < now) {
 			// Region is unlocked. Try locking it.
@@ -1181,32 +1910,66 @@ static int lock(CozyFS *fs, int wait_timeout_ms, int acquire_timeout_sec, int *c
 			// else got the lock. We don't need to wait
 			// before trying again.
 		} else {
-			int code = sys_wait(fs, word, old_word, old_word - now);
+			// Times are in seconds, so wait until the lock
+			// would expire rather than until it does
+			int code = sys_wait(fs, word, old_word, (old_word - now + 1) * 1000);
 			if (code < 0)
 				return code;
 		}
 
 		// Don't wait more than "wait_timeout_ms"
-		if (wait_timeout_ms >= 0 && now - start >= wait_timeout_ms)
+		if (wait_timeout_ms >= 0 && (now - start) * 1000 >= (u64) wait_timeout_ms)
 			return -COZYFS_ETIMEDOUT;
 	}
 
 	fs->ticket = new_word;
 
+	if (timed)
+		fs->locked_at = sys_clock(fs);
+
+	CozyFSStats *stats = fs->stats;
+	if (stats)
+		hist_add(&stats->lock_wait, fs->locked_at - wait_start);
+
 	if (old_word > 0) {
 		fence(); // If a crash happened, we missed the memory barriers from the unlock operation
 		*crash = 1;
+		if (stats)
+			atomic_add(&stats->crashes, 1);
 	} else
 		*crash = 0;
+
+	if (fs->trace)
+		sys_trace(fs, COZYFS_TRACE_LOCK_ACQUIRE, -1, *crash, fs->locked_at - wait_start, fs->locked_at, NULL);
 	return 0;
 }
 
 static int unlock(CozyFS *fs)
 {
 	RPage *root = fs->mem;
-	u64   *word = root->lock;
-	if (!cmpxchg_release(root->lock, 0, fs->ticket))
+	u64   *word = (u64*) &root->lock;
+
+	// The counter is bumped while still holding the lock so
+	// that watchers reading it after waking see the changes
+	int changed = fs->changed;
+	if (changed) {
+		atomic_store(&root->changes, root->changes + 1);
+		fs->changed = 0;
+	}
+
+	if (fs->stats || fs->trace) {
+		u64 now = sys_clock(fs);
+		if (fs->stats)
+			hist_add(&((CozyFSStats*) fs->stats)->lock_hold, now - fs->locked_at);
+		if (fs->trace)
+			sys_trace(fs, COZYFS_TRACE_LOCK_RELEASE, -1, 0, now - fs->locked_at, now, NULL);
+	}
+
+	if (!cmpxchg_release(word, 0, fs->ticket))
 		return -COZYFS_ETIMEDOUT;
+
+	if (changed)
+		sys_wake(fs, (u64*) &root->changes);
 	return sys_wake(fs, word); // TODO: Should I only wake up 1?
 }
 
@@ -1218,8 +1981,8 @@ static int refresh_lock(CozyFS *fs, int postpone_sec)
 
 	RPage *root = fs->mem;
 
-	u64 *word = root->lock;
-	u64 new_word = now + postpone_sec * 1000;
+	u64 *word = (u64*) &root->lock;
+	u64 new_word = now + postpone_sec;
 	u64 old_word = fs->ticket;
 
 	if (!cmpxchg_acq_rel(word, new_word, fs->ticket))
@@ -1232,47 +1995,316 @@ static int refresh_lock(CozyFS *fs, int postpone_sec)
 ////////////////////////////////////////////////////////////////////////
 // Backup
 
+// The arena is followed by a second half of the same size holding
+// a snapshot of it. "backup" is BACKUP_HALF_ACTIVE while the snapshot
+// is complete and BACKUP_HALF_INACTIVE while it's being taken, in
+// which case the arena itself is intact since backups are taken
+// between operations. The fields before "backup" are shared by all
+// processes, so they are never copied.
+static void copy_half(RPage *dst, const RPage *src)
+{
+	unsigned long skip = OFFSETOF(RPage, backup) + sizeof(src->backup);
+	my_memcpy((char*) dst + skip, (const char*) src + skip, (unsigned long) src->tot_pages * 4096 - skip);
+}
+
 static void perform_backup(CozyFS *fs, int not_before_sec)
 {
 	RPage *root = fs->mem;
 
-	int backup = atomic_load(&root->backup);
+	int backup = (int) atomic_load((volatile u64*) &root->backup);
 	if (backup == BACKUP_NO)
 		return;
 
 	u64 now = sys_time(fs);
-	if (now < root->last_backup_time + not_before_sec * 1000)
+	if (backup == BACKUP_HALF_ACTIVE && now < root->last_backup_time + not_before_sec)
 		return;
 
-	atomic_store(&root->backup, !backup);
+	u64 copy_start = (fs->stats || fs->trace) ? sys_clock(fs) : 0;
+	u64 copy_bytes = (u64) root->tot_pages * 4096;
 
-	// TODO
-	my_memcpy(???);
+	atomic_store((volatile u64*) &root->backup, (u32) BACKUP_HALF_INACTIVE);
+	root->last_backup_time = now;
+
+	if (fs->trace)
+		sys_trace(fs, COZYFS_TRACE_BACKUP_BEGIN, -1, 0, 0, copy_start, NULL);
+
+	copy_half(root + root->tot_pages, root);
 
-	atomic_store(&root->last_backup_time, now);
+	u64 copy_end = (fs->stats || fs->trace) ? sys_clock(fs) : 0;
+	if (fs->trace)
+		sys_trace(fs, COZYFS_TRACE_BACKUP_END, -1, 0, copy_bytes, copy_end, NULL);
+
+	atomic_store((volatile u64*) &root->backup, (u32) BACKUP_HALF_ACTIVE);
+
+	CozyFSStats *stats = fs->stats;
+	if (stats) {
+		hist_add(&stats->backup_time, copy_end - copy_start);
+		atomic_add(&stats->backup_bytes, copy_bytes);
+	}
 }
 
+// Called when the previous owner of the lock crashed. Returns 1
+// if the arena was rolled back to the snapshot.
 static int restore_backup(CozyFS *fs)
 {
-	const RPage *root = fs->mem;
+	RPage *root = fs->mem;
 
-	int backup = atomic_load(&root->backup);
+	int backup = (int) atomic_load((volatile u64*) &root->backup);
 	if (backup == BACKUP_NO)
 		return 0;
 
-	// Copy the inactive region into the active
-	// (and corrupted) one. Don't copy the volatile
-	// fields though.
+	// The crash happened while taking the snapshot,
+	// so only the snapshot needs to be redone
+	if (backup == BACKUP_HALF_INACTIVE) {
+		perform_backup(fs, 0);
+		return 0;
+	}
 
-	char *active = root;
-	char *inactive = root + root->tot_pages;
+	u64 copy_bytes = (u64) root->tot_pages * 4096;
+	if (fs->trace)
+		sys_trace(fs, COZYFS_TRACE_BACKUP_BEGIN, -1, 1, 0, sys_clock(fs), NULL);
 
-	int skip = OFFSETOF(RPage, backup) + sizeof(root->backup);
-	my_memcpy(active + skip, inactive + skip, root->tot_pages * 4096 - skip);
+	copy_half(root, root + root->tot_pages);
+	note_change(fs);
 
+	if (fs->trace)
+		sys_trace(fs, COZYFS_TRACE_BACKUP_END, -1, 1, copy_bytes, sys_clock(fs), NULL);
 	return 1;
 }
 
+////////////////////////////////////////////////////////////////////////
+// Statistics
+
+static void hist_add(CozyFSHistogram *hist, u64 value)
+{
+	int bucket = 0;
+	if (value > 0) {
+#if COMPILER_MSVC
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		bucket = index + 1;
+#else
+		bucket = 64 - __builtin_clzll(value);
+#endif
+		if (bucket >= COZYFS_HIST_BUCKETS)
+			bucket = COZYFS_HIST_BUCKETS-1;
+	}
+	atomic_add(&hist->count, 1);
+	atomic_add(&hist->sum, value);
+	atomic_add(&hist->buckets[bucket], 1);
+}
+
+static u64 stats_begin(CozyFS *fs, int op, const CozyFSTraceArgs *args)
+{
+	if (fs->stats == NULL && !fs->trace)
+		return 0;
+
+	u64 now = sys_clock(fs);
+	if (fs->trace) {
+		fs->trace_args = args;
+		sys_trace(fs, COZYFS_TRACE_OP_BEGIN, op, 0, 0, now, args);
+	}
+	return now;
+}
+
+// Records the latency of the public function "op" and passes
+// its return value through
+static int stats_end(CozyFS *fs, int op, u64 start, int code)
+{
+	if (fs->stats == NULL && !fs->trace)
+		return code;
+
+	u64 now = sys_clock(fs);
+
+	CozyFSStats *stats = fs->stats;
+	if (stats) {
+		hist_add(&stats->ops[op], now - start);
+		if (code < 0)
+			atomic_add(&stats->errors[op], 1);
+	}
+
+	if (fs->trace) {
+		sys_trace(fs, COZYFS_TRACE_OP_END, op, code, now - start, now, fs->trace_args);
+		fs->trace_args = NULL;
+	}
+	return code;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Inspection
+
+static int valid_page(CozyFS *fs, Offset off)
+{
+	const RPage *root = get_root(fs);
+	return off % 4096 == 0 && off > 0 && off / 4096 < (Offset) root->num_pages;
+}
+
+// Counts the pages of a list linked through the Offset at byte
+// "next_field" of each page. Lists the root page never initialized
+// have a head of 0 and are considered empty.
+static int inspect_chain(CozyFS *fs, Offset head, int next_field, int *count)
+{
+	const RPage *root = get_root(fs);
+
+	int num = 0;
+	Offset off = head;
+	if (off == 0)
+		off = INVALID_OFFSET;
+	while (off != INVALID_OFFSET) {
+		if (!valid_page(fs, off) || num == root->num_pages)
+			return -COZYFS_ECORRUPT; // Out of the arena, or a loop
+		num++;
+		off = *(Offset*) ((char*) off2ptr(fs, off) + next_field);
+	}
+
+	*count += num;
+	return COZYFS_OK;
+}
+
+static int inspect_file(CozyFS *fs, Inspection *ins, const Entity *file)
+{
+	int pages = 0;
+	int code = inspect_chain(fs, file->head, OFFSETOF(FPage, next), &pages);
+	if (code != COZYFS_OK)
+		return code;
+
+	if (ins->visit) {
+		CozyFSReportEntry entry = { ins->path, ptr2off(fs, file), 0, pages, 0, file->size };
+		ins->visit(ins->userptr, &entry);
+	}
+	return COZYFS_OK;
+}
+
+// Directories are reported before their contents
+static int inspect_dir(CozyFS *fs, Inspection *ins, const Entity *dir)
+{
+	for (int i = 0; i < ins->depth; i++)
+		if (ins->ancestors[i] == dir)
+			return -COZYFS_ECORRUPT; // The directory contains itself
+	if (ins->depth == INSPECT_MAX_DEPTH)
+		return -COZYFS_ECORRUPT;
+
+	int pages = 0;
+	int code = inspect_chain(fs, dir->head, OFFSETOF(DPage, next), &pages);
+	if (code != COZYFS_OK)
+		return code;
+
+	CozyFSReport *report = ins->report;
+
+	// Files may be linked from several directories but their
+	// entity lives in the pages of exactly one, so they are
+	// counted here instead of once per link
+	int entries = 0;
+	for (const DPage *dpage = off2ptr(fs, dir->head); dpage; dpage = off2ptr(fs, dpage->next)) {
+		entries += count_links(dpage);
+		for (int i = 0; i < COUNT(dpage->ents); i++) {
+			const Entity *ent = &dpage->ents[i];
+			if (ent->refs == 0)
+				continue;
+			report->used_entities++;
+			if ((ent->flags & ENTITY_FILE) == 0)
+				continue;
+			int fpages = 0;
+			code = inspect_chain(fs, ent->head, OFFSETOF(FPage, next), &fpages);
+			if (code != COZYFS_OK)
+				return code;
+			report->num_files++;
+			report->fpages += fpages;
+			report->file_bytes += ent->size;
+			report->fpage_slack += (u64) fpages * MEMBER_SIZEOF(FPage, data) - ent->size;
+		}
+	}
+
+	report->num_dirs++;
+	report->dpages += pages;
+	report->link_slots += pages * COUNT(((DPage*) 0)->links);
+	report->used_links += entries;
+	report->entity_slots += pages * COUNT(((DPage*) 0)->ents);
+
+	if (ins->visit) {
+		CozyFSReportEntry entry = { ins->path, ptr2off(fs, dir), 1, pages, entries, 0 };
+		ins->visit(ins->userptr, &entry);
+	}
+
+	ins->ancestors[ins->depth++] = dir;
+
+	int parent_len = ins->path_len;
+	for (const DPage *dpage = off2ptr(fs, dir->head); dpage; dpage = off2ptr(fs, dpage->next)) {
+		for (int i = 0; i < COUNT(dpage->links) && dpage->links[i].off != INVALID_OFFSET; i++) {
+
+			const Link *link = &dpage->links[i];
+
+			int len = 0;
+			while (len < (int) MAX_NAME && link->name[len])
+				len++;
+
+			int sep = parent_len > 1;
+			if (parent_len + sep + len >= INSPECT_MAX_PATH)
+				return -COZYFS_ENAMETOOLONG;
+			if (sep)
+				ins->path[parent_len] = '/';
+			my_memcpy(ins->path + parent_len + sep, link->name, len);
+			ins->path_len = parent_len + sep + len;
+			ins->path[ins->path_len] = '\0';
+
+			const Entity *entity = off2ptr(fs, link->off);
+			if (entity->flags & ENTITY_DIR)
+				code = inspect_dir(fs, ins, entity);
+			else
+				code = inspect_file(fs, ins, entity);
+			if (code != COZYFS_OK)
+				return code;
+		}
+	}
+
+	ins->path_len = parent_len;
+	ins->path[parent_len] = '\0';
+	ins->depth--;
+	return COZYFS_OK;
+}
+
+static int inspect_(CozyFS *fs, CozyFSReport *report, cozyfs_report_callback visit, void *userptr)
+{
+	const RPage *root = get_root(fs);
+
+	my_memset(report, 0, sizeof(CozyFSReport));
+	report->tot_pages = root->tot_pages;
+	report->num_pages = root->num_pages;
+
+	if ((int) atomic_load((volatile u64*) &root->backup) != BACKUP_NO)
+		report->backup_bytes = (u64) root->tot_pages * 4096;
+	report->stats_bytes = (u64) root->stats_slots * sizeof(CozyFSStats);
+
+	int code;
+	code = inspect_chain(fs, root->hpages,     OFFSETOF(HPage, next), &report->hpages);
+	if (code != COZYFS_OK) return code;
+	code = inspect_chain(fs, root->head_upage, OFFSETOF(UPage, next), &report->upages);
+	if (code != COZYFS_OK) return code;
+	code = inspect_chain(fs, root->free_pages, OFFSETOF(XPage, next), &report->xpages);
+	if (code != COZYFS_OK) return code;
+
+	for (int i = 0; i < COUNT(root->handles); i++)
+		if (root->handles[i].used)
+			report->open_handles++;
+
+	Inspection ins;
+	ins.report   = report;
+	ins.visit    = visit;
+	ins.userptr  = userptr;
+	ins.path_len = 1;
+	ins.path[0]  = '/';
+	ins.path[1]  = '\0';
+	ins.depth    = 0;
+	code = inspect_dir(fs, &ins, &root->root);
+	if (code != COZYFS_OK)
+		return code;
+
+	int reached = 1 + report->dpages + report->fpages + report->hpages + report->upages + report->xpages;
+	if (reached < report->num_pages)
+		report->lost_pages = report->num_pages - reached;
+	return COZYFS_OK;
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Public and thread-safe interface
 
@@ -1335,6 +2367,16 @@ int cozyfs_init(void *mem, unsigned long len, int backup, int refresh)
 		len -= pad;
 	}
 
+	// Statistics go at the end, past the arena and its backup
+	int stats_slots = 0;
+	unsigned long stats_len = 0;
+	if (len >= COZYFS_STATS_MIN_LEN) {
+		stats_slots = STATS_SLOTS;
+		stats_len = (stats_slots * sizeof(CozyFSStats) + 4095) & ~4095UL;
+		len = (len - stats_len) & ~4095UL;
+	}
+	unsigned long stats_off = len;
+
 	if (backup)
 		len /= 2;
 
@@ -1349,11 +2391,27 @@ int cozyfs_init(void *mem, unsigned long len, int backup, int refresh)
 	else {
 
 		atomic_store(&root->lock, 0);
-		atomic_store(&root->backup, backup ? BACKUP_HALF_ACTIVE : BACKUP_NO);
+		atomic_store((volatile u64*) &root->backup, (u32) (backup ? BACKUP_HALF_ACTIVE : BACKUP_NO));
 		root->dpages = INVALID_OFFSET;
+		root->hpages = INVALID_OFFSET;
 		root->free_pages = INVALID_OFFSET;
+		root->num_free_pages = 0;
 		root->tot_pages = tot_pages;
 		root->num_pages = 1;
+		root->next_entity_gen = 0;
+		root->last_backup_time = 0;
+
+		root->stats = stats_slots ? stats_off : INVALID_OFFSET;
+		root->stats_slots = stats_slots;
+		atomic_store(&root->stats_next_slot, 0);
+		if (stats_slots)
+			my_memset((char*) mem + stats_off, 0, stats_len);
+
+		my_memset(&root->root, 0, sizeof(root->root));
+		root->root.refs  = 1;
+		root->root.flags = ENTITY_DIR;
+		root->root.head  = INVALID_OFFSET;
+		root->root.tail  = INVALID_OFFSET;
 
 		for (int i = 0; i < COUNT(root->handles); i++) {
 			root->handles[i].gen = 1;
@@ -1378,173 +2436,302 @@ void cozyfs_attach(CozyFS *fs, void *mem, const char *user, cozyfs_callback call
 	fs->mem         = mem;
 	fs->userptr     = userptr;
 	fs->callback    = callback;
-	fs->user        = ???;
+	fs->user        = 0; // TODO: Look up "user"
 	fs->ticket      = 0;
 	fs->transaction = TRANSACTION_OFF;
 	fs->patch_count = 0;
+	fs->changed     = 0;
+	fs->locked_at   = 0;
+	fs->trace       = fs->callback(COZYFS_SYSOP_TRACE, userptr, NULL, 0) == 1;
+	fs->trace_args  = NULL;
+
+	// Processes are spread over the slots so they
+	// rarely update the same cache lines
+	RPage *root = mem;
+	fs->stats = NULL;
+	if (root->stats_slots > 0) {
+		u64 slot = atomic_add(&root->stats_next_slot, 1) % root->stats_slots;
+		fs->stats = (char*) mem + root->stats + slot * sizeof(CozyFSStats);
+	}
 }
 
 void cozyfs_idle(CozyFS *fs)
 {
-	if (fs->transaction == TRANSACTION_ON)
+	if (fs->transaction == TRANSACTION_ON) {
 		refresh_lock(fs, 5);
-	perform_backup(fs, 3); // TODO: Do this in the critical section
+		return;
+	}
+
+	// Snapshots are only taken while holding the lock, by
+	// leave_critical_section. Don't wait if someone else has it.
+	if (enter_critical_section(fs, 0) == COZYFS_OK)
+		leave_critical_section(fs);
 }
 
 int cozyfs_link(CozyFS *fs, const char *oldpath, const char *newpath)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_LINK, &(CozyFSTraceArgs) { .path = oldpath, .path2 = newpath });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_LINK, start, code);
 
 	code = link_(fs, oldpath, newpath);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_LINK, start, code);
 }
 
 int cozyfs_unlink(CozyFS *fs, const char *path)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_UNLINK, &(CozyFSTraceArgs) { .path = path });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_UNLINK, start, code);
 
 	code = unlink_(fs, path);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_UNLINK, start, code);
 }
 
 int cozyfs_mkdir(CozyFS *fs, const char *path)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_MKDIR, &(CozyFSTraceArgs) { .path = path });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_MKDIR, start, code);
 
 	code = mkdir_(fs, path);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_MKDIR, start, code);
 }
 
 int cozyfs_rmdir(CozyFS *fs, const char *path)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_RMDIR, &(CozyFSTraceArgs) { .path = path });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_RMDIR, start, code);
 
 	code = rmdir_(fs, path);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_RMDIR, start, code);
 }
 
 int cozyfs_mkusr(CozyFS *fs, const char *name)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_MKUSR, &(CozyFSTraceArgs) { .path = name });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_MKUSR, start, code);
 
 	code = mkusr(fs, name);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_MKUSR, start, code);
 }
 
 int cozyfs_rmusr(CozyFS *fs, const char *name)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_RMUSR, &(CozyFSTraceArgs) { .path = name });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_RMUSR, start, code);
 
 	code = rmusr(fs, name);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_RMUSR, start, code);
 }
 
 int cozyfs_chown(CozyFS *fs, const char *path, const char *newowner)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_CHOWN, &(CozyFSTraceArgs) { .path = path, .path2 = newowner });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_CHOWN, start, code);
 
 	code = chown_(fs, path, newowner);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_CHOWN, start, code);
 }
 
 int cozyfs_chmod(CozyFS *fs, const char *path, int mode)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_CHMOD, &(CozyFSTraceArgs) { .path = path, .num = mode });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_CHMOD, start, code);
 
 	code = chmod_(fs, path, mode);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_CHMOD, start, code);
 }
 
 int cozyfs_open(CozyFS *fs, const char *path)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_OPEN, &(CozyFSTraceArgs) { .path = path });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_OPEN, start, code);
 
 	code = open_(fs, path);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_OPEN, start, code);
+}
+
+int cozyfs_create(CozyFS *fs, const char *path)
+{
+	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_CREATE, &(CozyFSTraceArgs) { .path = path });
+	code = enter_critical_section(fs, -1);
+	if (code != COZYFS_OK)
+		return stats_end(fs, COZYFS_OP_CREATE, start, code);
+
+	code = create_(fs, path);
+
+	leave_critical_section(fs);
+	return stats_end(fs, COZYFS_OP_CREATE, start, code);
 }
 
 int cozyfs_close(CozyFS *fs, int fd)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_CLOSE, &(CozyFSTraceArgs) { .fd = fd });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_CLOSE, start, code);
 
 	code = close_(fs, fd);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_CLOSE, start, code);
 }
 
 int cozyfs_read(CozyFS *fs, int fd, void *dst, int max)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_READ, &(CozyFSTraceArgs) { .fd = fd, .num = max });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_READ, start, code);
 
 	code = read_(fs, fd, dst, max);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_READ, start, code);
+}
+
+int cozyfs_read_spans(CozyFS *fs, int fd, CozyFSSpan *spans, int max)
+{
+	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_READ_SPANS, &(CozyFSTraceArgs) { .fd = fd, .num = max });
+	code = enter_critical_section(fs, -1);
+	if (code != COZYFS_OK)
+		return stats_end(fs, COZYFS_OP_READ_SPANS, start, code);
+
+	code = read_spans_(fs, fd, spans, max);
+
+	leave_critical_section(fs);
+	return stats_end(fs, COZYFS_OP_READ_SPANS, start, code);
+}
+
+int cozyfs_read_path(CozyFS *fs, const char *path, void *dst, int max)
+{
+	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_READ_PATH, &(CozyFSTraceArgs) { .path = path, .num = max });
+	code = enter_critical_section(fs, -1);
+	if (code != COZYFS_OK)
+		return stats_end(fs, COZYFS_OP_READ_PATH, start, code);
+
+	code = read_path_(fs, path, dst, max);
+
+	leave_critical_section(fs);
+	return stats_end(fs, COZYFS_OP_READ_PATH, start, code);
+}
+
+int cozyfs_seek(CozyFS *fs, int fd, unsigned int offset)
+{
+	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_SEEK, &(CozyFSTraceArgs) { .fd = fd, .num = offset });
+	code = enter_critical_section(fs, -1);
+	if (code != COZYFS_OK)
+		return stats_end(fs, COZYFS_OP_SEEK, start, code);
+
+	code = seek_(fs, fd, offset);
+
+	leave_critical_section(fs);
+	return stats_end(fs, COZYFS_OP_SEEK, start, code);
+}
+
+int cozyfs_fstat(CozyFS *fs, int fd, CozyFSStat *buf)
+{
+	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_FSTAT, &(CozyFSTraceArgs) { .fd = fd });
+	code = enter_critical_section(fs, -1);
+	if (code != COZYFS_OK)
+		return stats_end(fs, COZYFS_OP_FSTAT, start, code);
+
+	code = fstat_(fs, fd, buf);
+
+	leave_critical_section(fs);
+	return stats_end(fs, COZYFS_OP_FSTAT, start, code);
+}
+
+int cozyfs_stat(CozyFS *fs, const char *path, CozyFSStat *buf)
+{
+	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_STAT, &(CozyFSTraceArgs) { .path = path });
+	code = enter_critical_section(fs, -1);
+	if (code != COZYFS_OK)
+		return stats_end(fs, COZYFS_OP_STAT, start, code);
+
+	code = stat_(fs, path, buf);
+
+	leave_critical_section(fs);
+	return stats_end(fs, COZYFS_OP_STAT, start, code);
+}
+
+int cozyfs_readdir(CozyFS *fs, const char *path, unsigned int *cursor, CozyFSDirEntry *entries, int max)
+{
+	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_READDIR, &(CozyFSTraceArgs) { .path = path, .num = max, .cursor = *cursor });
+	code = enter_critical_section(fs, -1);
+	if (code != COZYFS_OK)
+		return stats_end(fs, COZYFS_OP_READDIR, start, code);
+
+	code = readdir_(fs, path, cursor, entries, max);
+
+	leave_critical_section(fs);
+	return stats_end(fs, COZYFS_OP_READDIR, start, code);
 }
 
 int cozyfs_write(CozyFS *fs, int fd, const void *src, int len)
 {
 	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_WRITE, &(CozyFSTraceArgs) { .fd = fd, .num = len });
 	code = enter_critical_section(fs, -1);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_WRITE, start, code);
 
 	code = write_(fs, fd, src, len);
 
 	leave_critical_section(fs);
-	return code;
+	return stats_end(fs, COZYFS_OP_WRITE, start, code);
 }
 
 int cozyfs_transaction_begin(CozyFS *fs)
@@ -1552,16 +2739,18 @@ int cozyfs_transaction_begin(CozyFS *fs)
 	if (fs->transaction != TRANSACTION_OFF)
 		return -COZYFS_EINVAL;
 
+	u64 start = stats_begin(fs, COZYFS_OP_TRANSACTION_BEGIN, NULL);
+
 	int crash;
 	int code = lock(fs, -1, 5, &crash);
 	if (code != COZYFS_OK)
-		return code;
+		return stats_end(fs, COZYFS_OP_TRANSACTION_BEGIN, start, code);
 	if (crash) {
 		// TODO
 	}
 
 	fs->transaction = TRANSACTION_ON;
-	return COZYFS_OK;
+	return stats_end(fs, COZYFS_OP_TRANSACTION_BEGIN, start, COZYFS_OK);
 }
 
 int cozyfs_transaction_rollback(CozyFS *fs)
@@ -1569,14 +2758,17 @@ int cozyfs_transaction_rollback(CozyFS *fs)
 	if (fs->transaction == TRANSACTION_OFF)
 		return -COZYFS_EINVAL;
 
+	u64 start = stats_begin(fs, COZYFS_OP_TRANSACTION_ROLLBACK, NULL);
+
 	// Discard changes
 	for (int i = 0; i < fs->patch_count; i++)
 		sys_free(fs, fs->patch_ptrs[i], 4096);
 	fs->patch_count = 0;
+	fs->changed = 0;
 
 	unlock(fs);
 	fs->transaction = TRANSACTION_OFF;
-	return COZYFS_OK;
+	return stats_end(fs, COZYFS_OP_TRANSACTION_ROLLBACK, start, COZYFS_OK);
 }
 
 int cozyfs_transaction_commit(CozyFS *fs)
@@ -1584,6 +2776,8 @@ int cozyfs_transaction_commit(CozyFS *fs)
 	if (fs->transaction == TRANSACTION_OFF)
 		return -COZYFS_EINVAL;
 
+	u64 start = stats_begin(fs, COZYFS_OP_TRANSACTION_COMMIT, NULL);
+
 	if (fs->transaction == TRANSACTION_TIMEOUT) {
 
 		// Free patches
@@ -1591,11 +2785,14 @@ int cozyfs_transaction_commit(CozyFS *fs)
 			sys_free(fs, fs->patch_ptrs[i], 4096);
 		}
 		fs->patch_count = 0;
-		return -COZYFS_ETIMEDOUT;
+		return stats_end(fs, COZYFS_OP_TRANSACTION_COMMIT, start, -COZYFS_ETIMEDOUT);
 	}
 
 	// TODO: Verify conflicts
 
+	if (fs->stats)
+		hist_add(&((CozyFSStats*) fs->stats)->patches, fs->patch_count);
+
 	// Apply changes and free patches
 	for (int i = 0; i < fs->patch_count; i++) {
 		void *src = fs->patch_ptrs[i];
@@ -1608,9 +2805,70 @@ int cozyfs_transaction_commit(CozyFS *fs)
 	perform_backup(fs, 0);
 	unlock(fs);
 	fs->transaction = TRANSACTION_OFF;
+	return stats_end(fs, COZYFS_OP_TRANSACTION_COMMIT, start, COZYFS_OK);
+}
+
+unsigned long long cozyfs_changes(CozyFS *fs)
+{
+	RPage *root = (RPage*) fs->mem;
+	return load((u64*) &root->changes);
+}
+
+int cozyfs_wait_change(CozyFS *fs, unsigned long long seen, int timeout_ms)
+{
+	RPage *root = (RPage*) fs->mem;
+	if (load((u64*) &root->changes) != seen)
+		return COZYFS_OK;
+
+	int code = sys_wait(fs, (u64*) &root->changes, seen, timeout_ms);
+	if (code != COZYFS_OK)
+		return code;
+
+	if (load((u64*) &root->changes) != seen)
+		return COZYFS_OK;
+	return -COZYFS_ETIMEDOUT; // Timed out or woken spuriously
+}
+
+int cozyfs_stats(CozyFS *fs, CozyFSStats *stats)
+{
+	const RPage *root = fs->mem;
+	if (root->stats_slots == 0)
+		return -COZYFS_EINVAL;
+
+	// Every field is a counter, so slots are summed word by word
+	my_memset(stats, 0, sizeof(CozyFSStats));
+	u64 *dst = (u64*) stats;
+	for (int i = 0; i < root->stats_slots; i++) {
+		volatile u64 *src = (volatile u64*) ((char*) fs->mem + root->stats + i * sizeof(CozyFSStats));
+		for (int j = 0; j < (int) (sizeof(CozyFSStats) / sizeof(u64)); j++)
+			dst[j] += atomic_load(&src[j]);
+	}
 	return COZYFS_OK;
 }
 
+int cozyfs_usage(CozyFS *fs, CozyFSUsage *usage)
+{
+	const RPage *root = get_root(fs);
+	usage->tot_pages  = root->tot_pages;
+	usage->num_pages  = root->num_pages;
+	usage->free_pages = root->num_free_pages;
+	return COZYFS_OK;
+}
+
+int cozyfs_inspect(CozyFS *fs, CozyFSReport *report, cozyfs_report_callback visit, void *userptr)
+{
+	int code;
+	u64 start = stats_begin(fs, COZYFS_OP_INSPECT, NULL);
+	code = enter_critical_section(fs, -1);
+	if (code != COZYFS_OK)
+		return stats_end(fs, COZYFS_OP_INSPECT, start, code);
+
+	code = inspect_(fs, report, visit, userptr);
+
+	leave_critical_section(fs);
+	return stats_end(fs, COZYFS_OP_INSPECT, start, code);
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Windows callback
 #if OS_WINDOWS
@@ -1639,15 +2897,17 @@ cozyfs_callback_impl(int sysop, void *userptr, void *p, int n)
 
 		case COZYFS_SYSOP_WAIT:
 		{
-			if (!WaitOnAddress((volatile VOID*) word, (PVOID) &old_word, sizeof(u64), timeout_ms < 0 ? INFINITE: (DWORD) timeout_ms))
-				return -EAGAIN;
+			CozyFSWait *wait = p;
+			if (!WaitOnAddress((volatile VOID*) wait->word, (PVOID) &wait->expect, sizeof(u64), wait->timeout_ms < 0 ? INFINITE: (DWORD) wait->timeout_ms))
+				if (GetLastError() != ERROR_TIMEOUT)
+					return -EAGAIN;
 			return 0;
 		}
 		break;
 
 		case COZYFS_SYSOP_WAKE:
 		{
-			WakeByAddressAll((PVOID) word);
+			WakeByAddressAll(p);
 			return 0;
 		}
 		break;
@@ -1673,6 +2933,25 @@ cozyfs_callback_impl(int sysop, void *userptr, void *p, int n)
 			return (uli.QuadPart - 116444736000000000ULL) / 10000000ULL;
 		}
 		break;
+
+		case COZYFS_SYSOP_TRACE:
+		{
+			return 0; // No tracer
+		}
+		break;
+
+		case COZYFS_SYSOP_CLOCK:
+		{
+			static LARGE_INTEGER freq;
+			if (freq.QuadPart == 0)
+				QueryPerformanceFrequency(&freq);
+
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			return (now.QuadPart / freq.QuadPart) * 1000000000ULL
+				+ (now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+		}
+		break;
 	}
 
 	return -1; // unreachable
@@ -1684,11 +2963,12 @@ cozyfs_callback_impl(int sysop, void *userptr, void *p, int n)
 #if OS_LINUX
 
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
 #include <linux/futex.h>
-#define CLOCK_REALTIME 0
+#include <time.h>
 
 u64 cozyfs_callback_impl(int sysop, void *userptr, void *p, int n)
 {
@@ -1699,7 +2979,7 @@ u64 cozyfs_callback_impl(int sysop, void *userptr, void *p, int n)
 		case COZYFS_SYSOP_MALLOC:
 		{
 			void *addr = mmap(NULL, n, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-			if (*addr == MAP_FAILED)
+			if (addr == MAP_FAILED)
 				return 0;
 			return (u64) addr;
 		}
@@ -1713,22 +2993,26 @@ u64 cozyfs_callback_impl(int sysop, void *userptr, void *p, int n)
 
 		case COZYFS_SYSOP_WAIT:
 		{
+			CozyFSWait *wait = p;
 			struct timespec ts;
 			struct timespec *tsptr;
 
-			if (timeout_ms < 0)
+			if (wait->timeout_ms < 0)
 				tsptr = NULL;
 			else {
-				ts.tv_sec = timeout_ms / 1000;
-				ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+				ts.tv_sec = wait->timeout_ms / 1000;
+				ts.tv_nsec = (wait->timeout_ms % 1000) * 1000000;
+				tsptr = &ts;
 			}
 
+			// Futexes are 32 bits wide, so only the low half
+			// of the word is compared (little endian)
 			errno = 0;
 			long ret = syscall(
 				SYS_futex,
-				(unsigned int*) word,
+				(unsigned int*) wait->word,
 				FUTEX_WAIT,
-				(unsigned int) old_word,
+				(unsigned int) wait->expect,
 				tsptr,
 				NULL,
 				0
@@ -1744,7 +3028,7 @@ u64 cozyfs_callback_impl(int sysop, void *userptr, void *p, int n)
 			errno = 0;
 			long ret = syscall(
 				SYS_futex,
-				(unsigned int*) word,
+				(unsigned int*) p,
 				FUTEX_WAKE,
 				INT_MAX,
 				NULL,
@@ -1777,6 +3061,22 @@ u64 cozyfs_callback_impl(int sysop, void *userptr, void *p, int n)
 			return ts.tv_sec;
 		}
 		break;
+
+		case COZYFS_SYSOP_TRACE:
+		{
+			return 0; // No tracer
+		}
+		break;
+
+		case COZYFS_SYSOP_CLOCK:
+		{
+			// Through the vDSO, as it's called around every operation
+			struct timespec ts;
+			if (clock_gettime(CLOCK_MONOTONIC, &ts))
+				return 0;
+			return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+		}
+		break;
 	}
 
 	return -1; // unreachable
@@ -39,6 +39,9 @@ enum {
 	COZYFS_ESYSTIME,
 	COZYFS_ESYSWAIT,
 	COZYFS_ESYSWAKE,
+	COZYFS_ENOTDIR,
+	COZYFS_EEXIST,
+	COZYFS_ENOTEMPTY,
 };
 
 enum {
@@ -59,6 +62,8 @@ enum {
 	COZYFS_SYSOP_WAKE,
 	COZYFS_SYSOP_SYNC,
 	COZYFS_SYSOP_TIME,
+	COZYFS_SYSOP_CLOCK, // Monotonic nanoseconds for statistics, or 0 if unsupported
+	COZYFS_SYSOP_TRACE, // Receives a CozyFSTraceEvent, see below
 };
 
 enum {
@@ -67,8 +72,120 @@ enum {
 	COZYFS_SYSRES_UNDEFINED,
 };
 
+typedef struct {
+	const void *ptr;
+	int         len;
+} CozyFSSpan;
+
+typedef struct {
+	unsigned int id; // Stable for the lifetime of the entity
+	unsigned int size;
+	unsigned int gen;   // Changes whenever the contents do
+	unsigned int mtime; // Seconds since the epoch
+	int          is_dir;
+} CozyFSStat;
+
+typedef struct {
+	char       name[129]; // Zero-terminated
+	CozyFSStat stat;
+} CozyFSDirEntry;
+
+// Argument of COZYFS_SYSOP_WAIT. The callback blocks while "*word"
+// equals "expect", for at most "timeout_ms" (forever if negative).
+// COZYFS_SYSOP_WAKE receives the word itself and wakes all waiters.
+typedef struct {
+	volatile unsigned long long *word;
+	unsigned long long           expect;
+	int                          timeout_ms;
+} CozyFSWait;
+
 typedef unsigned long long (*cozyfs_callback)(int sysop, void *userptr, void *p, int n);
 
+// Public entry points whose latencies are recorded. The functions
+// that read shared counters without taking the lock (cozyfs_changes,
+// cozyfs_wait_change, cozyfs_stats and cozyfs_usage) are left out,
+// since watchers and monitoring poll them continuously.
+enum {
+	COZYFS_OP_LINK,
+	COZYFS_OP_UNLINK,
+	COZYFS_OP_MKDIR,
+	COZYFS_OP_RMDIR,
+	COZYFS_OP_MKUSR,
+	COZYFS_OP_RMUSR,
+	COZYFS_OP_CHOWN,
+	COZYFS_OP_CHMOD,
+	COZYFS_OP_OPEN,
+	COZYFS_OP_CREATE,
+	COZYFS_OP_CLOSE,
+	COZYFS_OP_READ,
+	COZYFS_OP_WRITE,
+	COZYFS_OP_READ_SPANS,
+	COZYFS_OP_SEEK,
+	COZYFS_OP_FSTAT,
+	COZYFS_OP_STAT,
+	COZYFS_OP_READDIR,
+	COZYFS_OP_TRANSACTION_BEGIN,
+	COZYFS_OP_TRANSACTION_COMMIT,
+	COZYFS_OP_TRANSACTION_ROLLBACK,
+	COZYFS_OP_INSPECT,
+	COZYFS_OP_READ_PATH,
+	COZYFS_OP_COUNT,
+};
+
+// Bucket "i" counts the values in [2^(i-1), 2^i), so bucket 0 holds
+// zeros. Times are in nanoseconds as returned by COZYFS_SYSOP_CLOCK.
+#define COZYFS_HIST_BUCKETS 48
+
+typedef struct {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long buckets[COZYFS_HIST_BUCKETS];
+} CozyFSHistogram;
+
+typedef struct {
+	CozyFSHistogram    ops[COZYFS_OP_COUNT];
+	unsigned long long errors[COZYFS_OP_COUNT];
+	CozyFSHistogram    lock_wait;
+	CozyFSHistogram    lock_hold;
+	CozyFSHistogram    patches;      // Pages patched per committed transaction
+	CozyFSHistogram    backup_time;
+	unsigned long long backup_bytes;
+	unsigned long long crashes;      // Locks found abandoned
+} CozyFSStats;
+
+// COZYFS_SYSOP_TRACE is issued with a NULL event when attaching, and
+// events are only delivered if the callback returns 1 to it. Events are
+// reported synchronously by the thread performing the operation, and
+// some while the lock is held, so the callback should be quick.
+enum {
+	COZYFS_TRACE_OP_BEGIN,     // "op" is starting
+	COZYFS_TRACE_OP_END,       // "op" returned "code" after "value" ns
+	COZYFS_TRACE_LOCK_ACQUIRE, // After waiting "value" ns. "code" is 1 if the previous holder crashed
+	COZYFS_TRACE_LOCK_RELEASE, // After holding it "value" ns
+	COZYFS_TRACE_PATCH,        // A transaction copied the page at offset "value"
+	COZYFS_TRACE_BACKUP_BEGIN, // "code" is 1 when restoring the snapshot after a crash
+	COZYFS_TRACE_BACKUP_END,   // "value" bytes were copied
+};
+
+// Arguments of the public function, as passed by the caller. Fields
+// the function doesn't take are NULL or 0.
+typedef struct {
+	const char  *path;
+	const char  *path2;  // New path of link, owner of chown
+	int          fd;
+	int          num;    // Bytes, entries, mode or offset
+	unsigned int cursor; // Value of readdir's cursor on entry
+} CozyFSTraceArgs;
+
+typedef struct {
+	int                    type;
+	int                    op;   // COZYFS_OP_*, or -1 if not relevant
+	int                    code;
+	unsigned long long     value;
+	unsigned long long     time; // As returned by COZYFS_SYSOP_CLOCK
+	const CozyFSTraceArgs *args; // Operation events only
+} CozyFSTraceEvent;
+
 typedef struct {
 	const void*        mem;
 	void*              userptr;
@@ -77,6 +194,11 @@ typedef struct {
 	unsigned long long ticket;
 	int                transaction;
 	int                patch_count;
+	int                changed; // Published to watchers by unlocking
+	void*              stats;   // This process's slot, or NULL
+	int                trace;   // The callback wants COZYFS_SYSOP_TRACE events
+	const CozyFSTraceArgs *trace_args; // Of the running operation
+	unsigned long long locked_at;
 	unsigned int       patch_offs[COZYFS_MAX_PATCHES];
 	void*              patch_ptrs[COZYFS_MAX_PATCHES];
 } CozyFS;
@@ -99,14 +221,108 @@ int  cozyfs_rmusr  (CozyFS *fs, const char *name);
 int  cozyfs_chown  (CozyFS *fs, const char *path, const char *newowner);
 int  cozyfs_chmod  (CozyFS *fs, const char *path, int mode);
 
+// Opening a missing file fails with COZYFS_ENOENT. cozyfs_create
+// makes the file if it doesn't exist and then opens it.
 int  cozyfs_open   (CozyFS *fs, const char *path);
+int  cozyfs_create (CozyFS *fs, const char *path);
 int  cozyfs_close  (CozyFS *fs, int fd);
 
 int  cozyfs_read   (CozyFS *fs, int fd, void       *dst, int max);
 int  cozyfs_write  (CozyFS *fs, int fd, const void *src, int len);
 
+// Zero-copy variant of cozyfs_read. Instead of copying, it fills "spans"
+// with pointers to the file's pages starting at the cursor, advances the
+// cursor and returns the number of spans. The pointers refer to the shared
+// memory and behave like sendfile would: they stay valid while the memory
+// is mapped, and when called inside a transaction they may point to
+// patches released at commit. Outside of transactions, pages are only freed once the file has no
+// links and no handles, and appends leave the bytes before the end as
+// they are, so the spans hold the same bytes for as long as "fd" is open.
+int  cozyfs_read_spans (CozyFS *fs, int fd, CozyFSSpan *spans, int max);
+
+// Copies up to "max" bytes from the start of the file at "path" without
+// opening it. Since no handle is taken, nothing is written to the arena,
+// so reading many files in one transaction doesn't use up its patches.
+int  cozyfs_read_path  (CozyFS *fs, const char *path, void *dst, int max);
+
+// Moves the cursor of "fd" to "offset". Sequential reads and seeks near
+// the previous position or the end of the file don't walk the whole file.
+int  cozyfs_seek   (CozyFS *fs, int fd, unsigned int offset);
+int  cozyfs_fstat  (CozyFS *fs, int fd, CozyFSStat *buf);
+int  cozyfs_stat   (CozyFS *fs, const char *path, CozyFSStat *buf);
+
+// Lists up to "max" entries of a directory starting from "*cursor",
+// which should be zero at first and is moved past the returned entries.
+// Returns zero when there are no more. Each call holds the lock briefly,
+// so large directories are best listed in batches.
+int  cozyfs_readdir(CozyFS *fs, const char *path, unsigned int *cursor, CozyFSDirEntry *entries, int max);
+
 int  cozyfs_transaction_begin    (CozyFS *fs);
 int  cozyfs_transaction_commit   (CozyFS *fs);
 int  cozyfs_transaction_rollback (CozyFS *fs);
 
+// Every critical section that modifies the file system bumps a shared
+// counter. Watchers read it with cozyfs_changes, check what they care
+// about, then block in cozyfs_wait_change until it moves past "seen".
+// That returns -COZYFS_ETIMEDOUT when it didn't, possibly before the
+// timeout expires. Negative timeouts wait forever.
+unsigned long long cozyfs_changes     (CozyFS *fs);
+int                cozyfs_wait_change (CozyFS *fs, unsigned long long seen, int timeout_ms);
+
+// Arenas of at least COZYFS_STATS_MIN_LEN bytes reserve some space at
+// the end for statistics. Processes update one of a few slots with
+// atomic additions and this sums them up without taking the lock, so
+// the totals may be slightly inconsistent with each other. Returns
+// -COZYFS_EINVAL if the arena has no statistics.
+#define COZYFS_STATS_MIN_LEN (1UL << 20)
+int                cozyfs_stats       (CozyFS *fs, CozyFSStats *stats);
+
+// Page counters of the arena, read without taking the lock
+typedef struct {
+	int tot_pages;
+	int num_pages;  // Ever handed out, including the ones now free
+	int free_pages;
+} CozyFSUsage;
+int                cozyfs_usage       (CozyFS *fs, CozyFSUsage *usage);
+
+// Filled by cozyfs_inspect. Files reached through several links are
+// counted once per entity.
+typedef struct {
+	int tot_pages;
+	int num_pages;     // Ever handed out, including the ones now free
+	int dpages;
+	int fpages;
+	int hpages;
+	int upages;
+	int xpages;        // Length of the free list
+	int lost_pages;    // Handed out but not reached by the walk
+	int num_dirs;      // Including the root
+	int num_files;
+	int link_slots;    // In the pages of all directories
+	int used_links;
+	int entity_slots;
+	int used_entities;
+	int open_handles;
+	unsigned long long file_bytes;
+	unsigned long long fpage_slack;  // File page bytes not holding contents
+	unsigned long long backup_bytes; // Copy of the arena used for recovery
+	unsigned long long stats_bytes;
+} CozyFSReport;
+
+typedef struct {
+	const char  *path;
+	unsigned int id;      // As in CozyFSStat
+	int          is_dir;
+	int          pages;   // Length of the page chain
+	int          entries; // Directories only
+	unsigned int size;    // Files only
+} CozyFSReportEntry;
+
+typedef void (*cozyfs_report_callback)(void *userptr, const CozyFSReportEntry *entry);
+
+// Walks the whole arena under the lock without modifying it, calling
+// "visit" (if not NULL) for every directory and for every link to a
+// file, so files with several links are visited once through each
+int                cozyfs_inspect     (CozyFS *fs, CozyFSReport *report, cozyfs_report_callback visit, void *userptr);
+
 #endif // COZYFS_H
\ No newline at end of file
@@ -24,7 +24,7 @@ int create_queue(CozyQueue *queue, char *name, int num_prios)
 	for (int i = 0; i < num_prios; i++) {
 		char path[1<<10];
 		snprintf(path, sizeof(path), "/queues/%s/prio_%d\n", name, i);
-		code = cozyfs_open(&queue->fs, path);
+		code = cozyfs_create(&queue->fs, path);
 		if (code < 0) goto error;
 	}
 
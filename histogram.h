@@ -0,0 +1,71 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <time.h>
+
+// Latency histograms shared by the benchmarks. Values are recorded in
+// log-linear buckets: 16 sub-buckets for each power of two, so
+// percentiles are within about 6% of the truth.
+
+typedef unsigned long long u64;
+
+#define SUB_BITS    4
+#define NUM_BUCKETS (64 << SUB_BITS)
+
+typedef struct {
+	u64 count;
+	u64 buckets[NUM_BUCKETS];
+} Histogram;
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of(u64 ns)
+{
+	if (ns < (1 << SUB_BITS))
+		return ns;
+	int msb = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+	return ((msb - SUB_BITS + 1) << SUB_BITS) + sub;
+}
+
+// Lower bound of the bucket
+static u64 bucket_value(int bucket)
+{
+	if (bucket < (1 << SUB_BITS))
+		return bucket;
+	int msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+	int sub = bucket & ((1 << SUB_BITS) - 1);
+	return ((u64) 1 << msb) | ((u64) sub << (msb - SUB_BITS));
+}
+
+static void record(Histogram *h, u64 ns)
+{
+	h->count++;
+	h->buckets[bucket_of(ns)]++;
+}
+
+static void merge(Histogram *dst, const Histogram *src)
+{
+	dst->count += src->count;
+	for (int i = 0; i < NUM_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+static u64 percentile(const Histogram *h, double p)
+{
+	u64 target = h->count * p;
+	u64 seen = 0;
+	for (int i = 0; i < NUM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > target)
+			return bucket_value(i);
+	}
+	return 0;
+}
+
+#endif // HISTOGRAM_H
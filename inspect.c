@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cozyfs.h"
+
+// Reports how the space of an existing arena is used: pages by type,
+// the free list, slack in directory and file pages, the overhead of
+// the backup and of transaction patches, and the directories and
+// files that are largest or have the longest page chains.
+//
+//   ./inspect [-n top] FILE
+//   ./inspect [-n top] -s SHM_NAME
+//
+// The contents aren't modified, but the walk holds the lock of the
+// arena like any other operation, so the mapping is writable.
+
+typedef unsigned long long u64;
+
+#define COUNT(X) (int) (sizeof(X) / sizeof((X)[0]))
+#define MAX_TOP 100
+
+typedef struct {
+	char        *path;
+	unsigned int id;
+	u64          key;
+	int          pages;
+	int          entries;
+	unsigned int size;
+} Top;
+
+typedef struct {
+	int num_top;
+	int num_dirs;
+	int num_files;
+	Top dirs[MAX_TOP];  // By number of entries
+	Top files[MAX_TOP]; // By size
+} Collector;
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Utilities
+
+static double percent(u64 part, u64 total)
+{
+	if (total == 0)
+		return 0;
+	return 100.0 * part / total;
+}
+
+static const char *human(u64 bytes, char *buf, int max)
+{
+	const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+	double value = bytes;
+	int unit = 0;
+	while (value >= 1024 && unit+1 < COUNT(units)) {
+		value /= 1024;
+		unit++;
+	}
+	snprintf(buf, max, unit ? "%.1f %s" : "%.0f %s", value, units[unit]);
+	return buf;
+}
+
+// Keeps the "max" entries with the largest keys, in descending order
+static void insert_top(Top *top, int *num, int max, Top item)
+{
+	if (*num == max && top[max-1].key >= item.key)
+		return;
+
+	if (*num == max)
+		free(top[--(*num)].path);
+
+	item.path = strdup(item.path);
+	if (item.path == NULL)
+		return;
+
+	int i = *num;
+	while (i > 0 && top[i-1].key < item.key) {
+		top[i] = top[i-1];
+		i--;
+	}
+	top[i] = item;
+	(*num)++;
+}
+
+// Files are visited once per link, and only the first path reaching
+// each is listed. If that one didn't make the list, the other links
+// can't either since they have the same size.
+static void visit(void *userptr, const CozyFSReportEntry *entry)
+{
+	Collector *c = userptr;
+	if (entry->is_dir) {
+		Top item = { (char*) entry->path, entry->id, entry->entries, entry->pages, entry->entries, 0 };
+		insert_top(c->dirs, &c->num_dirs, c->num_top, item);
+	} else {
+		for (int i = 0; i < c->num_files; i++)
+			if (c->files[i].id == entry->id)
+				return;
+		Top item = { (char*) entry->path, entry->id, entry->size, entry->pages, 0, entry->size };
+		insert_top(c->files, &c->num_files, c->num_top, item);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Report
+
+static void print_report(CozyFS *fs, CozyFSReport *r, Collector *c)
+{
+	char buf[32];
+
+	printf("Pages\n");
+	printf("  total         %8d (%s)\n", r->tot_pages, human((u64) r->tot_pages * 4096, buf, sizeof(buf)));
+	printf("  handed out    %8d (%.1f%%)\n", r->num_pages, percent(r->num_pages, r->tot_pages));
+	printf("  never used    %8d (%.1f%%)\n", r->tot_pages - r->num_pages, percent(r->tot_pages - r->num_pages, r->tot_pages));
+	printf("  root          %8d\n", 1);
+	printf("  directory     %8d (%.1f%%)\n", r->dpages, percent(r->dpages, r->tot_pages));
+	printf("  file          %8d (%.1f%%)\n", r->fpages, percent(r->fpages, r->tot_pages));
+	printf("  handle        %8d\n", r->hpages);
+	printf("  user          %8d\n", r->upages);
+	printf("  free list     %8d (%.1f%%)\n", r->xpages, percent(r->xpages, r->tot_pages));
+	if (r->lost_pages > 0)
+		printf("  unreachable   %8d\n", r->lost_pages);
+
+	printf("\nEntities\n");
+	printf("  directories   %8d\n", r->num_dirs);
+	printf("  files         %8d (%s)\n", r->num_files, human(r->file_bytes, buf, sizeof(buf)));
+	printf("  open handles  %8d\n", r->open_handles);
+
+	printf("\nFragmentation\n");
+	printf("  link slots    %8d used of %d (%.1f%%)\n", r->used_links, r->link_slots, percent(r->used_links, r->link_slots));
+	printf("  entity slots  %8d used of %d (%.1f%%)\n", r->used_entities, r->entity_slots, percent(r->used_entities, r->entity_slots));
+	printf("  file slack    %8s (%.1f%% of file pages)\n", human(r->fpage_slack, buf, sizeof(buf)),
+		percent(r->fpage_slack, (u64) r->fpages * 4096));
+
+	printf("\nOverhead\n");
+	printf("  backup        %8s\n", human(r->backup_bytes, buf, sizeof(buf)));
+	printf("  statistics    %8s\n", human(r->stats_bytes, buf, sizeof(buf)));
+
+	// Patches live in the memory of the process running the
+	// transaction, so only the statistics know about them
+	CozyFSStats stats;
+	if (cozyfs_stats(fs, &stats) == 0 && stats.patches.count > 0) {
+		int peak = 0;
+		for (int i = 0; i < COZYFS_HIST_BUCKETS; i++)
+			if (stats.patches.buckets[i])
+				peak = i;
+		double mean = (double) stats.patches.sum / stats.patches.count;
+		printf("  patches       %8.1f pages per transaction (%s), at most %llu\n", mean,
+			human(mean * 4096, buf, sizeof(buf)), peak ? (1ULL << peak) - 1 : 0);
+	}
+
+	printf("\nDirectories by entries\n");
+	printf("  %8s %6s  %s\n", "entries", "pages", "path");
+	for (int i = 0; i < c->num_dirs; i++)
+		printf("  %8d %6d  %s\n", c->dirs[i].entries, c->dirs[i].pages, c->dirs[i].path);
+
+	printf("\nFiles by size\n");
+	printf("  %8s %6s  %s\n", "size", "pages", "path");
+	for (int i = 0; i < c->num_files; i++)
+		printf("  %8s %6d  %s\n", human(c->files[i].size, buf, sizeof(buf)), c->files[i].pages, c->files[i].path);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Entry point
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	const char *shm  = NULL;
+	int num_top = 10;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i+1 < argc)
+			num_top = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-s") && i+1 < argc)
+			shm = argv[++i];
+		else if (argv[i][0] != '-' && path == NULL)
+			path = argv[i];
+		else {
+			path = shm = NULL;
+			break;
+		}
+	}
+	if ((path == NULL) == (shm == NULL)) {
+		fprintf(stderr, "Usage: %s [-n top] FILE\n", argv[0]);
+		fprintf(stderr, "       %s [-n top] -s SHM_NAME\n", argv[0]);
+		return -1;
+	}
+	if (num_top < 1) num_top = 1;
+	if (num_top > MAX_TOP) num_top = MAX_TOP;
+
+	int fd = path ? open(path, O_RDWR) : shm_open(shm, O_RDWR, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Couldn't open '%s'\n", path ? path : shm);
+		return -1;
+	}
+
+	struct stat buf;
+	if (fstat(fd, &buf) < 0 || buf.st_size < 4096) {
+		fprintf(stderr, "Error: '%s' is too small to be an arena\n", path ? path : shm);
+		close(fd);
+		return -1;
+	}
+
+	void *mem = mmap(NULL, buf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		fprintf(stderr, "Error: Couldn't map the arena\n");
+		return -1;
+	}
+
+	CozyFS fs;
+	cozyfs_attach(&fs, mem, NULL, cozyfs_callback_impl, NULL);
+
+	static Collector c;
+	c.num_top = num_top;
+
+	CozyFSReport report;
+	int code = cozyfs_inspect(&fs, &report, visit, &c);
+	if (code < 0) {
+		fprintf(stderr, "Error: Couldn't inspect the arena (%d)\n", code);
+		munmap(mem, buf.st_size);
+		return -1;
+	}
+
+	print_report(&fs, &report, &c);
+	munmap(mem, buf.st_size);
+	return 0;
+}
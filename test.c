@@ -1,52 +1,585 @@
 #include <stdio.h>
+#include <string.h>
 #include "cozyfs.h"
 
-#define TEST_START do { char mem[1<<16]; CozyFS fs; cozyfs_init(mem, sizeof(mem), 0, 0); cozyfs_attach(&fs, mem, (void*) 0, cozyfs_callback_impl, (void*) 0);
+// Arenas are large enough to have statistics
+#define TEST_START do { static char mem[1<<20]; CozyFS fs; cozyfs_init(mem, sizeof(mem), 0, 0); cozyfs_attach(&fs, mem, (void*) 0, cozyfs_callback_impl, (void*) 0);
 #define TEST_END } while (0);
 #define TEST_RESTART TEST_END; TEST_START;
 
-#define TEST_ASSERT(X) if (!(X)) { printf("Test failed at %s:%d\n", __FILE__, __LINE__); break; }
+#define TEST_ASSERT(X) if (!(X)) { printf("Test failed at %s:%d\n", __FILE__, __LINE__); failed++; break; }
+
+static int failed;
+
+// Creates "path" holding "len" bytes of "src"
+static int make_file(CozyFS *fs, const char *path, const char *src, int len)
+{
+	int fd = cozyfs_create(fs, path);
+	if (fd < 0)
+		return fd;
+	int num = cozyfs_write(fs, fd, src, len);
+	cozyfs_close(fs, fd);
+	return num == len ? 0 : -1;
+}
 
 static void test_mkdir(void)
 {
 	TEST_START;
-	TEST_ASSERT(cozyfs_mkdir(&fs, "???") == COZYFS_EBADF);
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/a") == 0);
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/a") == -COZYFS_EEXIST);
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/a/b") == 0);
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/x/y") == -COZYFS_ENOENT);
+	TEST_ASSERT(cozyfs_rmdir(&fs, "/a") == -COZYFS_ENOTEMPTY);
+	TEST_ASSERT(cozyfs_rmdir(&fs, "/a/b") == 0);
+	TEST_ASSERT(cozyfs_rmdir(&fs, "/a") == 0);
+	TEST_ASSERT(cozyfs_rmdir(&fs, "/a") == -COZYFS_ENOENT);
 	TEST_RESTART;
-	TEST_ASSERT(cozyfs_mkdir(&fs, "???") == COZYFS_EBADF);
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/") == -COZYFS_EPERM);
+	TEST_ASSERT(cozyfs_rmdir(&fs, "/") == -COZYFS_EPERM);
 	TEST_END;
 }
 
-int main(void)
+static void test_create(void)
 {
-	test_mkdir();
+	TEST_START;
+	TEST_ASSERT(cozyfs_open(&fs, "/f") == -COZYFS_ENOENT);
+	int fd = cozyfs_create(&fs, "/f");
+	TEST_ASSERT(fd >= 0);
+	TEST_ASSERT(cozyfs_write(&fs, fd, "hello", 5) == 5);
+	TEST_ASSERT(cozyfs_close(&fs, fd) == 0);
+	TEST_ASSERT(cozyfs_close(&fs, fd) == -COZYFS_EBADF);
+
+	// Creating an existing file opens it without truncating
+	fd = cozyfs_create(&fs, "/f");
+	TEST_ASSERT(fd >= 0);
+	char buf[16];
+	TEST_ASSERT(cozyfs_read(&fs, fd, buf, sizeof(buf)) == 5);
+	TEST_ASSERT(!memcmp(buf, "hello", 5));
+	TEST_ASSERT(cozyfs_close(&fs, fd) == 0);
+
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/d") == 0);
+	TEST_ASSERT(cozyfs_open(&fs, "/d") == -COZYFS_EISDIR);
+	TEST_ASSERT(cozyfs_create(&fs, "/d") == -COZYFS_EISDIR);
+	TEST_ASSERT(cozyfs_create(&fs, "/f/x") == -COZYFS_ENOTDIR);
+	TEST_END;
+}
+
+// Each close bumps the generation of the handle slot, which must
+// wrap before the descriptors it's packed into turn negative
+static void test_reopen(void)
+{
+	TEST_START;
+	TEST_ASSERT(make_file(&fs, "/f", "x", 1) == 0);
+	int first = cozyfs_open(&fs, "/f");
+	TEST_ASSERT(first >= 0);
+	TEST_ASSERT(cozyfs_close(&fs, first) == 0);
+	for (int i = 0; i < 70000; i++) {
+		int fd = cozyfs_open(&fs, "/f");
+		TEST_ASSERT(fd >= 0);
+		TEST_ASSERT(cozyfs_close(&fs, fd) == 0);
+	}
+	TEST_ASSERT(cozyfs_close(&fs, first) == -COZYFS_EBADF);
+	TEST_END;
+}
+
+static void test_unlink(void)
+{
+	TEST_START;
+	TEST_ASSERT(make_file(&fs, "/a", "a", 1) == 0);
+	TEST_ASSERT(make_file(&fs, "/b", "b", 1) == 0);
+	TEST_ASSERT(cozyfs_link(&fs, "/a", "/c") == 0);
+	TEST_ASSERT(cozyfs_link(&fs, "/a", "/b") == -COZYFS_EEXIST);
+	TEST_ASSERT(cozyfs_unlink(&fs, "/a") == 0);
+	TEST_ASSERT(cozyfs_unlink(&fs, "/a") == -COZYFS_ENOENT);
+
+	// The other link keeps the contents alive
+	int fd = cozyfs_open(&fs, "/c");
+	TEST_ASSERT(fd >= 0);
+	char buf[4];
+	TEST_ASSERT(cozyfs_read(&fs, fd, buf, sizeof(buf)) == 1 && buf[0] == 'a');
+	TEST_ASSERT(cozyfs_close(&fs, fd) == 0);
+
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/d") == 0);
+	TEST_ASSERT(cozyfs_unlink(&fs, "/d") == -COZYFS_EISDIR);
+	TEST_ASSERT(cozyfs_rmdir(&fs, "/b") == -COZYFS_ENOTDIR);
+	TEST_END;
+}
+
+// Directories span several pages once they have more entries than fit
+// in one. Removed entries leave no holes.
+static void test_large_dir(void)
+{
+	TEST_START;
+	char path[32];
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/d") == 0);
+	int i;
+	for (i = 0; i < 100; i++) {
+		snprintf(path, sizeof(path), "/d/f%d", i);
+		if (make_file(&fs, path, path, strlen(path)) < 0)
+			break;
+	}
+	TEST_ASSERT(i == 100);
+
+	for (i = 0; i < 100; i += 3) {
+		snprintf(path, sizeof(path), "/d/f%d", i);
+		if (cozyfs_unlink(&fs, path) < 0)
+			break;
+	}
+	TEST_ASSERT(i >= 100);
+
+	static CozyFSDirEntry entries[128];
+	unsigned int cursor = 0;
+	TEST_ASSERT(cozyfs_readdir(&fs, "/d", &cursor, entries, 128) == 66);
+	TEST_ASSERT(cozyfs_readdir(&fs, "/d", &cursor, entries, 128) == 0);
+
+	// Slots of removed entries are reused
+	CozyFSUsage before, after;
+	TEST_ASSERT(cozyfs_usage(&fs, &before) == 0);
+	TEST_ASSERT(make_file(&fs, "/d/new", "", 0) == 0);
+	TEST_ASSERT(cozyfs_usage(&fs, &after) == 0);
+	TEST_ASSERT(after.num_pages == before.num_pages);
+
+	// Every page of the directory is freed with it
+	for (i = 0; i < 100; i++) {
+		snprintf(path, sizeof(path), "/d/f%d", i);
+		if (i % 3 && cozyfs_unlink(&fs, path) < 0)
+			break;
+	}
+	TEST_ASSERT(i == 100);
+	TEST_ASSERT(cozyfs_unlink(&fs, "/d/new") == 0);
+	TEST_ASSERT(cozyfs_rmdir(&fs, "/d") == 0);
+	CozyFSReport report;
+	TEST_ASSERT(cozyfs_inspect(&fs, &report, (void*) 0, (void*) 0) == 0);
+	TEST_ASSERT(report.lost_pages == 0);
+	TEST_END;
+}
+
+static void test_seek(void)
+{
+	TEST_START;
+	static char data[10000];
+	for (int i = 0; i < (int) sizeof(data); i++)
+		data[i] = i % 251;
+	TEST_ASSERT(make_file(&fs, "/f", data, sizeof(data)) == 0);
+
+	int fd = cozyfs_open(&fs, "/f");
+	TEST_ASSERT(fd >= 0);
+
+	char buf[100];
+	TEST_ASSERT(cozyfs_seek(&fs, fd, 5000) == 0);
+	TEST_ASSERT(cozyfs_read(&fs, fd, buf, sizeof(buf)) == 100);
+	TEST_ASSERT(!memcmp(buf, data + 5000, 100));
+
+	// Backwards, across a page boundary
+	TEST_ASSERT(cozyfs_seek(&fs, fd, 4050) == 0);
+	TEST_ASSERT(cozyfs_read(&fs, fd, buf, sizeof(buf)) == 100);
+	TEST_ASSERT(!memcmp(buf, data + 4050, 100));
+
+	TEST_ASSERT(cozyfs_seek(&fs, fd, sizeof(data)) == 0);
+	TEST_ASSERT(cozyfs_read(&fs, fd, buf, sizeof(buf)) == 0);
+	TEST_ASSERT(cozyfs_seek(&fs, fd, sizeof(data) + 1) == -COZYFS_EINVAL);
+	TEST_ASSERT(cozyfs_close(&fs, fd) == 0);
+	TEST_END;
+}
+
+static void test_read_spans(void)
+{
+	TEST_START;
+	static char data[10000];
+	for (int i = 0; i < (int) sizeof(data); i++)
+		data[i] = i % 251;
+	TEST_ASSERT(make_file(&fs, "/f", data, sizeof(data)) == 0);
+
+	int fd = cozyfs_open(&fs, "/f");
+	TEST_ASSERT(fd >= 0);
+	TEST_ASSERT(cozyfs_seek(&fs, fd, 10) == 0);
+
+	// One span per page, the first one starting at the cursor
+	CozyFSSpan spans[8];
+	int num = cozyfs_read_spans(&fs, fd, spans, 2);
+	TEST_ASSERT(num == 2);
+	int off = 10;
+	for (int i = 0; i < num; i++) {
+		if (memcmp(spans[i].ptr, data + off, spans[i].len))
+			break;
+		off += spans[i].len;
+	}
+	TEST_ASSERT(off == 10 + spans[0].len + spans[1].len);
+
+	// The cursor moved past the spans
+	num = cozyfs_read_spans(&fs, fd, spans, 8);
+	TEST_ASSERT(num == 1);
+	TEST_ASSERT(off + spans[0].len == (int) sizeof(data));
+	TEST_ASSERT(!memcmp(spans[0].ptr, data + off, spans[0].len));
+	TEST_ASSERT(cozyfs_read_spans(&fs, fd, spans, 8) == 0);
+	TEST_ASSERT(cozyfs_close(&fs, fd) == 0);
+	TEST_END;
+}
+
+static void test_read_path(void)
+{
+	TEST_START;
+	static char data[10000];
+	for (int i = 0; i < (int) sizeof(data); i++)
+		data[i] = i % 251;
+	TEST_ASSERT(make_file(&fs, "/f", data, sizeof(data)) == 0);
+
+	static char buf[sizeof(data) + 1];
+	TEST_ASSERT(cozyfs_read_path(&fs, "/f", buf, sizeof(buf)) == (int) sizeof(data));
+	TEST_ASSERT(!memcmp(buf, data, sizeof(data)));
+	TEST_ASSERT(cozyfs_read_path(&fs, "/f", buf, 5000) == 5000);
+	TEST_ASSERT(!memcmp(buf, data, 5000));
+	TEST_ASSERT(cozyfs_read_path(&fs, "/x", buf, 1) == -COZYFS_ENOENT);
+	TEST_ASSERT(cozyfs_read_path(&fs, "/", buf, 1) == -COZYFS_EISDIR);
+
+	// Reading files in more directories than a transaction has
+	// patches doesn't use any of them. The files are empty so
+	// that the directories fit in the arena.
+	TEST_RESTART;
+	char path[32];
+	int i;
+	for (i = 0; i < 150; i++) {
+		snprintf(path, sizeof(path), "/d%d", i);
+		if (cozyfs_mkdir(&fs, path) < 0)
+			break;
+		snprintf(path, sizeof(path), "/d%d/f", i);
+		if (make_file(&fs, path, "", 0) < 0)
+			break;
+	}
+	TEST_ASSERT(i == 150);
+	TEST_ASSERT(cozyfs_transaction_begin(&fs) == 0);
+	for (i = 0; i < 150; i++) {
+		snprintf(path, sizeof(path), "/d%d/f", i);
+		char c;
+		if (cozyfs_read_path(&fs, path, &c, 1) != 0)
+			break;
+	}
+	TEST_ASSERT(i == 150);
+	TEST_ASSERT(cozyfs_transaction_rollback(&fs) == 0);
+	TEST_END;
+}
+
+static void test_stat(void)
+{
+	TEST_START;
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/d") == 0);
+	TEST_ASSERT(make_file(&fs, "/d/f", "abc", 3) == 0);
+
+	CozyFSStat root, dir, file;
+	TEST_ASSERT(cozyfs_stat(&fs, "/", &root) == 0 && root.is_dir);
+	TEST_ASSERT(cozyfs_stat(&fs, "/d", &dir) == 0 && dir.is_dir);
+	TEST_ASSERT(cozyfs_stat(&fs, "/d/f", &file) == 0);
+	TEST_ASSERT(!file.is_dir && file.size == 3);
+	TEST_ASSERT(cozyfs_stat(&fs, "/d/g", &file) == -COZYFS_ENOENT);
+
+	// Writes change the generation but not the id
+	int fd = cozyfs_open(&fs, "/d/f");
+	TEST_ASSERT(fd >= 0);
+	CozyFSStat before, after;
+	TEST_ASSERT(cozyfs_fstat(&fs, fd, &before) == 0);
+	TEST_ASSERT(cozyfs_write(&fs, fd, "d", 1) == 1);
+	TEST_ASSERT(cozyfs_fstat(&fs, fd, &after) == 0);
+	TEST_ASSERT(after.id == before.id && after.gen != before.gen && after.size == 4);
+	TEST_ASSERT(cozyfs_close(&fs, fd) == 0);
+
+	CozyFSDirEntry entries[4];
+	unsigned int cursor = 0;
+	TEST_ASSERT(cozyfs_readdir(&fs, "/d", &cursor, entries, 4) == 1);
+	TEST_ASSERT(!strcmp(entries[0].name, "f") && entries[0].stat.id == after.id && entries[0].stat.size == 4);
+	TEST_ASSERT(cozyfs_readdir(&fs, "/d/f", &cursor, entries, 4) == -COZYFS_ENOTDIR);
+	TEST_END;
+}
+
+static void test_transaction(void)
+{
+	TEST_START;
+	TEST_ASSERT(cozyfs_transaction_begin(&fs) == 0);
+	TEST_ASSERT(make_file(&fs, "/a", "a", 1) == 0);
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/d") == 0);
+	TEST_ASSERT(cozyfs_transaction_rollback(&fs) == 0);
+	CozyFSStat stat;
+	TEST_ASSERT(cozyfs_stat(&fs, "/a", &stat) == -COZYFS_ENOENT);
+	TEST_ASSERT(cozyfs_stat(&fs, "/d", &stat) == -COZYFS_ENOENT);
+
+	TEST_ASSERT(cozyfs_transaction_begin(&fs) == 0);
+	char path[32];
+	int i;
+	for (i = 0; i < 30; i++) {
+		snprintf(path, sizeof(path), "/f%d", i);
+		if (make_file(&fs, path, "x", 1) < 0)
+			break;
+	}
+	TEST_ASSERT(i == 30);
+	TEST_ASSERT(cozyfs_transaction_commit(&fs) == 0);
+	TEST_ASSERT(cozyfs_stat(&fs, "/f29", &stat) == 0 && stat.size == 1);
+
+	// Files with more pages than a transaction can patch can be removed
+	static char page[4084];
+	int fd = cozyfs_create(&fs, "/big");
+	TEST_ASSERT(fd >= 0);
+	for (i = 0; i < 150; i++)
+		if (cozyfs_write(&fs, fd, page, sizeof(page)) != sizeof(page))
+			break;
+	TEST_ASSERT(i == 150);
+	TEST_ASSERT(cozyfs_close(&fs, fd) == 0);
+	CozyFSUsage before, after;
+	TEST_ASSERT(cozyfs_usage(&fs, &before) == 0);
+	TEST_ASSERT(cozyfs_transaction_begin(&fs) == 0);
+	TEST_ASSERT(cozyfs_unlink(&fs, "/big") == 0);
+	TEST_ASSERT(cozyfs_transaction_commit(&fs) == 0);
+	TEST_ASSERT(cozyfs_usage(&fs, &after) == 0);
+	TEST_ASSERT(after.free_pages == before.free_pages + 150);
+
+	// And the freed pages can be handed out again
+	fd = cozyfs_create(&fs, "/big");
+	TEST_ASSERT(fd >= 0);
+	for (i = 0; i < 150; i++)
+		if (cozyfs_write(&fs, fd, page, sizeof(page)) != sizeof(page))
+			break;
+	TEST_ASSERT(i == 150);
+	TEST_ASSERT(cozyfs_close(&fs, fd) == 0);
+	CozyFSReport report;
+	TEST_ASSERT(cozyfs_inspect(&fs, &report, (void*) 0, (void*) 0) == 0);
+	TEST_ASSERT(report.lost_pages == 0);
+	TEST_END;
+}
+
+static void test_changes(void)
+{
+	TEST_START;
+	unsigned long long seen = cozyfs_changes(&fs);
+
+	// Reads don't count as changes
+	CozyFSStat stat;
+	TEST_ASSERT(cozyfs_stat(&fs, "/", &stat) == 0);
+	TEST_ASSERT(cozyfs_changes(&fs) == seen);
+	TEST_ASSERT(cozyfs_wait_change(&fs, seen, 0) == -COZYFS_ETIMEDOUT);
+
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/d") == 0);
+	TEST_ASSERT(cozyfs_changes(&fs) != seen);
+	TEST_ASSERT(cozyfs_wait_change(&fs, seen, 0) == 0);
+	TEST_END;
+}
+
+static void test_stats(void)
+{
+	TEST_START;
+	CozyFSStats stats;
+	TEST_ASSERT(cozyfs_stats(&fs, &stats) == 0);
+	TEST_ASSERT(stats.ops[COZYFS_OP_MKDIR].count == 0);
+
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/d") == 0);
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/d") == -COZYFS_EEXIST);
+	TEST_ASSERT(cozyfs_stats(&fs, &stats) == 0);
+	TEST_ASSERT(stats.ops[COZYFS_OP_MKDIR].count == 2);
+	TEST_ASSERT(stats.errors[COZYFS_OP_MKDIR] == 1);
+	TEST_ASSERT(stats.lock_hold.count >= 2);
+	TEST_END;
+
+	// Small arenas have no room for them
+	do {
+		static char mem[1<<16];
+		CozyFS fs;
+		cozyfs_init(mem, sizeof(mem), 0, 0);
+		cozyfs_attach(&fs, mem, (void*) 0, cozyfs_callback_impl, (void*) 0);
+		CozyFSStats stats;
+		TEST_ASSERT(cozyfs_stats(&fs, &stats) == -COZYFS_EINVAL);
+	} while (0);
+}
+
+// Records the id reported for each of the paths "/d/f" and "/h"
+static void visit_ids(void *userptr, const CozyFSReportEntry *entry)
+{
+	unsigned int *ids = userptr;
+	if (!strcmp(entry->path, "/d/f")) ids[0] = entry->id;
+	if (!strcmp(entry->path, "/h"))   ids[1] = entry->id;
+}
+
+static void test_inspect(void)
+{
+	TEST_START;
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/d") == 0);
+	TEST_ASSERT(make_file(&fs, "/d/f", "hello", 5) == 0);
+	TEST_ASSERT(make_file(&fs, "/g", "abc", 3) == 0);
+
+	CozyFSReport report;
+	TEST_ASSERT(cozyfs_inspect(&fs, &report, (void*) 0, (void*) 0) == 0);
+	TEST_ASSERT(report.num_dirs == 2);
+	TEST_ASSERT(report.num_files == 2);
+	TEST_ASSERT(report.file_bytes == 8);
+	TEST_ASSERT(report.fpages == 2);
+	TEST_ASSERT(report.lost_pages == 0);
+	TEST_ASSERT(report.backup_bytes == 0);
+
+	// A second link doesn't count the pages of the file twice
+	TEST_ASSERT(cozyfs_link(&fs, "/d/f", "/h") == 0);
+	TEST_ASSERT(cozyfs_inspect(&fs, &report, (void*) 0, (void*) 0) == 0);
+	TEST_ASSERT(report.num_files == 2);
+	TEST_ASSERT(report.fpages == 2);
+	TEST_ASSERT(report.lost_pages == 0);
+
+	// The visitor sees both links, with the id of the one entity
+	CozyFSStat stat;
+	unsigned int ids[2] = {0, 0};
+	TEST_ASSERT(cozyfs_stat(&fs, "/h", &stat) == 0);
+	TEST_ASSERT(cozyfs_inspect(&fs, &report, visit_ids, ids) == 0);
+	TEST_ASSERT(ids[0] == stat.id);
+	TEST_ASSERT(ids[1] == stat.id);
+	TEST_END;
+}
+
+// A removed directory whose pages hold a file linked elsewhere keeps
+// them until the file goes, and its slot isn't reused meanwhile
+static void test_rmdir_linked(void)
+{
+	TEST_START;
+	int cycles = 0;
+	while (cycles < 50) {
+		TEST_ASSERT(cozyfs_mkdir(&fs, "/d") == 0);
+		TEST_ASSERT(make_file(&fs, "/d/f", "hello", 5) == 0);
+		TEST_ASSERT(cozyfs_link(&fs, "/d/f", "/h") == 0);
+		TEST_ASSERT(cozyfs_unlink(&fs, "/d/f") == 0);
+		TEST_ASSERT(cozyfs_rmdir(&fs, "/d") == 0);
+		TEST_ASSERT(cozyfs_mkdir(&fs, "/e") == 0);
+		TEST_ASSERT(make_file(&fs, "/e/g", "abc", 3) == 0);
+
+		char buf[8];
+		TEST_ASSERT(cozyfs_read_path(&fs, "/h", buf, sizeof(buf)) == 5);
+		TEST_ASSERT(!memcmp(buf, "hello", 5));
+
+		TEST_ASSERT(cozyfs_unlink(&fs, "/h") == 0);
+		TEST_ASSERT(cozyfs_unlink(&fs, "/e/g") == 0);
+		TEST_ASSERT(cozyfs_rmdir(&fs, "/e") == 0);
+		cycles++;
+	}
+	TEST_ASSERT(cycles == 50);
+
+	CozyFSReport report;
+	TEST_ASSERT(cozyfs_inspect(&fs, &report, (void*) 0, (void*) 0) == 0);
+	TEST_ASSERT(report.lost_pages == 0);
+	TEST_ASSERT(report.num_dirs == 1);
+	int in_use = report.num_pages - report.xpages;
+
+	// Held by a handle, and by a removed directory inside another
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/a") == 0);
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/a/b") == 0);
+	TEST_ASSERT(make_file(&fs, "/a/b/f", "hello", 5) == 0);
+	int fd = cozyfs_open(&fs, "/a/b/f");
+	TEST_ASSERT(fd >= 0);
+	TEST_ASSERT(cozyfs_unlink(&fs, "/a/b/f") == 0);
+	TEST_ASSERT(cozyfs_rmdir(&fs, "/a/b") == 0);
+	TEST_ASSERT(cozyfs_rmdir(&fs, "/a") == 0);
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/c") == 0);
+	TEST_ASSERT(cozyfs_rmdir(&fs, "/c") == 0);
+	TEST_ASSERT(cozyfs_close(&fs, fd) == 0);
+	TEST_ASSERT(cozyfs_inspect(&fs, &report, (void*) 0, (void*) 0) == 0);
+	TEST_ASSERT(report.lost_pages == 0);
+	TEST_ASSERT(report.num_pages - report.xpages == in_use);
+	TEST_END;
+}
+
+// Records the events of the tracing test
+typedef struct {
+	int  num_ops;
+	int  last_op;
+	int  last_code;
+	char last_path[64];
+	int  num_locks;
+} Trace;
+
+static Trace trace;
+
+static unsigned long long trace_callback(int sysop, void *userptr, void *p, int n)
+{
+	if (sysop != COZYFS_SYSOP_TRACE)
+		return cozyfs_callback_impl(sysop, userptr, p, n);
+
+	CozyFSTraceEvent *event = p;
+	if (event == (void*) 0)
+		return 1; // Ask for events
+
+	if (event->type == COZYFS_TRACE_OP_BEGIN && event->args && event->args->path)
+		snprintf(trace.last_path, sizeof(trace.last_path), "%s", event->args->path);
+	if (event->type == COZYFS_TRACE_OP_END) {
+		trace.num_ops++;
+		trace.last_op = event->op;
+		trace.last_code = event->code;
+	}
+	if (event->type == COZYFS_TRACE_LOCK_ACQUIRE)
+		trace.num_locks++;
 	return 0;
 }
 
-/*
+static void test_trace(void)
+{
+	TEST_START;
+	cozyfs_attach(&fs, mem, (void*) 0, trace_callback, (void*) 0);
+	memset(&trace, 0, sizeof(trace));
 
-int  cozyfs_init   (void *mem, unsigned long len, int backup, int refresh);
-void cozyfs_attach (CozyFS *fs, void *mem, const char *user, cozyfs_callback callback, void *userptr);
-void cozyfs_idle   (CozyFS *fs);
+	TEST_ASSERT(cozyfs_mkdir(&fs, "/traced") == 0);
+	TEST_ASSERT(trace.num_ops == 1 && trace.num_locks == 1);
+	TEST_ASSERT(trace.last_op == COZYFS_OP_MKDIR && trace.last_code == 0);
+	TEST_ASSERT(!strcmp(trace.last_path, "/traced"));
 
-int  cozyfs_link   (CozyFS *fs, const char *oldpath, const char *newpath);
-int  cozyfs_unlink (CozyFS *fs, const char *path);
+	TEST_ASSERT(cozyfs_open(&fs, "/missing") == -COZYFS_ENOENT);
+	TEST_ASSERT(trace.last_op == COZYFS_OP_OPEN && trace.last_code == -COZYFS_ENOENT);
+	TEST_ASSERT(!strcmp(trace.last_path, "/missing"));
 
-int  cozyfs_mkdir  (CozyFS *fs, const char *path);
-int  cozyfs_rmdir  (CozyFS *fs, const char *path);
+	// Polling the counters isn't traced, inspecting is
+	int num_ops = trace.num_ops;
+	CozyFSUsage usage;
+	TEST_ASSERT(cozyfs_usage(&fs, &usage) == 0);
+	cozyfs_changes(&fs);
+	TEST_ASSERT(trace.num_ops == num_ops);
+	CozyFSReport report;
+	TEST_ASSERT(cozyfs_inspect(&fs, &report, (void*) 0, (void*) 0) == 0);
+	TEST_ASSERT(trace.num_ops == num_ops + 1 && trace.last_op == COZYFS_OP_INSPECT);
+	TEST_END;
+}
 
-int  cozyfs_mkusr  (CozyFS *fs, const char *name);
-int  cozyfs_rmusr  (CozyFS *fs, const char *name);
+static void test_backup(void)
+{
+	do {
+		static char mem[1<<20];
+		CozyFS fs;
+		TEST_ASSERT(cozyfs_init(mem, sizeof(mem), 1, 0) == 0);
+		cozyfs_attach(&fs, mem, (void*) 0, cozyfs_callback_impl, (void*) 0);
 
-int  cozyfs_chown  (CozyFS *fs, const char *path, const char *newowner);
-int  cozyfs_chmod  (CozyFS *fs, const char *path, int mode);
+		// The first operation takes a snapshot
+		TEST_ASSERT(make_file(&fs, "/a", "a", 1) == 0);
+		CozyFSStats stats;
+		TEST_ASSERT(cozyfs_stats(&fs, &stats) == 0);
+		TEST_ASSERT(stats.backup_bytes > 0);
 
-int  cozyfs_open   (CozyFS *fs, const char *path);
-int  cozyfs_close  (CozyFS *fs, int fd);
+		CozyFSReport report;
+		TEST_ASSERT(cozyfs_inspect(&fs, &report, (void*) 0, (void*) 0) == 0);
+		TEST_ASSERT(report.backup_bytes > 0);
+	} while (0);
+}
 
-int  cozyfs_read   (CozyFS *fs, int fd, void       *dst, int max);
-int  cozyfs_write  (CozyFS *fs, int fd, const void *src, int len);
+int main(void)
+{
+	test_mkdir();
+	test_create();
+	test_reopen();
+	test_unlink();
+	test_large_dir();
+	test_seek();
+	test_read_spans();
+	test_read_path();
+	test_stat();
+	test_transaction();
+	test_changes();
+	test_stats();
+	test_inspect();
+	test_rmdir_linked();
+	test_trace();
+	test_backup();
 
-int  cozyfs_transaction_begin    (CozyFS *fs, int lock);
-int  cozyfs_transaction_commit   (CozyFS *fs);
-int  cozyfs_transaction_rollback (CozyFS *fs);
-*/
\ No newline at end of file
+	if (failed) {
+		printf("%d tests failed\n", failed);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}
@@ -0,0 +1,700 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "bulk.h"
+#include "thread_fs.h"
+
+typedef unsigned long long u64;
+
+#define COUNT(X) (int) (sizeof(X) / sizeof((X)[0]))
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+
+#define MAX_PATH     (1<<12)
+#define MAX_THREADS  64
+#define QUEUE_SIZE   (1<<10)
+#define MAX_INFLIGHT (1<<28) // Bytes read but not yet written
+#define BATCH_FILES  256
+#define BATCH_BYTES  (1<<20)
+
+// Files are queued in the order of the walk, which lists directories
+// before their contents, and are written in the same order.
+typedef struct {
+	char   path[MAX_PATH]; // Relative to both roots
+	int    is_dir;
+	int    loaded;
+	int    error;   // errno of loading the file
+	int    skipped; // Refused by store_job, which reported why
+	int    stored;  // Committed to the file system
+	char  *data;
+	size_t size;
+} Job;
+
+typedef struct {
+	CozyFS     *fs; // Shared, see thread_fs
+	const char *src;
+	const char *dst;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+
+	// Jobs in [head, next) are being loaded or were loaded and
+	// are waiting to be written, jobs in [next, tail) are queued
+	Job *jobs;
+	u64  head;
+	u64  next;
+	u64  tail;
+	u64  inflight;
+	int  done; // Nothing more will be queued
+	int  failed;
+	int  walk_failed;
+
+	u64 num_files;
+	u64 num_dirs;
+	u64 num_bytes;
+} Bulk;
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Utilities
+
+static int join_path(char *dst, const char *root, const char *rel)
+{
+	int len;
+	if (rel[0] == '\0')
+		len = snprintf(dst, MAX_PATH, "%s", root);
+	else if (root[0] != '\0' && root[strlen(root)-1] == '/')
+		len = snprintf(dst, MAX_PATH, "%s%s", root, rel);
+	else
+		len = snprintf(dst, MAX_PATH, "%s/%s", root, rel);
+	if (len >= MAX_PATH)
+		return -1;
+	return 0;
+}
+
+static int default_threads(int threads)
+{
+	if (threads <= 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n > 0 ? n : 1;
+	}
+	return MIN(threads, MAX_THREADS);
+}
+
+static int bulk_init(Bulk *b, CozyFS *fs, const char *src, const char *dst)
+{
+	memset(b, 0, sizeof(Bulk));
+	b->jobs = calloc(QUEUE_SIZE, sizeof(Job));
+	if (b->jobs == NULL)
+		return -1;
+	b->fs  = fs;
+	b->src = src;
+	b->dst = dst;
+	pthread_mutex_init(&b->mutex, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	return 0;
+}
+
+static void bulk_free(Bulk *b)
+{
+	pthread_cond_destroy(&b->cond);
+	pthread_mutex_destroy(&b->mutex);
+	free(b->jobs);
+}
+
+// Adds a job to the queue, waiting for space if it's full
+static void push_job(Bulk *b, const char *rel, int is_dir)
+{
+	pthread_mutex_lock(&b->mutex);
+	while (b->tail - b->head == QUEUE_SIZE)
+		pthread_cond_wait(&b->cond, &b->mutex);
+	Job *job = &b->jobs[b->tail % QUEUE_SIZE];
+	snprintf(job->path, sizeof(job->path), "%s", rel);
+	job->is_dir = is_dir;
+	job->loaded = 0;
+	job->error  = 0;
+	job->skipped = 0;
+	job->stored  = 0;
+	job->data   = NULL;
+	job->size   = 0;
+	b->tail++;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->mutex);
+}
+
+static void finish_queue(Bulk *b)
+{
+	pthread_mutex_lock(&b->mutex);
+	b->done = 1;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->mutex);
+}
+
+// Takes the next job to be loaded, or returns NULL when there are
+// no more. Loading stalls while too much data waits to be written.
+// If "copy" is given, the job is copied there and its slot freed.
+static Job *claim_job(Bulk *b, Job *copy)
+{
+	pthread_mutex_lock(&b->mutex);
+	while ((b->next == b->tail && !b->done) || (b->next < b->tail && b->inflight >= MAX_INFLIGHT))
+		pthread_cond_wait(&b->cond, &b->mutex);
+	Job *job = NULL;
+	if (b->next < b->tail) {
+		job = &b->jobs[b->next++ % QUEUE_SIZE];
+		if (copy) {
+			*copy = *job;
+			job = copy;
+			b->head = b->next;
+			pthread_cond_broadcast(&b->cond);
+		}
+	}
+	pthread_mutex_unlock(&b->mutex);
+	return job;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Import
+
+static int walk_host(Bulk *b, char *rel, int len)
+{
+	char path[MAX_PATH];
+	if (join_path(path, b->src, rel) < 0) {
+		fprintf(stderr, "Error: Path too long '%s'\n", rel);
+		return -1;
+	}
+
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		fprintf(stderr, "Error: Couldn't open '%s' (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	int ret = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		int n = snprintf(rel + len, MAX_PATH - len, "%s%s", len > 0 ? "/" : "", ent->d_name);
+		if (len + n >= MAX_PATH) {
+			fprintf(stderr, "Error: Path too long '%s'\n", rel);
+			rel[len] = '\0';
+			ret = -1;
+			continue;
+		}
+
+		int type = ent->d_type;
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			struct stat buf;
+			if (join_path(path, b->src, rel) == 0 && stat(path, &buf) == 0)
+				type = S_ISDIR(buf.st_mode) ? DT_DIR : S_ISREG(buf.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR) {
+			push_job(b, rel, 1);
+			if (walk_host(b, rel, len + n) < 0)
+				ret = -1;
+		} else if (type == DT_REG)
+			push_job(b, rel, 0);
+
+		rel[len] = '\0';
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+static void *import_walker(void *arg)
+{
+	Bulk *b = arg;
+	char rel[MAX_PATH] = "";
+	if (walk_host(b, rel, 0) < 0)
+		b->walk_failed = 1; // Read after joining
+	finish_queue(b);
+	return NULL;
+}
+
+static void load_host_file(Bulk *b, Job *job)
+{
+	char path[MAX_PATH];
+	if (join_path(path, b->src, job->path) < 0) {
+		job->error = ENAMETOOLONG;
+		return;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		job->error = errno;
+		return;
+	}
+
+	struct stat buf;
+	if (fstat(fd, &buf) < 0) {
+		job->error = errno;
+		close(fd);
+		return;
+	}
+	if ((u64) buf.st_size > (unsigned int) -1) {
+		job->error = EFBIG;
+		close(fd);
+		return;
+	}
+
+	size_t cap = buf.st_size;
+	char *data = malloc(cap ? cap : 1);
+	if (data == NULL) {
+		job->error = ENOMEM;
+		close(fd);
+		return;
+	}
+
+	size_t size = 0;
+	while (size < cap) {
+		ssize_t num = read(fd, data + size, cap - size);
+		if (num < 0 && errno == EINTR)
+			continue;
+		if (num < 0) {
+			job->error = errno;
+			free(data);
+			close(fd);
+			return;
+		}
+		if (num == 0)
+			break; // Shrunk while reading
+		size += num;
+	}
+	close(fd);
+
+	job->data = data;
+	job->size = size;
+}
+
+static void *import_reader(void *arg)
+{
+	Bulk *b = arg;
+	Job *job;
+	while ((job = claim_job(b, NULL))) {
+
+		if (!job->is_dir)
+			load_host_file(b, job);
+
+		pthread_mutex_lock(&b->mutex);
+		job->loaded = 1;
+		b->inflight += job->size;
+		pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->mutex);
+	}
+	return NULL;
+}
+
+// Returns an engine error code, or 0 if the job was copied or
+// skipped because of a problem specific to it
+static int store_job(Bulk *b, CozyFS *fs, Job *job)
+{
+	if (job->error || job->skipped)
+		return 0; // Reported already or when released
+
+	char path[MAX_PATH];
+	if (join_path(path, b->dst, job->path) < 0) {
+		fprintf(stderr, "Error: Path too long '%s'\n", job->path);
+		b->failed = 1;
+		job->skipped = 1;
+		return 0;
+	}
+
+	CozyFSStat stat;
+	int code = cozyfs_stat(fs, path, &stat);
+
+	if (job->is_dir) {
+		if (code == 0 && stat.is_dir)
+			return 0;
+		return cozyfs_mkdir(fs, path);
+	}
+
+	// Files can't be overwritten, only appended to
+	if (code == 0 && (stat.is_dir || stat.size > 0)) {
+		fprintf(stderr, "Error: '%s' already exists\n", path);
+		b->failed = 1;
+		job->skipped = 1;
+		return 0;
+	}
+
+	int fd = cozyfs_create(fs, path);
+	if (fd < 0)
+		return fd;
+
+	size_t written = 0;
+	while (written < job->size) {
+		int num = cozyfs_write(fs, fd, job->data + written, MIN(job->size - written, 1<<30));
+		if (num < 0) {
+			cozyfs_close(fs, fd);
+			return num;
+		}
+		written += num;
+	}
+
+	return cozyfs_close(fs, fd);
+}
+
+static void mark_stored(Job *job)
+{
+	if (!job->error && !job->skipped)
+		job->stored = 1;
+}
+
+// Writes "count" jobs starting at "first" in one transaction.
+// On failure "at" is set to the job that caused it.
+static int store_batch(Bulk *b, CozyFS *fs, u64 first, int count, Job **at)
+{
+	*at = &b->jobs[first % QUEUE_SIZE];
+	int code = cozyfs_transaction_begin(fs);
+	if (code < 0)
+		return code;
+
+	for (int i = 0; i < count; i++) {
+		*at = &b->jobs[(first + i) % QUEUE_SIZE];
+		code = store_job(b, fs, *at);
+		if (code < 0) {
+			cozyfs_transaction_rollback(fs);
+			return code;
+		}
+	}
+	code = cozyfs_transaction_commit(fs);
+	if (code < 0)
+		return code;
+
+	for (int i = 0; i < count; i++)
+		mark_stored(&b->jobs[(first + i) % QUEUE_SIZE]);
+	return 0;
+}
+
+// Writes one job in its own transaction, or without one
+// if it needs more patches than a transaction can hold
+static void store_single(Bulk *b, CozyFS *fs, u64 index)
+{
+	Job *at;
+	int code = store_batch(b, fs, index, 1, &at);
+	if (code == -COZYFS_ENOMEM) {
+		code = store_job(b, fs, at);
+		if (code == 0)
+			mark_stored(at);
+	}
+	if (code < 0) {
+		fprintf(stderr, "Error: Couldn't write '%s' (error %d)\n", at->path, -code);
+		b->failed = 1;
+	}
+}
+
+// Waits for loaded jobs at the head of the queue and returns how
+// many of them, up to "max", should go in the next batch
+static int next_batch(Bulk *b, int max)
+{
+	pthread_mutex_lock(&b->mutex);
+	for (;;) {
+		int count = 0;
+		size_t bytes = 0;
+		while (b->head + count < b->tail && count < max && (count == 0 || bytes < BATCH_BYTES)) {
+			Job *job = &b->jobs[(b->head + count) % QUEUE_SIZE];
+			if (!job->loaded)
+				break;
+			bytes += job->size;
+			count++;
+		}
+		if (count > 0 || (b->done && b->head == b->tail)) {
+			pthread_mutex_unlock(&b->mutex);
+			return count;
+		}
+		pthread_cond_wait(&b->cond, &b->mutex);
+	}
+}
+
+static void release_batch(Bulk *b, int count)
+{
+	pthread_mutex_lock(&b->mutex);
+	for (int i = 0; i < count; i++) {
+		Job *job = &b->jobs[b->head++ % QUEUE_SIZE];
+		if (job->error) {
+			fprintf(stderr, "Error: Couldn't read '%s' (%s)\n", job->path, strerror(job->error));
+			b->failed = 1;
+		} else if (!job->stored) {
+			// Reported when it failed
+		} else if (job->is_dir)
+			b->num_dirs++;
+		else {
+			b->num_files++;
+			b->num_bytes += job->size;
+		}
+		b->inflight -= job->size;
+		free(job->data);
+		job->data = NULL;
+	}
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->mutex);
+}
+
+int cozyfs_import(CozyFS *fs, const char *src, const char *dst, int threads)
+{
+	Bulk b;
+	if (bulk_init(&b, fs, src, dst) < 0)
+		return -1;
+	threads = default_threads(threads);
+
+	pthread_t walker;
+	pthread_t readers[MAX_THREADS];
+	int num_readers = 0;
+
+	if (pthread_create(&walker, NULL, import_walker, &b)) {
+		bulk_free(&b);
+		return -1;
+	}
+	for (int i = 0; i < threads; i++)
+		if (!pthread_create(&readers[num_readers], NULL, import_reader, &b))
+			num_readers++;
+	if (num_readers == 0)
+		import_reader(&b); // Better slow than never
+
+	// Batches that run out of patches are retried at half the
+	// size, and grow back while they succeed. Any other failure
+	// rolls back the whole batch, so its jobs are retried one at
+	// a time and only the ones that fail again are lost.
+	CozyFS *wfs = thread_fs(fs);
+	int max = BATCH_FILES;
+	int count;
+	while ((count = next_batch(&b, max)) > 0) {
+
+		Job *at;
+		int code = store_batch(&b, wfs, b.head, count, &at);
+		if (code == -COZYFS_ENOMEM && count > 1) {
+			max = count / 2;
+			continue;
+		}
+		if (code < 0) {
+			for (int i = 0; i < count; i++)
+				store_single(&b, wfs, b.head + i);
+		} else
+			max = MIN(2 * max, BATCH_FILES);
+
+		release_batch(&b, count);
+	}
+
+	pthread_join(walker, NULL);
+	for (int i = 0; i < num_readers; i++)
+		pthread_join(readers[i], NULL);
+	if (b.walk_failed)
+		b.failed = 1;
+
+	fprintf(stderr, "Imported %llu files (%llu bytes) and %llu directories\n",
+		b.num_files, b.num_bytes, b.num_dirs);
+
+	int ret = b.failed ? -1 : 0;
+	bulk_free(&b);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Export
+
+static int walk_arena(Bulk *b, CozyFS *fs, char *rel, int len)
+{
+	char path[MAX_PATH];
+	if (join_path(path, b->src, rel) < 0) {
+		fprintf(stderr, "Error: Path too long '%s'\n", rel);
+		return -1;
+	}
+
+	int ret = 0;
+	unsigned int cursor = 0;
+	for (;;) {
+		CozyFSDirEntry entries[32];
+		int num = cozyfs_readdir(fs, path, &cursor, entries, COUNT(entries));
+		if (num < 0) {
+			fprintf(stderr, "Error: Couldn't list '%s' (error %d)\n", path, -num);
+			return -1;
+		}
+		if (num == 0)
+			break;
+
+		for (int i = 0; i < num; i++) {
+
+			int n = snprintf(rel + len, MAX_PATH - len, "%s%s", len > 0 ? "/" : "", entries[i].name);
+			if (len + n >= MAX_PATH) {
+				fprintf(stderr, "Error: Path too long '%s'\n", rel);
+				rel[len] = '\0';
+				ret = -1;
+				continue;
+			}
+
+			// Directories are created here so they exist
+			// before the files in them are written
+			if (entries[i].stat.is_dir) {
+				char host[MAX_PATH];
+				if (join_path(host, b->dst, rel) < 0 || (mkdir(host, 0755) < 0 && errno != EEXIST)) {
+					fprintf(stderr, "Error: Couldn't create '%s' (%s)\n", rel, strerror(errno));
+					ret = -1;
+				} else {
+					b->num_dirs++;
+					if (walk_arena(b, fs, rel, len + n) < 0)
+						ret = -1;
+				}
+			} else
+				push_job(b, rel, 0);
+
+			rel[len] = '\0';
+		}
+	}
+	return ret;
+}
+
+// Copies the file straight from the arena's pages to the host. Pages
+// of an open file aren't freed and appends don't touch the bytes
+// before the end, so the ones up to the size found at open are copied
+// as they were then.
+static int dump_file(Bulk *b, CozyFS *fs, Job *job)
+{
+	char path[MAX_PATH];
+	char host[MAX_PATH];
+	if (join_path(path, b->src, job->path) < 0 || join_path(host, b->dst, job->path) < 0) {
+		job->error = ENAMETOOLONG;
+		return -1;
+	}
+
+	int fd = cozyfs_open(fs, path);
+	if (fd < 0) {
+		job->error = EIO;
+		return -1;
+	}
+
+	int out = open(host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		job->error = errno;
+		cozyfs_close(fs, fd);
+		return -1;
+	}
+
+	CozyFSStat stat;
+	if (cozyfs_fstat(fs, fd, &stat) < 0) {
+		job->error = EIO;
+		close(out);
+		cozyfs_close(fs, fd);
+		return -1;
+	}
+
+	unsigned int remaining = stat.size;
+	while (remaining > 0) {
+		CozyFSSpan spans[64];
+		int num = cozyfs_read_spans(fs, fd, spans, COUNT(spans));
+		if (num < 0) {
+			job->error = EIO;
+			break;
+		}
+		if (num == 0)
+			break;
+
+		// Spans past the size are bytes appended since
+		struct iovec iov[COUNT(spans)];
+		size_t total = 0;
+		int used = 0;
+		while (used < num && remaining > 0) {
+			iov[used].iov_base = (void*) spans[used].ptr;
+			iov[used].iov_len  = MIN((unsigned int) spans[used].len, remaining);
+			total += iov[used].iov_len;
+			remaining -= iov[used].iov_len;
+			used++;
+		}
+		num = used;
+
+		int idx = 0;
+		while (total > 0) {
+			ssize_t n = writev(out, iov + idx, num - idx);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				job->error = errno;
+				break;
+			}
+			total -= n;
+			while (idx < num && (size_t) n >= iov[idx].iov_len)
+				n -= iov[idx++].iov_len;
+			if (idx < num) {
+				iov[idx].iov_base = (char*) iov[idx].iov_base + n;
+				iov[idx].iov_len -= n;
+			}
+		}
+		if (job->error)
+			break;
+	}
+
+	close(out);
+	cozyfs_close(fs, fd);
+	return job->error ? -1 : 0;
+}
+
+static void *export_writer(void *arg)
+{
+	Bulk *b = arg;
+	CozyFS *fs = thread_fs(b->fs);
+	Job copy;
+	Job *job;
+	while ((job = claim_job(b, &copy))) {
+
+		int code = dump_file(b, fs, job);
+
+		pthread_mutex_lock(&b->mutex);
+		if (code < 0) {
+			fprintf(stderr, "Error: Couldn't export '%s' (%s)\n", job->path, strerror(job->error));
+			b->failed = 1;
+		} else
+			b->num_files++;
+		pthread_mutex_unlock(&b->mutex);
+	}
+	return NULL;
+}
+
+int cozyfs_export(CozyFS *fs, const char *src, const char *dst, int threads)
+{
+	Bulk b;
+	if (bulk_init(&b, fs, src, dst) < 0)
+		return -1;
+	threads = default_threads(threads);
+
+	// Files are independent, so writers free their slot as soon
+	// as they claim it and finish in any order
+	pthread_t writers[MAX_THREADS];
+	int num_writers = 0;
+	for (int i = 0; i < threads; i++)
+		if (!pthread_create(&writers[num_writers], NULL, export_writer, &b))
+			num_writers++;
+
+	int walk_failed = 0;
+	if (mkdir(dst, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error: Couldn't create '%s' (%s)\n", dst, strerror(errno));
+		walk_failed = 1;
+	} else {
+		char rel[MAX_PATH] = "";
+		if (walk_arena(&b, thread_fs(fs), rel, 0) < 0)
+			walk_failed = 1;
+	}
+	finish_queue(&b);
+
+	if (num_writers == 0)
+		export_writer(&b);
+	for (int i = 0; i < num_writers; i++)
+		pthread_join(writers[i], NULL);
+	if (walk_failed)
+		b.failed = 1;
+
+	fprintf(stderr, "Exported %llu files and %llu directories\n", b.num_files, b.num_dirs);
+
+	int ret = b.failed ? -1 : 0;
+	bulk_free(&b);
+	return ret;
+}
@@ -0,0 +1,35 @@
+// Copyright (c) 2025 Francesco Cozzuto
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this
+// software and associated documentation files (the "Software"), to deal in the Software
+// without restriction, including without limitation the rights to use, copy, modify, merge,
+// publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons
+// to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+// OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+#ifndef COZYFS_BULK_H
+#define COZYFS_BULK_H
+#include <cozyfs.h>
+
+// Copies the host directory "src" into the directory "dst" of the file
+// system. Files are read by "threads" threads (one per CPU if zero) while
+// the calling thread writes them, grouped into transactions, in the order
+// of the walk. Existing non-empty files are left alone and reported.
+// Returns 0 on success and -1 if anything couldn't be copied.
+int cozyfs_import(CozyFS *fs, const char *src, const char *dst, int threads);
+
+// Copies the directory "src" of the file system into the host directory
+// "dst". Files are written by "threads" threads straight from the pages
+// of the file system. Returns 0 on success and -1 if anything couldn't
+// be copied.
+int cozyfs_export(CozyFS *fs, const char *src, const char *dst, int threads);
+
+#endif // COZYFS_BULK_H
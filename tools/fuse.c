@@ -1,95 +1,1365 @@
-#define FUSE_USE_VERSION 30
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 34
 
-#include <fuse.h>
 #include <stdio.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <time.h>
-#include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse_lowlevel.h>
+
+#include "fuse.h"
+#include "thread_fs.h"
+
+typedef unsigned long long u64;
+
+#define COUNT(X) (int) (sizeof(X) / sizeof((X)[0]))
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+
+#define MAX_PATH      (1<<12)
+#define INODE_BUCKETS (1<<12)
+#define MAX_WRITE     (1<<20)
+#define MAX_PENDING   (1<<22)
+#define PAGE_DATA     4084 // File bytes held by a page of the arena
+
+// The kernel may cache attributes, entries and pages for long since
+// changes made by other processes are invalidated explicitly
+#define ATTR_TIMEOUT  3600.0
+#define ENTRY_TIMEOUT 3600.0
+
+// The engine addresses files by path while the kernel uses inode
+// numbers. Inodes are entity ids, except for the root which must be
+// FUSE_ROOT_ID, and each remembers the path it was looked up with
+// (or renamed to) until the kernel forgets it. Files with more than
+// one link are reached through the first path the kernel saw, and the
+// others are kept aside to take its place when it's unlinked.
+typedef struct Alias Alias;
+struct Alias {
+	Alias     *next;
+	fuse_ino_t parent;
+	char       path[];
+};
+
+typedef struct Inode Inode;
+struct Inode {
+	fuse_ino_t   ino;
+	fuse_ino_t   parent;
+	uint64_t     nlookup;
+	unsigned int gen; // Generation the kernel's cache reflects
+	Inode       *next;
+	Alias       *aliases; // Other links the kernel knows about
+	const char  *name; // Last component of "path"
+	char         path[];
+};
+
+// Adjacent writes to a file are buffered and appended with a single
+// engine call when the buffer fills up, the file is read or flushed,
+// or a handle is released. The buffer belongs to the inode rather than
+// to a handle, since the kernel picks the offsets of all writers from
+// one size, which must include the bytes still buffered.
+typedef struct Pending Pending;
+struct Pending {
+	fuse_ino_t      ino;
+	int             refs; // Open handles, changed under the table's mutex
+	Pending        *next;
+	pthread_mutex_t mutex;
+	char           *buf;
+	size_t          len;
+	u64             end;   // Size of the file once "buf" is appended
+	int             error; // Of a flush that had no caller to report it to
+};
+
+typedef struct {
+	CozyFS         *fs; // Shared, see thread_fs
+	unsigned int    root_id;
+	pthread_mutex_t mutex;
+	Inode          *buckets[INODE_BUCKETS];
+	Pending        *pending[INODE_BUCKETS];
+
+	struct fuse_session *se;
+	volatile int         stop;
+
+	// Value of the change counter up to which the kernel's caches
+	// are known to be current, either because the watcher checked
+	// them or because the change was made through the mount
+	unsigned long long seen;
+} Mount;
+
+// Collected under the table's mutex and sent after releasing
+// it, since the kernel may call back into the file system
+typedef struct {
+	fuse_ino_t ino;
+	fuse_ino_t parent;
+	int        entry;
+	char       name[129];
+} Invalidation;
+
+// Copy of a remembered inode, checked without holding the table's mutex
+typedef struct {
+	fuse_ino_t   ino;
+	fuse_ino_t   parent;
+	unsigned int gen;
+	int          entry; // The path no longer leads to the inode
+	size_t       path;  // Offset in the buffer of paths
+} Check;
+
+// Reads move the cursor of the engine handle, so calls on the
+// same open file are serialized
+typedef struct {
+	int             fd;
+	pthread_mutex_t mutex;
+	Pending        *pending;
+} FileHandle;
 
-static int do_getattr( const char *path, struct stat *st )
-{
-	printf( "[getattr] Called\n" );
-	printf( "\tAttributes of %s requested\n", path );
-	
-	// GNU's definitions of the attributes (http://www.gnu.org/software/libc/manual/html_node/Attribute-Meanings.html):
-	// 		st_uid: 	The user ID of the file’s owner.
-	//		st_gid: 	The group ID of the file.
-	//		st_atime: 	This is the last access time for the file.
-	//		st_mtime: 	This is the time of the last modification to the contents of the file.
-	//		st_mode: 	Specifies the mode of the file. This includes file type information (see Testing File Type) and the file permission bits (see Permission Bits).
-	//		st_nlink: 	The number of hard links to the file. This count keeps track of how many directories have entries for this file. If the count is ever decremented to zero, then the file itself is discarded as soon 
-	//						as no process still holds it open. Symbolic links are not counted in the total.
-	//		st_size:	This specifies the size of a regular file in bytes. For files that are really devices this field isn’t usually meaningful. For symbolic links this specifies the length of the file name the link refers to.
-	
-	st->st_uid = getuid(); // The owner of the file/directory is the user who mounted the filesystem
-	st->st_gid = getgid(); // The group of the file/directory is the same as the group of the user who mounted the filesystem
-	st->st_atime = time( NULL ); // The last "a"ccess of the file/directory is right now
-	st->st_mtime = time( NULL ); // The last "m"odification of the file/directory is right now
-	
-	if ( strcmp( path, "/" ) == 0 )
-	{
-		st->st_mode = S_IFDIR | 0755;
-		st->st_nlink = 2; // Why "two" hardlinks instead of "one"? The answer is here: http://unix.stackexchange.com/a/101536
+////////////////////////////////////////////////////////////////////////////////////////////
+// Utilities
+
+static int to_errno(int code)
+{
+	switch (-code) {
+		case COZYFS_EINVAL:       return EINVAL;
+		case COZYFS_ENOMEM:       return ENOSPC; // The arena is full
+		case COZYFS_ENOENT:       return ENOENT;
+		case COZYFS_EPERM:        return EPERM;
+		case COZYFS_EBUSY:        return EBUSY;
+		case COZYFS_EISDIR:       return EISDIR;
+		case COZYFS_ENOTDIR:      return ENOTDIR;
+		case COZYFS_ENFILE:       return ENFILE;
+		case COZYFS_EBADF:        return EBADF;
+		case COZYFS_ENAMETOOLONG: return ENAMETOOLONG;
+		case COZYFS_ETIMEDOUT:    return ETIMEDOUT;
+		case COZYFS_EEXIST:       return EEXIST;
+		case COZYFS_ENOTEMPTY:    return ENOTEMPTY;
 	}
-	else
-	{
-		st->st_mode = S_IFREG | 0644;
-		st->st_nlink = 1;
-		st->st_size = 1024;
+	return EIO;
+}
+
+static fuse_ino_t ino_of(Mount *m, CozyFSStat stat)
+{
+	return stat.id == m->root_id ? FUSE_ROOT_ID : stat.id;
+}
+
+static void fill_attr(struct stat *st, fuse_ino_t ino, CozyFSStat stat)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino     = ino;
+	st->st_mode    = stat.is_dir ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+	st->st_nlink   = stat.is_dir ? 2 : 1;
+	st->st_uid     = getuid();
+	st->st_gid     = getgid();
+	st->st_size    = stat.size;
+	st->st_blksize = 4096;
+	st->st_blocks  = (stat.size + 511) / 512;
+	st->st_atime   = stat.mtime;
+	st->st_mtime   = stat.mtime;
+	st->st_ctime   = stat.mtime;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Inode table
+
+static Inode **find_inode(Mount *m, fuse_ino_t ino)
+{
+	Inode **slot = &m->buckets[ino % INODE_BUCKETS];
+	while (*slot && (*slot)->ino != ino)
+		slot = &(*slot)->next;
+	return slot;
+}
+
+static Alias **find_alias(Inode *inode, const char *path)
+{
+	Alias **slot = &inode->aliases;
+	while (*slot && strcmp((*slot)->path, path))
+		slot = &(*slot)->next;
+	return slot;
+}
+
+// Replaces the main path of the inode. Must be called with the
+// table's mutex held. If there's no memory for the longer path the
+// old one is kept, and operations on the inode fail until the kernel
+// looks it up again.
+static void set_inode_path(Inode **slot, fuse_ino_t parent, const char *path)
+{
+	int len = strlen(path);
+	Inode *inode = realloc(*slot, sizeof(Inode) + len + 1);
+	if (inode) {
+		inode->parent = parent;
+		memcpy(inode->path, path, len + 1);
+		inode->name = strrchr(inode->path, '/') + 1;
+		*slot = inode;
 	}
-	
+}
+
+// Remembers another link to the inode. Must be called with the table's
+// mutex held. Without memory for it, unlinking the main path leaves
+// this one unreachable until it's looked up again.
+static void add_alias(Inode *inode, fuse_ino_t parent, const char *path)
+{
+	if (!strcmp(inode->path, path) || *find_alias(inode, path))
+		return;
+
+	int len = strlen(path);
+	Alias *alias = malloc(sizeof(Alias) + len + 1);
+	if (alias) {
+		alias->parent = parent;
+		memcpy(alias->path, path, len + 1);
+		alias->next = inode->aliases;
+		inode->aliases = alias;
+	}
+}
+
+// Adds a reference to the inode the kernel was just told about
+static int remember_inode(Mount *m, fuse_ino_t ino, fuse_ino_t parent, const char *path, unsigned int gen)
+{
+	if (ino == FUSE_ROOT_ID)
+		return 0; // Never forgotten
+
+	pthread_mutex_lock(&m->mutex);
+	Inode **slot = find_inode(m, ino);
+	if (*slot == NULL) {
+		int len = strlen(path);
+		Inode *inode = malloc(sizeof(Inode) + len + 1);
+		if (inode == NULL) {
+			pthread_mutex_unlock(&m->mutex);
+			return -ENOMEM;
+		}
+		inode->ino = ino;
+		inode->parent = parent;
+		inode->nlookup = 0;
+		inode->next = NULL;
+		inode->aliases = NULL;
+		memcpy(inode->path, path, len + 1);
+		inode->name = strrchr(inode->path, '/') + 1;
+		*slot = inode;
+	} else
+		add_alias(*slot, parent, path);
+	(*slot)->nlookup++;
+	(*slot)->gen = gen;
+	pthread_mutex_unlock(&m->mutex);
 	return 0;
 }
 
-static int do_readdir( const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi )
+static void free_inode(Inode *inode)
+{
+	while (inode->aliases) {
+		Alias *alias = inode->aliases;
+		inode->aliases = alias->next;
+		free(alias);
+	}
+	free(inode);
+}
+
+static void forget_inode(Mount *m, fuse_ino_t ino, uint64_t nlookup)
+{
+	pthread_mutex_lock(&m->mutex);
+	Inode **slot = find_inode(m, ino);
+	Inode *inode = *slot;
+	if (inode) {
+		inode->nlookup -= MIN(nlookup, inode->nlookup);
+		if (inode->nlookup == 0) {
+			*slot = inode->next;
+			free_inode(inode);
+		}
+	}
+	pthread_mutex_unlock(&m->mutex);
+}
+
+// Moves the link of the inode at "oldpath" to "path"
+static void rename_inode(Mount *m, fuse_ino_t ino, const char *oldpath, fuse_ino_t parent, const char *path)
+{
+	pthread_mutex_lock(&m->mutex);
+	Inode **slot = find_inode(m, ino);
+	if (*slot) {
+		Alias **alias = find_alias(*slot, oldpath);
+		if (*alias) {
+			Alias *next = (*alias)->next;
+			free(*alias);
+			*alias = next;
+		}
+		if (!strcmp((*slot)->path, oldpath))
+			set_inode_path(slot, parent, path);
+		else
+			add_alias(*slot, parent, path);
+	}
+	pthread_mutex_unlock(&m->mutex);
+}
+
+// Drops the link of the inode at "path". If that was the main path,
+// another link takes its place.
+static void unlink_inode(Mount *m, fuse_ino_t ino, const char *path)
 {
-	printf( "--> Getting The List of Files of %s\n", path );
-	
-	filler( buffer, ".", NULL, 0 ); // Current Directory
-	filler( buffer, "..", NULL, 0 ); // Parent Directory
-	
-	if ( strcmp( path, "/" ) == 0 ) // If the user is trying to show the files/directories of the root directory show the following
-	{
-		filler( buffer, "file54", NULL, 0 );
-		filler( buffer, "file349", NULL, 0 );
+	pthread_mutex_lock(&m->mutex);
+	Inode **slot = find_inode(m, ino);
+	if (*slot) {
+		Alias **alias = find_alias(*slot, path);
+		if (*alias == NULL && !strcmp((*slot)->path, path))
+			alias = &(*slot)->aliases;
+		if (*alias) {
+			Alias *removed = *alias;
+			*alias = removed->next;
+			if (!strcmp((*slot)->path, path))
+				set_inode_path(slot, removed->parent, removed->path);
+			free(removed);
+		}
 	}
-	
+	pthread_mutex_unlock(&m->mutex);
+}
+
+// Records a change the kernel made itself, so it isn't invalidated
+static void update_inode(Mount *m, fuse_ino_t ino, unsigned int gen)
+{
+	pthread_mutex_lock(&m->mutex);
+	Inode *inode = *find_inode(m, ino);
+	if (inode)
+		inode->gen = gen;
+	pthread_mutex_unlock(&m->mutex);
+}
+
+// Called after an operation that modified the file system exactly once,
+// with the change counter read before it. If nothing else changed in
+// the meantime, the watcher doesn't need to revalidate for it.
+static void claim_change(Mount *m, CozyFS *fs, unsigned long long before)
+{
+	unsigned long long after = cozyfs_changes(fs);
+	if (after == before + 1)
+		__atomic_compare_exchange_n(&m->seen, &before, after, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+static int path_of(Mount *m, fuse_ino_t ino, char *dst)
+{
+	if (ino == FUSE_ROOT_ID) {
+		strcpy(dst, "/");
+		return 0;
+	}
+
+	pthread_mutex_lock(&m->mutex);
+	Inode *inode = *find_inode(m, ino);
+	if (inode)
+		strcpy(dst, inode->path);
+	pthread_mutex_unlock(&m->mutex);
+	return inode ? 0 : -ENOENT;
+}
+
+static int child_path(Mount *m, fuse_ino_t parent, const char *name, char *dst)
+{
+	int code = path_of(m, parent, dst);
+	if (code < 0)
+		return code;
+
+	int len = strlen(dst);
+	if (len + strlen(name) + 2 > MAX_PATH)
+		return -ENAMETOOLONG;
+
+	if (len > 1)
+		dst[len++] = '/';
+	strcpy(dst + len, name);
 	return 0;
 }
 
-static int do_read( const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi )
-{
-	printf( "--> Trying to read %s, %u, %u\n", path, offset, size );
-	
-	char file54Text[] = "Hello World From File54!";
-	char file349Text[] = "Hello World From File349!";
-	char *selectedText = NULL;
-	
-	// ... //
-	
-	if ( strcmp( path, "/file54" ) == 0 )
-		selectedText = file54Text;
-	else if ( strcmp( path, "/file349" ) == 0 )
-		selectedText = file349Text;
+static int make_entry(Mount *m, fuse_ino_t parent, const char *path, CozyFSStat stat, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->ino = ino_of(m, stat);
+	e->attr_timeout = ATTR_TIMEOUT;
+	e->entry_timeout = ENTRY_TIMEOUT;
+	fill_attr(&e->attr, e->ino, stat);
+	return remember_inode(m, e->ino, parent, path, stat.gen);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Pending writes
+
+static Pending **find_pending(Mount *m, fuse_ino_t ino)
+{
+	Pending **slot = &m->pending[ino % INODE_BUCKETS];
+	while (*slot && (*slot)->ino != ino)
+		slot = &(*slot)->next;
+	return slot;
+}
+
+// Returns the buffer of the inode with a reference added, creating it
+// if "create" is set and no other handle has one
+static Pending *get_pending(Mount *m, fuse_ino_t ino, int create)
+{
+	pthread_mutex_lock(&m->mutex);
+	Pending **slot = find_pending(m, ino);
+	if (*slot == NULL && create) {
+		Pending *p = malloc(sizeof(Pending));
+		if (p) {
+			p->ino = ino;
+			p->refs = 0;
+			p->next = NULL;
+			pthread_mutex_init(&p->mutex, NULL);
+			p->buf = NULL;
+			p->len = 0;
+			p->end = 0;
+			p->error = 0;
+			*slot = p;
+		}
+	}
+	Pending *p = *slot;
+	if (p)
+		p->refs++;
+	pthread_mutex_unlock(&m->mutex);
+	return p;
+}
+
+// The last reference must be dropped with the buffer flushed
+static void put_pending(Mount *m, Pending *p)
+{
+	pthread_mutex_lock(&m->mutex);
+	if (--p->refs == 0) {
+		*find_pending(m, p->ino) = p->next;
+		pthread_mutex_destroy(&p->mutex);
+		free(p->buf);
+		free(p);
+	}
+	pthread_mutex_unlock(&m->mutex);
+}
+
+// Appends the buffered writes through the engine handle "fd". Must be
+// called with the buffer's mutex held. The bytes are dropped if they
+// can't be appended.
+static int flush_pending(Mount *m, int fd, Pending *p)
+{
+	if (p->len == 0)
+		return 0;
+	CozyFS *fs = thread_fs(m->fs);
+
+	int code = 0;
+	size_t written = 0;
+	while (written < p->len) {
+		unsigned long long before = cozyfs_changes(fs);
+		int num = cozyfs_write(fs, fd, p->buf + written, p->len - written);
+		if (num < 0) {
+			code = num;
+			break;
+		}
+		if (num > 0)
+			claim_change(m, fs, before);
+		written += num;
+	}
+	p->len = 0;
+
+	// The kernel already knows about this change
+	CozyFSStat stat;
+	if (written > 0 && cozyfs_fstat(fs, fd, &stat) == 0)
+		update_inode(m, p->ino, stat.gen);
+
+	return code;
+}
+
+// Returns the error of a flush that happened on behalf of another
+// handle, or of a call that doesn't report errors. Must be called
+// with the buffer's mutex held.
+static int take_error(Pending *p)
+{
+	int code = p->error;
+	p->error = 0;
+	return code;
+}
+
+// Adds the buffered bytes to the size of the file, so that the kernel
+// doesn't go back to the stored size while writes are in flight
+static void add_pending(Mount *m, fuse_ino_t ino, CozyFSStat *stat)
+{
+	if (stat->is_dir)
+		return;
+	Pending *p = get_pending(m, ino, 0);
+	if (p) {
+		pthread_mutex_lock(&p->mutex);
+		stat->size += p->len;
+		pthread_mutex_unlock(&p->mutex);
+		put_pending(m, p);
+	}
+}
+
+// Free bytes of the arena, assuming each free page becomes a file page
+static u64 arena_room(CozyFS *fs)
+{
+	CozyFSUsage usage;
+	if (cozyfs_usage(fs, &usage) < 0)
+		return 0;
+	return (u64) (usage.tot_pages - usage.num_pages + usage.free_pages) * PAGE_DATA;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Operations
+
+static void do_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+
+	// The writeback cache isn't requested: it flushes dirty pages
+	// in any order and from stale sizes, which an append-only file
+	// can't take. Small writes are gathered in "pending" instead.
+	conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+	conn->max_write = MAX_WRITE;
+}
+
+static void do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	Mount *m = fuse_req_userdata(req);
+
+	char path[MAX_PATH];
+	int code = child_path(m, parent, name, path);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	CozyFSStat stat;
+	code = cozyfs_stat(thread_fs(m->fs), path, &stat);
+	if (code < 0) {
+		fuse_reply_err(req, to_errno(code));
+		return;
+	}
+	add_pending(m, ino_of(m, stat), &stat);
+
+	struct fuse_entry_param e;
+	code = make_entry(m, parent, path, stat, &e);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+static void do_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	forget_inode(fuse_req_userdata(req), ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void do_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	Mount *m = fuse_req_userdata(req);
+	for (size_t i = 0; i < count; i++)
+		forget_inode(m, forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void do_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) fi;
+	Mount *m = fuse_req_userdata(req);
+
+	char path[MAX_PATH];
+	int code = path_of(m, ino, path);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	CozyFSStat stat;
+	code = cozyfs_stat(thread_fs(m->fs), path, &stat);
+	if (code < 0) {
+		fuse_reply_err(req, to_errno(code));
+		return;
+	}
+	add_pending(m, ino, &stat);
+
+	struct stat st;
+	fill_attr(&st, ino, stat);
+	fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+// Files can only grow by appending, so the only size change
+// accepted is one that leaves it as it is
+static void do_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	Mount *m = fuse_req_userdata(req);
+
+	char path[MAX_PATH];
+	int code = path_of(m, ino, path);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	CozyFSStat stat;
+	code = cozyfs_stat(thread_fs(m->fs), path, &stat);
+	if (code < 0) {
+		fuse_reply_err(req, to_errno(code));
+		return;
+	}
+	add_pending(m, ino, &stat);
+
+	if ((to_set & FUSE_SET_ATTR_SIZE) && (u64) attr->st_size != stat.size) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	// Modes, owners and times aren't stored, so they are ignored
+	(void) fi;
+	struct stat st;
+	fill_attr(&st, ino, stat);
+	fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	(void) fi;
+	Mount *m = fuse_req_userdata(req);
+
+	char path[MAX_PATH];
+	int code = path_of(m, ino, path);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	char *buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	// Offsets are engine cursors, which count entries
+	size_t used = 0;
+	unsigned int cursor = off;
+	for (;;) {
+		CozyFSDirEntry entries[32];
+		unsigned int start = cursor;
+		int num = cozyfs_readdir(thread_fs(m->fs), path, &cursor, entries, COUNT(entries));
+		if (num < 0) {
+			free(buf);
+			fuse_reply_err(req, to_errno(num));
+			return;
+		}
+		if (num == 0)
+			break;
+
+		int i = 0;
+		while (i < num) {
+			struct stat st;
+			fill_attr(&st, ino_of(m, entries[i].stat), entries[i].stat);
+			size_t len = fuse_add_direntry(req, buf + used, size - used, entries[i].name, &st, start + i + 1);
+			if (len > size - used)
+				break;
+			used += len;
+			i++;
+		}
+		if (i < num)
+			break; // The buffer is full
+	}
+
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void reply_open(fuse_req_t req, Mount *m, fuse_ino_t ino, int fd, struct fuse_file_info *fi, struct fuse_entry_param *e)
+{
+	FileHandle *fh = malloc(sizeof(FileHandle));
+	Pending *p = get_pending(m, ino, 1);
+	if (fh == NULL || p == NULL) {
+		if (p)
+			put_pending(m, p);
+		free(fh);
+		cozyfs_close(thread_fs(m->fs), fd);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fh->fd = fd;
+	pthread_mutex_init(&fh->mutex, NULL);
+	fh->pending = p;
+	fi->fh = (u64) fh;
+	fi->keep_cache = 1; // Invalidated by the watcher
+
+	if (e)
+		fuse_reply_create(req, e, fi);
+	else
+		fuse_reply_open(req, fi);
+}
+
+static void do_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	Mount *m = fuse_req_userdata(req);
+	CozyFS *fs = thread_fs(m->fs);
+
+	char path[MAX_PATH];
+	int code = path_of(m, ino, path);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	int fd = cozyfs_open(fs, path);
+	if (fd < 0) {
+		fuse_reply_err(req, to_errno(fd));
+		return;
+	}
+
+	// Nothing can be truncated
+	CozyFSStat stat;
+	if ((fi->flags & O_TRUNC) && (cozyfs_fstat(fs, fd, &stat) < 0 || stat.size > 0)) {
+		cozyfs_close(fs, fd);
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	reply_open(req, m, ino, fd, fi, NULL);
+}
+
+static void do_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+	(void) mode;
+	Mount *m = fuse_req_userdata(req);
+	CozyFS *fs = thread_fs(m->fs);
+
+	char path[MAX_PATH];
+	int code = child_path(m, parent, name, path);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	CozyFSStat stat;
+	code = cozyfs_stat(fs, path, &stat);
+	if (code == 0 && (fi->flags & O_EXCL)) {
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+	if (code == 0 && (fi->flags & O_TRUNC) && stat.size > 0) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	unsigned long long before = cozyfs_changes(fs);
+	int fd = cozyfs_create(fs, path);
+	if (fd < 0) {
+		fuse_reply_err(req, to_errno(fd));
+		return;
+	}
+	if (code == -COZYFS_ENOENT)
+		claim_change(m, fs, before);
+
+	code = cozyfs_fstat(fs, fd, &stat);
+	struct fuse_entry_param e;
+	if (code == 0)
+		code = make_entry(m, parent, path, stat, &e);
 	else
-		return -1;
-	
-	// ... //
-	
-	memcpy( buffer, selectedText + offset, size );
-		
-	return strlen( selectedText ) - offset;
-}
-
-static struct fuse_operations operations = {
-	.getattr	= do_getattr,
-	.readdir	= do_readdir,
-	.read		= do_read,
+		code = -to_errno(code);
+	if (code < 0) {
+		cozyfs_close(fs, fd);
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	reply_open(req, m, e.ino, fd, fi, &e);
+}
+
+// The bytes are copied out of the arena by the engine while it holds
+// its lock, since other processes may modify the file at any time
+static void do_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	Mount *m = fuse_req_userdata(req);
+	CozyFS *fs = thread_fs(m->fs);
+	FileHandle *fh = (FileHandle*) fi->fh;
+
+	char *buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	// Buffered bytes are appended first, possibly those of other
+	// handles. A failure is theirs, so it's left for them to report.
+	Pending *p = fh->pending;
+	pthread_mutex_lock(&p->mutex);
+	int code = flush_pending(m, fh->fd, p);
+	if (code < 0)
+		p->error = code;
+	pthread_mutex_unlock(&p->mutex);
+	(void) ino;
+
+	pthread_mutex_lock(&fh->mutex);
+
+	CozyFSStat stat;
+	code = cozyfs_fstat(fs, fh->fd, &stat);
+	if (code == 0 && (u64) off >= stat.size)
+		size = 0; // Seeking past the end is an error
+	if (code == 0 && size > 0)
+		code = cozyfs_seek(fs, fh->fd, off);
+
+	size_t copied = 0;
+	while (code == 0 && copied < size) {
+		int num = cozyfs_read(fs, fh->fd, buf + copied, MIN(size - copied, (size_t) MAX_WRITE));
+		if (num <= 0) {
+			code = num;
+			break;
+		}
+		copied += num;
+	}
+
+	pthread_mutex_unlock(&fh->mutex);
+
+	if (code < 0)
+		fuse_reply_err(req, to_errno(code));
+	else
+		fuse_reply_buf(req, buf, copied);
+	free(buf);
+}
+
+// Returns 1 if the file's bytes from "off" up to its end match "buf",
+// which holds "len" bytes. Must be called with the buffer's mutex held.
+static int matches_tail(CozyFS *fs, FileHandle *fh, u64 off, const char *buf, size_t len)
+{
+	Pending *p = fh->pending;
+	u64 flushed = p->end - p->len;
+	if (off < flushed) {
+
+		// The read moves the cursor of the handle
+		pthread_mutex_lock(&fh->mutex);
+		int code = cozyfs_seek(fs, fh->fd, off);
+		while (code == 0 && off < flushed && len > 0) {
+			char tmp[4096];
+			int num = cozyfs_read(fs, fh->fd, tmp, MIN(MIN(sizeof(tmp), flushed - off), len));
+			if (num <= 0 || memcmp(tmp, buf, num))
+				code = -1;
+			else {
+				off += num;
+				buf += num;
+				len -= num;
+			}
+		}
+		pthread_mutex_unlock(&fh->mutex);
+		if (code < 0)
+			return 0;
+	}
+	if (len == 0)
+		return 1;
+	size_t skip = off - flushed;
+	return memcmp(p->buf + skip, buf, len) == 0;
+}
+
+// The engine only appends, so writes must start at the end of the file.
+// Rewriting bytes before it is allowed as long as they don't change.
+static void do_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	(void) ino;
+	Mount *m = fuse_req_userdata(req);
+	CozyFS *fs = thread_fs(m->fs);
+	FileHandle *fh = (FileHandle*) fi->fh;
+	Pending *p = fh->pending;
+
+	pthread_mutex_lock(&p->mutex);
+
+	int code = take_error(p);
+	if (code < 0) {
+		pthread_mutex_unlock(&p->mutex);
+		fuse_reply_err(req, to_errno(code));
+		return;
+	}
+
+	// Other processes may have appended since the last batch
+	if (p->len == 0) {
+		CozyFSStat stat;
+		code = cozyfs_fstat(fs, fh->fd, &stat);
+		if (code < 0) {
+			pthread_mutex_unlock(&p->mutex);
+			fuse_reply_err(req, to_errno(code));
+			return;
+		}
+		p->end = stat.size;
+	}
+
+	size_t overlap = 0;
+	if ((u64) off < p->end)
+		overlap = MIN(size, (size_t) (p->end - off));
+	if ((u64) off > p->end || (overlap > 0 && !matches_tail(fs, fh, off, buf, overlap))) {
+		pthread_mutex_unlock(&p->mutex);
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	buf  += overlap;
+	size -= overlap;
+
+	// When the arena may not hold the bytes they are appended right
+	// away, so that running out of space fails this write rather than
+	// the close
+	int through = p->len + size > arena_room(fs);
+	if (through || p->len + size > MAX_PENDING)
+		code = flush_pending(m, fh->fd, p);
+
+	if (code == 0 && size > 0) {
+		if (p->buf == NULL)
+			p->buf = malloc(MAX_PENDING);
+		if (p->buf == NULL || size > MAX_PENDING)
+			code = -COZYFS_ENOMEM;
+		else {
+			memcpy(p->buf + p->len, buf, size);
+			p->len += size;
+			p->end += size;
+		}
+	}
+	if (code == 0 && through)
+		code = flush_pending(m, fh->fd, p);
+
+	pthread_mutex_unlock(&p->mutex);
+
+	if (code < 0)
+		fuse_reply_err(req, to_errno(code));
+	else
+		fuse_reply_write(req, overlap + size);
+}
+
+static void do_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+	Mount *m = fuse_req_userdata(req);
+	FileHandle *fh = (FileHandle*) fi->fh;
+	Pending *p = fh->pending;
+
+	pthread_mutex_lock(&p->mutex);
+	int code = flush_pending(m, fh->fd, p);
+	if (code == 0)
+		code = take_error(p);
+	pthread_mutex_unlock(&p->mutex);
+
+	fuse_reply_err(req, code < 0 ? to_errno(code) : 0);
+}
+
+static void do_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	(void) datasync;
+	do_flush(req, ino, fi);
+}
+
+static void do_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+	Mount *m = fuse_req_userdata(req);
+	FileHandle *fh = (FileHandle*) fi->fh;
+	Pending *p = fh->pending;
+
+	// The engine handle goes away, so the bytes are appended now.
+	// Errors were reported by the flush preceding the release, and
+	// later ones are left for the other handles.
+	pthread_mutex_lock(&p->mutex);
+	int code = flush_pending(m, fh->fd, p);
+	if (code < 0)
+		p->error = code;
+	pthread_mutex_unlock(&p->mutex);
+	put_pending(m, p);
+
+	cozyfs_close(thread_fs(m->fs), fh->fd);
+	pthread_mutex_destroy(&fh->mutex);
+	free(fh);
+	fuse_reply_err(req, 0);
+}
+
+static void do_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	(void) mode;
+	Mount *m = fuse_req_userdata(req);
+	CozyFS *fs = thread_fs(m->fs);
+
+	char path[MAX_PATH];
+	int code = child_path(m, parent, name, path);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	unsigned long long before = cozyfs_changes(fs);
+	code = cozyfs_mkdir(fs, path);
+	if (code == 0)
+		claim_change(m, fs, before);
+
+	CozyFSStat stat;
+	if (code == 0)
+		code = cozyfs_stat(fs, path, &stat);
+	if (code < 0) {
+		fuse_reply_err(req, to_errno(code));
+		return;
+	}
+
+	struct fuse_entry_param e;
+	code = make_entry(m, parent, path, stat, &e);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+static void remove_child(fuse_req_t req, fuse_ino_t parent, const char *name, int (*remove)(CozyFS*, const char*))
+{
+	Mount *m = fuse_req_userdata(req);
+
+	char path[MAX_PATH];
+	int code = child_path(m, parent, name, path);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	// Other links of the file may still be reached through the inode
+	CozyFS *fs = thread_fs(m->fs);
+	CozyFSStat stat;
+	int found = cozyfs_stat(fs, path, &stat) == 0;
+
+	unsigned long long before = cozyfs_changes(fs);
+	code = remove(fs, path);
+	if (code == 0)
+		claim_change(m, fs, before);
+	if (code == 0 && found)
+		unlink_inode(m, ino_of(m, stat), path);
+	fuse_reply_err(req, code < 0 ? to_errno(code) : 0);
+}
+
+static void do_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	remove_child(req, parent, name, cozyfs_unlink);
+}
+
+static void do_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	remove_child(req, parent, name, cozyfs_rmdir);
+}
+
+// The engine has no rename, so the file is linked under the new name
+// and unlinked from the old one within a transaction. Directories
+// can't be linked: EXDEV makes tools like mv copy them instead.
+static void do_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	Mount *m = fuse_req_userdata(req);
+	CozyFS *fs = thread_fs(m->fs);
+
+	if (flags & ~RENAME_NOREPLACE) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	char oldpath[MAX_PATH];
+	char newpath[MAX_PATH];
+	int code = child_path(m, parent, name, oldpath);
+	if (code == 0)
+		code = child_path(m, newparent, newname, newpath);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	unsigned long long before = cozyfs_changes(fs);
+	code = cozyfs_transaction_begin(fs);
+	if (code < 0) {
+		fuse_reply_err(req, to_errno(code));
+		return;
+	}
+
+	int err = 0;
+	int same = 0;
+	int replaced = 0;
+	CozyFSStat src;
+	CozyFSStat dst;
+	code = cozyfs_stat(fs, oldpath, &src);
+	if (code == 0 && src.is_dir)
+		err = EXDEV;
+	else if (code == 0 && cozyfs_stat(fs, newpath, &dst) == 0) {
+		if (flags & RENAME_NOREPLACE)
+			err = EEXIST;
+		else if (dst.is_dir)
+			err = EISDIR;
+		else if (dst.id == src.id)
+			same = 1; // Both names are links to the same file
+		else {
+			code = cozyfs_unlink(fs, newpath);
+			replaced = 1;
+		}
+	}
+	if (code == 0 && !err && !same)
+		code = cozyfs_link(fs, oldpath, newpath);
+	if (code == 0 && !err && !same)
+		code = cozyfs_unlink(fs, oldpath);
+
+	if (code < 0 || err || same) {
+		cozyfs_transaction_rollback(fs);
+		fuse_reply_err(req, code < 0 ? to_errno(code) : err);
+		return;
+	}
+
+	code = cozyfs_transaction_commit(fs);
+	if (code < 0) {
+		fuse_reply_err(req, to_errno(code));
+		return;
+	}
+	claim_change(m, fs, before);
+
+	if (replaced)
+		unlink_inode(m, ino_of(m, dst), newpath);
+	rename_inode(m, ino_of(m, src), oldpath, newparent, newpath);
+	fuse_reply_err(req, 0);
+}
+
+static void do_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+	Mount *m = fuse_req_userdata(req);
+	CozyFS *fs = thread_fs(m->fs);
+
+	char oldpath[MAX_PATH];
+	char newpath[MAX_PATH];
+	int code = path_of(m, ino, oldpath);
+	if (code == 0)
+		code = child_path(m, newparent, newname, newpath);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+
+	unsigned long long before = cozyfs_changes(fs);
+	code = cozyfs_link(fs, oldpath, newpath);
+	if (code == 0)
+		claim_change(m, fs, before);
+
+	CozyFSStat stat;
+	if (code == 0)
+		code = cozyfs_stat(fs, newpath, &stat);
+	if (code < 0) {
+		fuse_reply_err(req, to_errno(code));
+		return;
+	}
+
+	// The inode keeps the path it was first looked up with
+	struct fuse_entry_param e;
+	code = make_entry(m, newparent, newpath, stat, &e);
+	if (code < 0) {
+		fuse_reply_err(req, -code);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+static const struct fuse_lowlevel_ops operations = {
+	.init         = do_init,
+	.lookup       = do_lookup,
+	.forget       = do_forget,
+	.forget_multi = do_forget_multi,
+	.getattr      = do_getattr,
+	.setattr      = do_setattr,
+	.readdir      = do_readdir,
+	.open         = do_open,
+	.create       = do_create,
+	.read         = do_read,
+	.write        = do_write,
+	.flush        = do_flush,
+	.fsync        = do_fsync,
+	.release      = do_release,
+	.mkdir        = do_mkdir,
+	.unlink       = do_unlink,
+	.rmdir        = do_rmdir,
+	.rename       = do_rename,
+	.link         = do_link,
 };
 
-int main( int argc, char *argv[] )
+////////////////////////////////////////////////////////////////////////////////////////////
+// Invalidation
+
+// Copies the inodes the kernel knows about under the table's mutex
+static int collect_checks(Mount *m, Check **checks, int *count, char **paths)
+{
+	int capacity = 0;
+	size_t used = 0;
+	size_t space = 0;
+	*checks = NULL;
+	*count = 0;
+	*paths = NULL;
+
+	int code = 0;
+	pthread_mutex_lock(&m->mutex);
+	for (int i = 0; i < INODE_BUCKETS && code == 0; i++)
+		for (Inode *inode = m->buckets[i]; inode; inode = inode->next) {
+
+			if (*count == capacity) {
+				int n = capacity ? 2 * capacity : 32;
+				Check *p = realloc(*checks, n * sizeof(Check));
+				if (p == NULL) {
+					code = -ENOMEM;
+					break;
+				}
+				*checks = p;
+				capacity = n;
+			}
+
+			size_t len = strlen(inode->path) + 1;
+			if (used + len > space) {
+				size_t n = 2 * (space + len);
+				char *p = realloc(*paths, n);
+				if (p == NULL) {
+					code = -ENOMEM;
+					break;
+				}
+				*paths = p;
+				space = n;
+			}
+
+			Check *check = &(*checks)[(*count)++];
+			check->ino    = inode->ino;
+			check->parent = inode->parent;
+			check->gen    = inode->gen;
+			check->entry  = 0;
+			check->path   = used;
+			memcpy(*paths + used, inode->path, len);
+			used += len;
+		}
+	pthread_mutex_unlock(&m->mutex);
+	return code;
+}
+
+// Compares every inode the kernel knows about with the file system
+// and drops the kernel's caches for the ones other processes changed.
+// The paths are copied first so that the table isn't locked while
+// the arena is, and all of them are checked in a single critical
+// section of the engine.
+static void revalidate(Mount *m)
+{
+	CozyFS *fs = thread_fs(m->fs);
+
+	Check *checks;
+	char  *paths;
+	int count;
+	if (collect_checks(m, &checks, &count, &paths) < 0) {
+		free(checks);
+		free(paths);
+		return;
+	}
+
+	// Only the checks of inodes that need invalidating are kept
+	int batched = cozyfs_transaction_begin(fs) == 0;
+	int changed = 0;
+	for (int i = 0; i < count; i++) {
+		CozyFSStat stat;
+		int code = cozyfs_stat(fs, paths + checks[i].path, &stat);
+		if (code < 0 || ino_of(m, stat) != checks[i].ino)
+			checks[i].entry = 1;
+		else if (stat.gen != checks[i].gen)
+			checks[i].gen = stat.gen;
+		else
+			continue;
+		checks[changed++] = checks[i];
+	}
+	if (batched)
+		cozyfs_transaction_rollback(fs); // Nothing was modified
+
+	Invalidation *list = changed ? malloc(changed * sizeof(Invalidation)) : NULL;
+	int num = 0;
+
+	pthread_mutex_lock(&m->mutex);
+	for (int i = 0; i < changed && list; i++) {
+		Check *check = &checks[i];
+		if (!check->entry) {
+			Inode *inode = *find_inode(m, check->ino);
+			if (inode)
+				inode->gen = check->gen;
+		}
+		Invalidation *inv = &list[num++];
+		inv->ino    = check->ino;
+		inv->parent = check->parent;
+		inv->entry  = check->entry;
+		snprintf(inv->name, sizeof(inv->name), "%s", strrchr(paths + check->path, '/') + 1);
+	}
+	pthread_mutex_unlock(&m->mutex);
+	free(checks);
+	free(paths);
+
+	for (int i = 0; i < num; i++) {
+		if (list[i].entry)
+			fuse_lowlevel_notify_inval_entry(m->se, list[i].parent, list[i].name, strlen(list[i].name));
+		fuse_lowlevel_notify_inval_inode(m->se, list[i].ino, 0, 0);
+	}
+	free(list);
+}
+
+// Changes the mount claimed for itself (see claim_change) move "seen"
+// forward, and those wakeups don't cause a revalidation
+static void *watcher_loop(void *arg)
+{
+	Mount *m = arg;
+	CozyFS *fs = thread_fs(m->fs);
+
+	unsigned long long last = cozyfs_changes(fs);
+	__atomic_store_n(&m->seen, last, __ATOMIC_RELEASE);
+	while (!m->stop) {
+		int code = cozyfs_wait_change(fs, last, 1000);
+		if (code == -COZYFS_ETIMEDOUT)
+			continue;
+		if (code != COZYFS_OK)
+			sleep(1); // Don't spin if waiting isn't supported
+		last = cozyfs_changes(fs);
+		if (last == __atomic_load_n(&m->seen, __ATOMIC_ACQUIRE))
+			continue;
+		__atomic_store_n(&m->seen, last, __ATOMIC_RELEASE);
+		revalidate(m);
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Entry point
+
+int cozyfs_fuse(CozyFS *fs, const char *mountpoint)
 {
-	return fuse_main( argc, argv, &operations, NULL );
-}
\ No newline at end of file
+	Mount *m = calloc(1, sizeof(Mount));
+	if (m == NULL)
+		return -1;
+	m->fs = fs;
+	pthread_mutex_init(&m->mutex, NULL);
+
+	CozyFSStat root;
+	if (cozyfs_stat(thread_fs(m->fs), "/", &root) < 0) {
+		pthread_mutex_destroy(&m->mutex);
+		free(m);
+		return -1;
+	}
+	m->root_id = root.id;
+
+	char *argv[] = { "cozyfs", NULL };
+	struct fuse_args args = FUSE_ARGS_INIT(1, argv);
+
+	int ret = -1;
+	struct fuse_session *se = fuse_session_new(&args, &operations, sizeof(operations), m);
+	if (se) {
+		if (fuse_set_signal_handlers(se) == 0) {
+			if (fuse_session_mount(se, mountpoint) == 0) {
+
+				// Without the watcher, changes made by other
+				// processes show up when the timeouts expire
+				m->se = se;
+				pthread_t thread;
+				int watching = !pthread_create(&thread, NULL, watcher_loop, m);
+
+				// Each thread gets its own device descriptor
+				// so requests are spread without contention
+				struct fuse_loop_config config = {
+					.clone_fd = 1,
+					.max_idle_threads = 16,
+				};
+				ret = fuse_session_loop_mt(se, &config);
+
+				if (watching) {
+					m->stop = 1;
+					pthread_join(thread, NULL);
+				}
+				fuse_session_unmount(se);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+		fuse_session_destroy(se);
+	}
+	fuse_opt_free_args(&args);
+
+	for (int i = 0; i < INODE_BUCKETS; i++)
+		while (m->buckets[i]) {
+			Inode *inode = m->buckets[i];
+			m->buckets[i] = inode->next;
+			free_inode(inode);
+		}
+	pthread_mutex_destroy(&m->mutex);
+	free(m);
+	return ret;
+}
@@ -1,31 +1,42 @@
-#include "cozyfs_http.h"
+#define _GNU_SOURCE // accept4
+#include "http.h"
 
+#include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <zlib.h> // Link with -lz
 
 #if defined(_WIN32)
 #include <winsock2.h>
-#define POLL WSAPoll
 #define CLOSE_SOCKET closesocket
 #endif
 
 #if defined(__linux__)
-#include <poll.h>
+#include <time.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
-#define POLL poll
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #define CLOSE_SOCKET close
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "http.h"
+#include "thread_fs.h"
 
-// TODO: Use the HTTPServerConfig fields instead
-#define PORT 8080
-#define CONN_TIMEOUT 60
-#define RECV_TIMEOUT 5
-#define SEND_TIMEOUT 5
-#define INPUT_BUFFER_LIMIT (1<<20)
-#define CONNECTION_REUSE_LIMIT 100
+typedef unsigned long long u64;
 
 typedef struct {
 	char *ptr;
@@ -37,18 +48,118 @@ typedef struct {
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 #define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
 
+#define COUNT(X) ((int) (sizeof(X)/sizeof((X)[0])))
+#define ASSERT(X) if (!(X)) __builtin_trap();
+
+enum {
+	BODY_BUFFERED,    // Content-Length patched once the response is complete
+	BODY_LENGTH,      // Streamed with a Content-Length known upfront
+	BODY_CHUNKED,     // Streamed with chunked transfer encoding
+	BODY_UNTIL_CLOSE, // Streamed to HTTP/1.0 clients, delimited by closing
+};
+
+// Timeouts are tracked with a two level timer wheel. The first level
+// has one slot per tick, the second one slot per rotation of the first.
+#define TIMER_TICK_MS 100
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_MASK    (WHEEL_SLOTS - 1)
+
 typedef struct {
+	void (*release)(void *data);
+	void  *data;
+} Pin;
+
+typedef struct Worker     Worker;
+typedef struct Connection Connection;
+struct Connection {
 	int sock_fd;
 
+	// Consumed requests are skipped by moving "input_head" forward.
+	// The unconsumed bytes are only moved to the front when the
+	// buffer runs out of space at the end. Bytes before "input_scan"
+	// are known not to end a request head.
 	char *input_buffer;
+	int   input_pooled; // The buffer is a slab block
+	int   input_head;
+	int   input_scan;
 	int   input_count;
 	int   input_capacity;
 
 	char *output_buffer;
+	int   output_pooled;
 	int   output_count;
 	int   output_capacity;
 
+	// The output is a queue of segments sent in order with sendmsg.
+	// A segment either borrows memory from the caller (usually file
+	// pages) which is sent without copying, or has a NULL base and
+	// refers to the next bytes of the output buffer.
+	struct iovec *segs;
+	int           seg_head;
+	int           seg_count;
+	int           seg_capacity;
+
+	// Bytes borrowed by the current response
+	long long span_bytes;
+
+	// Owners of borrowed memory to notify once the queue is drained.
+	// They may hear later than they could, but never earlier.
+	Pin *pins;
+	int  num_pins;
+	int  pin_capacity;
+
+	// Body of the current request consumed as it arrives
+	HTTPUpload upload;
+	long long  upload_remaining;
+
+	// Body of the current response produced as the socket drains.
+	// While it's active, pipelined requests wait.
+	HTTPStream stream;
+	int        stream_done;
+	long long  stream_remaining;
+	int        body_mode;
+
+	// Connections with work left that yielded to let others run
+	Connection *ready_prev;
+	Connection *ready_next;
+	int         ready;
+
+	// Streams that returned HTTP_STREAM_WAIT. "park_epoch" is the
+	// wake count seen before the stream was called, so a wake that
+	// races with it isn't lost. "park_channel_epoch" is the same for
+	// the channel of the stream.
+	Connection  *park_prev;
+	Connection  *park_next;
+	int          parked;
+	int          stream_waiting;
+	u64          park_epoch;
+	HTTPChannel *park_channel;
+	u64          park_channel_epoch;
+
+	// Position in the timer wheel. Activity doesn't move the timer,
+	// it's checked against the actual timeout when its slot expires.
+	Connection  *timer_prev;
+	Connection  *timer_next;
+	Connection **timer_slot;
+
+	// While a job runs on the pool, only the pool thread may touch
+	// the connection's buffers. The reactor neither reads nor sends
+	// and defers closing until the job is handed back.
+	Worker     *worker;
+	Connection *job_next;
+	int         job_result;
+	int         busy;
+	int         dropped;
+
+	// Bytes received so far and up to which point the requests were
+	// processed, so the reactor knows when there's new work.
+	long long input_total;
+	long long input_checked;
+
 	int response_offset;
+	int response_seg_count;
+	int response_seg_len;
 	int state;
 	int error;
 	int minor;
@@ -56,13 +167,178 @@ typedef struct {
 	int content_offset;
 	int content_length_value_offset;
 
+	// HEAD responses go through the same code as GET. The body
+	// is dropped once its length is known, from the segment
+	// that was last when it started.
+	int head_only;
+	int content_seg_count;
+	int content_seg_len;
+
 	int num_requests;
 	int close_when_flushed;
 
-	int accept_time;
-	int last_recv_time;
-	int last_send_time;
-} Connection;
+	u64 accept_time;
+	u64 last_recv_time;
+	u64 last_send_time;
+};
+
+// Parked streams are kept in lists by channel so a wake of one
+// channel only walks the streams that may be waiting on it. Up to
+// WOKEN_MAX channels are queued per worker between checks, past
+// that every parked stream is resumed.
+#define PARK_BUCKETS 64
+#define WOKEN_MAX    64
+
+// Fixed-size buffers reused across connections. Blocks are carved from
+// chunks that are only released with the worker. Pool threads may grow
+// output buffers, so the free list is protected by a mutex.
+#define SLAB_BLOCK_SIZE   (1<<14)
+#define SLAB_CHUNK_BLOCKS 64
+
+typedef struct SlabChunk SlabChunk;
+struct SlabChunk {
+	SlabChunk *next;
+	char       data[];
+};
+
+typedef struct {
+	pthread_mutex_t mutex;
+	SlabChunk      *chunks;
+	void           *free_list; // Linked through the first bytes of each block
+} Slab;
+
+static void slab_init(Slab *slab)
+{
+	pthread_mutex_init(&slab->mutex, NULL);
+	slab->chunks = NULL;
+	slab->free_list = NULL;
+}
+
+static void slab_free(Slab *slab)
+{
+	while (slab->chunks) {
+		SlabChunk *chunk = slab->chunks;
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+	pthread_mutex_destroy(&slab->mutex);
+}
+
+static void *slab_get(Slab *slab)
+{
+	pthread_mutex_lock(&slab->mutex);
+
+	if (slab->free_list == NULL) {
+		SlabChunk *chunk = malloc(sizeof(SlabChunk) + SLAB_CHUNK_BLOCKS * SLAB_BLOCK_SIZE);
+		if (chunk == NULL) {
+			pthread_mutex_unlock(&slab->mutex);
+			return NULL;
+		}
+		chunk->next = slab->chunks;
+		slab->chunks = chunk;
+		for (int i = 0; i < SLAB_CHUNK_BLOCKS; i++) {
+			void **block = (void**) (chunk->data + i * SLAB_BLOCK_SIZE);
+			*block = slab->free_list;
+			slab->free_list = block;
+		}
+	}
+
+	void **block = slab->free_list;
+	slab->free_list = *block;
+
+	pthread_mutex_unlock(&slab->mutex);
+	return block;
+}
+
+static void slab_put(Slab *slab, void *ptr)
+{
+	pthread_mutex_lock(&slab->mutex);
+	*(void**) ptr = slab->free_list;
+	slab->free_list = ptr;
+	pthread_mutex_unlock(&slab->mutex);
+}
+
+// Threads running request callbacks and streams off the event loop,
+// so that waiting for the file system only stalls the connections
+// that need it. Jobs are queued through the connections themselves.
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	Connection     *head;
+	Connection     *tail;
+	int             stop;
+	int             num_threads;
+	pthread_t      *threads;
+} Pool;
+
+// Each worker thread owns a listening socket bound with SO_REUSEPORT,
+// so the kernel spreads incoming connections between workers and no
+// state is shared between them.
+struct Worker {
+	int epoll_fd;
+	int accept_fd;
+	int accept_pending; // The backlog wasn't drained because the table was full
+
+	int         num_conns;
+	int         max_conns;
+	Connection *conns;
+	int        *free_list;
+
+	// Read by http_server_stats from other threads
+	u64 num_accepted;
+	u64 num_requests;
+
+	Slab slab;
+
+	u64 current_time;
+
+	u64         wheel_tick; // Last tick processed
+	int         num_timers;
+	Connection *wheel[2][WHEEL_SLOTS];
+
+	Connection *ready_head;
+	Connection *ready_tail;
+
+	Connection *parked[PARK_BUCKETS];
+	u64         wake_epoch; // Last wake handled
+
+	// Channels passed to http_wake_channel since the last check
+	pthread_mutex_t woken_mutex;
+	HTTPChannel    *woken[WOKEN_MAX];
+	int             num_woken;
+	int             woken_overflow;
+
+	HTTPServerConfig config;
+	HTTPCallback     callback;
+	void*            userptr;
+
+	// Jobs completed by the pool, signaled through "event_fd"
+	Pool           *pool;
+	int             event_fd;
+	pthread_mutex_t done_mutex;
+	Connection     *done_head;
+
+	Worker   *registry_next;
+	pthread_t thread;
+};
+
+// Workers of all running servers, so http_wake_streams can
+// reach them. "wake_epoch" counts the calls.
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Worker         *registry = NULL;
+static u64             wake_epoch = 0;
+
+static int is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static char to_lower(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 'a';
+	return c;
+}
 
 static int
 streq_case_insensitive(string a, string b)
@@ -75,16 +351,25 @@ streq_case_insensitive(string a, string b)
 	return 1;
 }
 
-static int
+static HTTPHeader *find_header(HTTPRequest *req, string name)
+{
+	for (int i = 0; i < req->num_headers; i++) {
+		HTTPHeader *header = &req->headers[i];
+		if (streq_case_insensitive((string) { header->name, header->name_len }, name))
+			return header;
+	}
+	return NULL;
+}
+
+// Returns 0 when the header is missing and -1 when it's invalid
+static long long
 parse_content_length(HTTPRequest *req)
 {
-	int i = 0;
-	while (i < req->num_headers && !streq_case_insensitive(req->headers[i].name, S("Content-Length")))
-		i++;
-	if (i == req->num_headers)
-		return -1;
-	char *src = req->headers[i].value.ptr;
-	int   len = req->headers[i].value.len;
+	HTTPHeader *header = find_header(req, S("Content-Length"));
+	if (header == NULL)
+		return 0;
+	char *src = header->value;
+	int   len = header->value_len;
 
 	int i = 0;
 	while (i < len && src[i] == ' ')
@@ -92,14 +377,17 @@ parse_content_length(HTTPRequest *req)
 	if (i == len || !is_digit(src[i]))
 		return -1;
 
-	int result = 0;
+	long long result = 0;
 	do {
 		int d = src[i++] - '0';
-		if (result > (INT_MAX - d) / 10)
+		if (result > (LLONG_MAX - d) / 10)
 			return -1;
 		result = result * 10 + d;
 	} while (i < len && is_digit(src[i]));
 
+	while (i < len && src[i] == ' ')
+		i++;
+
 	if (i < len)
 		return -1;
 
@@ -184,6 +472,10 @@ static int parse(char *src, int len, HTTPRequest *req)
 		return -1;
 	}
 
+	if (i == len || src[i] != ' ')
+		return -1;
+	i++;
+
 	int off = i;
 	while (i < len && src[i] != ' ')
 		i++;
@@ -225,6 +517,12 @@ static int parse(char *src, int len, HTTPRequest *req)
 		return -1;
 	}
 
+	if (1 >= len - i
+		|| src[i+0] != '\r'
+		|| src[i+1] != '\n')
+		return -1;
+	i += 2;
+
 	req->num_headers = 0;
 	for (;;) {
 
@@ -245,6 +543,10 @@ static int parse(char *src, int len, HTTPRequest *req)
 
 		i++;
 
+		// Leading and trailing whitespace isn't part of the value
+		while (i < len && (src[i] == ' ' || src[i] == '\t'))
+			i++;
+
 		off = i;
 		while (i < len && src[i] != '\r') // TODO: This is not good
 			i++;
@@ -252,6 +554,8 @@ static int parse(char *src, int len, HTTPRequest *req)
 			return -1;
 		char *value = src + off;
 		int   value_len = i - off;
+		while (value_len > 0 && (value[value_len-1] == ' ' || value[value_len-1] == '\t'))
+			value_len--;
 
 		if (1 >= len - i
 			|| src[i+0] != '\r'
@@ -333,42 +637,123 @@ static string status_text(int code)
 		case 503: return S("Service Unavailable");
 		case 504: return S("Gateway Timeout");
 		case 505: return S("HTTP Version Not Supported");
+		case 507: return S("Insufficient Storage");
 		case 509: return S("Bandwidth Limit Exceeded");
 	}
 	return S("???");
 }
 
+// Buffers that fit in a block come from the worker's slab. Only
+// unusually large requests or responses go through malloc.
+static char *alloc_buffer(Worker *w, int *size, int *pooled)
+{
+	if (*size <= SLAB_BLOCK_SIZE) {
+		*size = SLAB_BLOCK_SIZE;
+		*pooled = 1;
+		return slab_get(&w->slab);
+	}
+	*pooled = 0;
+	return malloc(*size);
+}
+
+static void free_buffer(Worker *w, char *ptr, int pooled)
+{
+	if (pooled)
+		slab_put(&w->slab, ptr);
+	else
+		free(ptr);
+}
+
 static char *write_bytes_ptr(Connection *c, int mincap, int *cap)
 {
 	if (c->error) return NULL;
 	if (c->output_capacity - c->output_count < mincap) {
-		int x = MAX(mincap, 2 * c->output_capacity);
-		void *p = malloc(x);
+		int pooled;
+		int x = MAX(c->output_count + mincap, 2 * c->output_capacity);
+		char *p = alloc_buffer(c->worker, &x, &pooled);
 		if (p == NULL) {
 			c->error = 1;
 			return NULL;
 		}
 		if (c->output_capacity) {
 			memcpy(p, c->output_buffer, c->output_count);
-			free(c->output_buffer);
+			free_buffer(c->worker, c->output_buffer, c->output_pooled);
 		}
 		c->output_buffer = p;
+		c->output_pooled = pooled;
 		c->output_capacity = x;
 	}
 	*cap = c->output_capacity - c->output_count;
 	return c->output_buffer + c->output_count;
 }
 
+static void push_segment(Connection *c, void *ptr, int len)
+{
+	if (c->seg_count > c->seg_head) {
+		struct iovec *last = &c->segs[c->seg_count-1];
+		if (ptr == NULL && last->iov_base == NULL) {
+			last->iov_len += len;
+			return;
+		}
+		if (ptr != NULL && (char*) last->iov_base + last->iov_len == ptr) {
+			last->iov_len += len;
+			return;
+		}
+	}
+
+	if (c->seg_count == c->seg_capacity) {
+		int x = MAX(8, 2 * c->seg_capacity);
+		void *p = realloc(c->segs, x * sizeof(struct iovec));
+		if (p == NULL) {
+			c->error = 1;
+			return;
+		}
+		c->segs = p;
+		c->seg_capacity = x;
+	}
+
+	c->segs[c->seg_count++] = (struct iovec) { ptr, len };
+}
+
+static void release_pins(Connection *c)
+{
+	for (int i = 0; i < c->num_pins; i++)
+		c->pins[i].release(c->pins[i].data);
+	c->num_pins = 0;
+}
+
 static void write_bytes_ack(Connection *c, int num)
 {
 	if (c->error) return;
 	c->output_count += num;
+	push_segment(c, NULL, num);
+}
+
+// Drops the last "num" bytes written to the output buffer
+static void unwrite_bytes(Connection *c, int num)
+{
+	struct iovec *last = &c->segs[c->seg_count-1];
+	ASSERT(last->iov_base == NULL && last->iov_len >= (size_t) num);
+	last->iov_len -= num;
+	if (last->iov_len == 0)
+		c->seg_count--;
+	c->output_count -= num;
+}
+
+// Bytes queued but not sent yet
+static long long pending_output(Connection *c)
+{
+	long long total = c->output_count;
+	for (int i = c->seg_head; i < c->seg_count; i++)
+		if (c->segs[i].iov_base)
+			total += c->segs[i].iov_len;
+	return total;
 }
 
 static void write_bytes(Connection *c, string s)
 {
 	int cap;
-	void *ptr = write_bytes_ptr(c, s.len, cap);
+	void *ptr = write_bytes_ptr(c, s.len, &cap);
 	if (ptr == NULL) return;
 	memcpy(ptr, s.ptr, s.len);
 	write_bytes_ack(c, s.len);
@@ -386,7 +771,8 @@ static void write_head(Connection *c, int status)
 	dst = write_bytes_ptr(c, 1<<9, &cap);
 	if (dst == NULL) return;
 
-	int len = snprintf(dst, cap, "HTTP/1.%d %d %s\r\n", c->minor, status, status_text(status));
+	string text = status_text(status);
+	int len = snprintf(dst, cap, "HTTP/1.%d %d %.*s\r\n", c->minor, status, text.len, text.ptr);
 	if (len < 0) {
 		c->error = 1;
 		return;
@@ -402,7 +788,7 @@ static void write_header(Connection *c, const char *fmt, va_list args)
 	ASSERT(c->state == 1);
 
 	int cap;
-	char *ptr = write_bytes_ptr(c, 512, cap);
+	char *ptr = write_bytes_ptr(c, 512, &cap);
 	if (ptr) {
 		int len = vsnprintf(ptr, cap, fmt, args);
 		if (len < 0 || len+2 > cap)
@@ -415,18 +801,55 @@ static void write_header(Connection *c, const char *fmt, va_list args)
 	}
 }
 
+static void end_stream(Connection *c)
+{
+	if (c->stream.free)
+		c->stream.free(c->stream.data);
+	c->stream = (HTTPStream) {0};
+	c->stream_waiting = 0;
+}
+
 static void restart_response(Connection *c)
 {
+	// Nothing is sent while the callback runs, so the
+	// response can still be removed from the queue.
 	c->output_count = c->response_offset;
+	c->seg_count = c->response_seg_count;
+	if (c->seg_count > c->seg_head && c->segs[c->seg_count-1].iov_base == NULL)
+		c->segs[c->seg_count-1].iov_len = c->response_seg_len;
+	c->span_bytes = 0;
+	c->body_mode = BODY_BUFFERED;
+	end_stream(c);
 	c->error = 0;
 	c->state = 0;
 }
 
 static void special_headers(Connection *c)
 {
-	write_bytes(c, S("Content-Length: "));
-	c->content_length_value_offset = c->output_count;
-	write_bytes(c, S("          \r\n")); // Exactly 10 spaces
+	switch (c->body_mode) {
+
+		case BODY_BUFFERED:
+		write_bytes(c, S("Content-Length: "));
+		c->content_length_value_offset = c->output_count;
+		write_bytes(c, S("          \r\n")); // Exactly 10 spaces
+		break;
+
+		case BODY_LENGTH:
+		{
+			int cap;
+			char *dst = write_bytes_ptr(c, 64, &cap);
+			if (dst == NULL) return;
+			write_bytes_ack(c, snprintf(dst, cap, "Content-Length: %lld\r\n", c->stream_remaining));
+		}
+		break;
+
+		case BODY_CHUNKED:
+		write_bytes(c, S("Transfer-Encoding: chunked\r\n"));
+		break;
+
+		case BODY_UNTIL_CLOSE:
+		break;
+	}
 
 	if (c->keep_alive)
 		write_bytes(c, S("Connection: Keep-Alive\r\n"));
@@ -435,11 +858,13 @@ static void special_headers(Connection *c)
 
 	write_bytes(c, S("\r\n"));
 	c->content_offset = c->output_count;
+	c->content_seg_count = c->seg_count;
+	c->content_seg_len = c->seg_count > c->seg_head ? c->segs[c->seg_count-1].iov_len : 0;
 }
 
 static void *write_body_ptr(Connection *c, int mincap, int *cap)
 {
-	if (c->error) return;
+	if (c->error) return NULL;
 
 	ASSERT(c->state == 1 || c->state == 2);
 
@@ -465,6 +890,159 @@ static void write_body(Connection *c, string s)
 	write_body_ack(c, s.len);
 }
 
+static void write_body_span(Connection *c, const void *ptr, int len)
+{
+	if (c->error) return;
+
+	ASSERT(c->state == 1 || c->state == 2);
+
+	if (c->state == 1) {
+		special_headers(c);
+		c->state = 2;
+	}
+
+	if (len == 0)
+		return;
+
+	push_segment(c, (void*) ptr, len);
+	c->span_bytes += len;
+}
+
+static void write_body_span_release(Connection *c, const void *ptr, int len, void (*release)(void*), void *data)
+{
+	if (c->num_pins == c->pin_capacity) {
+		int x = MAX(4, 2 * c->pin_capacity);
+		void *p = realloc(c->pins, x * sizeof(Pin));
+		if (p == NULL) {
+			c->error = 1;
+			release(data);
+			return;
+		}
+		c->pins = p;
+		c->pin_capacity = x;
+	}
+	c->pins[c->num_pins++] = (Pin) { release, data };
+	write_body_span(c, ptr, len);
+}
+
+static void write_body_stream(Connection *c, long long length, HTTPStream stream)
+{
+	if (c->error) {
+		if (stream.free)
+			stream.free(stream.data);
+		return;
+	}
+
+	ASSERT(c->state == 1);
+
+	if (length >= 0) {
+		c->body_mode = BODY_LENGTH;
+		c->stream_remaining = length;
+	} else if (c->minor == 1)
+		c->body_mode = BODY_CHUNKED;
+	else {
+		c->body_mode = BODY_UNTIL_CLOSE;
+		c->keep_alive = 0;
+	}
+
+	special_headers(c);
+	c->state = 2;
+
+	if (c->head_only) {
+		if (stream.free)
+			stream.free(stream.data);
+		return;
+	}
+	c->stream = stream;
+	c->stream_done = 0;
+}
+
+static void end_upload(Connection *c)
+{
+	if (c->upload.free)
+		c->upload.free(c->upload.data);
+	c->upload = (HTTPUpload) {0};
+}
+
+static void read_body_stream(Connection *c, HTTPUpload upload)
+{
+	// The response can only be written once the body is received
+	if (c->error || c->state != 0 || c->upload.callback) {
+		if (upload.free)
+			upload.free(upload.data);
+		c->error = 1;
+		return;
+	}
+	c->upload = upload;
+}
+
+// Asks the stream for as many bytes as fit in the output window.
+// Returns 1 if the connection must be dropped.
+static int pump_stream(Worker *w, Connection *c)
+{
+	long long max = w->config.output_window - pending_output(c);
+	if (max <= 0)
+		return 0;
+
+	if (c->body_mode == BODY_LENGTH)
+		max = MIN(max, c->stream_remaining);
+
+	int chunk_header = -1;
+	if (c->body_mode == BODY_CHUNKED) {
+		chunk_header = c->output_count;
+		write_bytes(c, S("00000000\r\n")); // Chunk size, patched below
+	}
+
+	long long buffered = c->output_count;
+	long long borrowed = c->span_bytes;
+
+	u64 epoch = __atomic_load_n(&wake_epoch, __ATOMIC_ACQUIRE);
+	HTTPChannel *channel = c->stream.channel;
+	u64 channel_epoch = channel ? __atomic_load_n(&channel->epoch, __ATOMIC_ACQUIRE) : 0;
+	int ret = c->stream.callback((HTTPResponse*) c, max, c->stream.data);
+
+	// The head was sent already so errors can't be
+	// reported. All we can do is drop the connection.
+	if (ret == HTTP_STREAM_ERROR || c->error)
+		return 1;
+
+	long long produced = (c->output_count - buffered) + (c->span_bytes - borrowed);
+
+	if (c->body_mode == BODY_CHUNKED) {
+		if (produced == 0)
+			unwrite_bytes(c, 10);
+		else {
+			char buf[9];
+			snprintf(buf, sizeof(buf), "%08llx", produced);
+			memcpy(c->output_buffer + chunk_header, buf, 8);
+			write_bytes(c, S("\r\n"));
+		}
+		if (ret == HTTP_STREAM_DONE)
+			write_bytes(c, S("0\r\n\r\n"));
+	}
+
+	if (c->body_mode == BODY_LENGTH)
+		c->stream_remaining -= produced;
+
+	if (ret == HTTP_STREAM_DONE) {
+		// A body shorter than advertised leaves the
+		// connection in an unusable state.
+		if (c->body_mode == BODY_LENGTH && c->stream_remaining != 0)
+			c->close_when_flushed = 1;
+		end_stream(c);
+		c->stream_done = 1;
+		c->state = 3;
+	} else if (ret == HTTP_STREAM_WAIT) {
+		c->stream_waiting = 1;
+		c->park_epoch = epoch;
+		c->park_channel = channel;
+		c->park_channel_epoch = channel_epoch;
+	} else if (produced == 0)
+		return 1; // A stream that doesn't progress would never be called again
+
+	return c->error;
+}
+
 static void write_end(Connection *c)
 {
 	if (c->error) {
@@ -477,29 +1055,162 @@ static void write_end(Connection *c)
 		c->state = 2;
 	}
 
-	// TODO
+	if (c->content_length_value_offset >= 0) {
+		// Fill the spaces reserved by special_headers
+		char buf[11];
+		int content_length = c->output_count - c->content_offset + c->span_bytes;
+		int len = snprintf(buf, sizeof(buf), "%d", content_length);
+		memcpy(c->output_buffer + c->content_length_value_offset, buf, len);
+	}
+
+	if (c->head_only && c->content_offset >= 0) {
+		c->output_count = c->content_offset;
+		c->seg_count = c->content_seg_count;
+		if (c->seg_count > c->seg_head && c->segs[c->seg_count-1].iov_base == NULL)
+			c->segs[c->seg_count-1].iov_len = c->content_seg_len;
+		c->span_bytes = 0;
+	}
+
+	// Streamed responses are completed by pump_stream
+	if (c->stream.callback == NULL)
+		c->state = 3;
+}
+
+static void process_single_request(Worker *w, Connection *c, HTTPRequest *req)
+{
+	__atomic_add_fetch(&w->num_requests, 1, __ATOMIC_RELAXED); // May run on the pool
+	w->callback(req, (HTTPResponse*) c, w->userptr);
+}
+
+static void prepare_response(Connection *c)
+{
+	c->response_offset = c->output_count;
+	c->response_seg_count = c->seg_count;
+	c->response_seg_len = c->seg_count > c->seg_head ? c->segs[c->seg_count-1].iov_len : 0;
+	c->error = 0;
+	c->state = 0;
+	c->content_offset = -1;
+	c->content_length_value_offset = -1;
+	c->span_bytes = 0;
+	c->body_mode = BODY_BUFFERED;
+	c->head_only = 0;
+}
+
+static int finish_response(Connection *c)
+{
+	write_end(c); // Make sure this is called
+	if (c->error)
+		return 1;
+
+	c->num_requests++;
+	if (c->keep_alive == 0)
+		c->close_when_flushed = 1;
+	return 0;
+}
+
+static int pending_input(Connection *c)
+{
+	return c->input_count - c->input_head;
+}
+
+static void consume_input(Connection *c, int num)
+{
+	c->input_head += num;
+	c->input_scan = MAX(c->input_scan, c->input_head);
+	if (c->input_head == c->input_count) {
+		c->input_head  = 0;
+		c->input_scan  = 0;
+		c->input_count = 0;
+	}
+}
 
-	c->state = 3;
+// Returns the offset just past the first CRLFCRLF of "src",
+// starting the search at "from", or -1 if there is none.
+// Candidates are found by looking for LFs 16 bytes at a time.
+static int find_head_end(const char *src, int len, int from)
+{
+	int i = MAX(from, 3);
+#if defined(__SSE2__)
+	__m128i lf = _mm_set1_epi8('\n');
+	while (len - i >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*) (src + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lf));
+		while (mask) {
+			int j = i + __builtin_ctz(mask);
+			if (src[j-1] == '\r' && src[j-2] == '\n' && src[j-3] == '\r')
+				return j + 1;
+			mask &= mask - 1;
+		}
+		i += 16;
+	}
+#endif
+	for (; i < len; i++)
+		if (src[i] == '\n' && src[i-1] == '\r' && src[i-2] == '\n' && src[i-3] == '\r')
+			return i + 1;
+	return -1;
 }
 
-static void process_single_request(Connection *c, HTTPRequest *req, void *userptr)
+// Hands the buffered body bytes to the upload callback. Once the
+// whole body is received, the callback writes the response.
+static int feed_upload(Connection *c)
 {
-	// TODO
+	int num = MIN(pending_input(c), c->upload_remaining);
+	if (num > 0) {
+		int ret = c->upload.callback((HTTPResponse*) c, c->input_buffer + c->input_head, num, c->upload.data);
+		if (ret == HTTP_STREAM_ERROR)
+			return 1;
+		consume_input(c, num);
+		c->upload_remaining -= num;
+	}
+
+	if (c->upload_remaining > 0)
+		return 0;
+
+	// Bytes may have been sent while the body was
+	// arriving so the response starts from here.
+	prepare_response(c);
+
+	int ret = c->upload.callback((HTTPResponse*) c, NULL, 0, c->upload.data);
+	end_upload(c);
+	if (ret == HTTP_STREAM_ERROR)
+		return 1;
+
+	return finish_response(c);
 }
 
-static int process_queued_requests(Connection *c, CozyFS *fs)
+static int process_queued_requests(Worker *w, Connection *c)
 {
+	if (c->stream.callback || c->close_when_flushed)
+		return 0;
+
 	for (;;) {
 
-		// Look for the CRLFCRLF
-		int k = 0;
-		while (3 < c->input_count - k && (c->input_buffer[k+0] != '\r' || c->input_buffer[k+1] != '\n' || c->input_buffer[k+2] != '\r' || c->input_buffer[k+3] != '\n'))
-			k++;
-		if (3 >= c->input_count - k)
-			break;
+		if (c->upload.callback) {
+			if (feed_upload(c))
+				return 1;
+			if (c->upload.callback || c->close_when_flushed || c->stream.callback)
+				break;
+			continue;
+		}
 
-		char *head = c->input_buffer;
-		int head_len = k + 4;
+		// Look for the CRLFCRLF, resuming where the last search stopped
+		char *head = c->input_buffer + c->input_head;
+		int end = find_head_end(head, pending_input(c), c->input_scan - c->input_head);
+		if (end < 0 && pending_input(c) >= w->config.input_buffer_limit) {
+			// The buffer can't grow and nothing in it can be consumed
+			write_head(c, 431);
+			write_bytes(c, S("Connection: Close\r\n"));
+			write_bytes(c, S("Content-Length: 0\r\n"));
+			write_bytes(c, S("\r\n"));
+			c->close_when_flushed = 1;
+			return 0;
+		}
+		if (end < 0) {
+			c->input_scan = c->input_count;
+			c->input_checked = c->input_total;
+			break;
+		}
+		int head_len = end;
 
 		HTTPRequest req;
 		int code = parse(head, head_len, &req);
@@ -515,12 +1226,24 @@ static int process_queued_requests(Connection *c, CozyFS *fs)
 		if (req.major != 1 || (req.minor != 1 && req.minor != 0)) {
 			// TODO: 505 HTTP Version Not Supported
 			ASSERT(0);
-			return;
+			return 1;
+		}
+
+		// Chunked request bodies aren't supported
+		long long content_len = parse_content_length(&req);
+		if (content_len < 0 || find_header(&req, S("Transfer-Encoding"))) {
+			write_head(c, content_len < 0 ? 400 : 411);
+			write_bytes(c, S("Connection: Close\r\n"));
+			write_bytes(c, S("Content-Length: 0\r\n"));
+			write_bytes(c, S("\r\n"));
+			c->close_when_flushed = 1;
+			return 0;
 		}
 
-		int content_len = parse_content_length(&req);
-		if (content_len < 0) {
-			write_head(c, 411);
+		// "100-continue" is the only expectation defined
+		HTTPHeader *expect = find_header(&req, S("Expect"));
+		if (expect && !streq_case_insensitive((string) { expect->value, expect->value_len }, S("100-continue"))) {
+			write_head(c, 417);
 			write_bytes(c, S("Connection: Close\r\n"));
 			write_bytes(c, S("Content-Length: 0\r\n"));
 			write_bytes(c, S("\r\n"));
@@ -528,357 +1251,2856 @@ static int process_queued_requests(Connection *c, CozyFS *fs)
 			return 0;
 		}
 
-		int total_len = head_len + content_len;
-		if (total_len > c->input_count) break;
+		// Bodies that fit in the input buffer are handed to the callback
+		// whole. Larger ones can only be consumed with an upload stream.
+		int buffered = head_len + content_len <= w->config.input_buffer_limit;
+		if (buffered && head_len + content_len > pending_input(c)) {
+			c->input_checked = c->input_total;
+			break;
+		}
+
+		req.content_length = content_len;
+		req.body = buffered ? head + head_len : NULL;
+		req.body_len = buffered ? content_len : 0;
 
 		// Prepare connection for responding
-		c->response_offset = c->output_count;
-		c->error = 0;
-		c->state = 0;
+		prepare_response(c);
+		c->head_only = req.method == M_HEAD;
 		c->minor = req.minor;
 		c->keep_alive = 1;
-		if (num_conns * 10 >= COUNT(conns) * 7)
+		if (w->num_conns * 10 >= w->max_conns * 7)
 			c->keep_alive = 0;
-		if (c->num_requests >= CONNECTION_REUSE_LIMIT)
+		if (c->num_requests >= w->config.connection_reuse_limit)
 			c->keep_alive = 0;
 		if (req.minor == 0)
 			c->keep_alive = 0;
-		c->content_offset = -1;
-		c->content_length_value_offset = -1;
+		HTTPHeader *connection = find_header(&req, S("Connection"));
+		if (connection && streq_case_insensitive((string) { connection->value, connection->value_len }, S("close")))
+			c->keep_alive = 0;
 
-		process_single_request(c, &req, fs);
-		write_end(c); // Make sure this is called
-		if (c->error)
-			return 1;
+		process_single_request(w, c, &req);
 
-		c->num_requests++;
-		if (c->keep_alive == 0)
-			c->close_when_flushed = 1;
+		if (c->upload.callback) {
 
-		if (c->close_when_flushed)
-			break;
+			// The body will go through the upload callback
+			consume_input(c, head_len);
+			c->upload_remaining = content_len;
+
+			// Clients that asked wait for this before sending large bodies
+			if (expect && req.minor == 1 && content_len > pending_input(c))
+				write_bytes(c, S("HTTP/1.1 100 Continue\r\n\r\n"));
+			continue;
+		}
+
+		// The rest of an unbuffered body wasn't read, so
+		// the connection can't be used for other requests.
+		if (!buffered)
+			c->keep_alive = 0;
+
+		consume_input(c, buffered ? head_len + content_len : head_len);
 
-		memcpy(c->input_buffer,
-			c->input_buffer + total_len,
-			c->input_count - total_len);
-		c->input_count -= total_len;
+		if (finish_response(c))
+			return 1;
 
+		if (c->close_when_flushed || c->stream.callback)
+			break;
 	}
 	return 0;
 }
 
-static int recv_from_conn(Connection *c)
+// Since sockets are registered as edge-triggered, both
+// recv_from_conn and send_to_conn must keep going until
+// the kernel returns EAGAIN or we won't be notified again.
+static int recv_from_conn(Worker *w, Connection *c)
 {
-	c->last_recv_time = current_time;
-	while (c->input_count < INPUT_BUFFER_LIMIT) {
+	c->last_recv_time = w->current_time;
+	while (pending_input(c) < w->config.input_buffer_limit) {
+
+		if (c->input_capacity - c->input_count < 1<<8 && c->input_head > 0) {
+			// Make room by dropping the consumed bytes
+			memmove(c->input_buffer, c->input_buffer + c->input_head, pending_input(c));
+			c->input_count -= c->input_head;
+			c->input_scan  -= c->input_head;
+			c->input_head   = 0;
+		}
 
-		if (c->input_capacity - c->input_count < 1<<8) {
+		// Once at the limit, whatever room is left is filled and
+		// requests that still don't fit are refused by the parser
+		if (c->input_capacity - c->input_count < 1<<8 && c->input_capacity < w->config.input_buffer_limit) {
+			int pooled;
 			int x;
 			x = MAX(1<<8, 2 * c->input_capacity);
-			x = MIN(x, INPUT_BUFFER_LIMIT);
-			void *p = malloc(x);
+			x = MIN(x, w->config.input_buffer_limit);
+			char *p = alloc_buffer(w, &x, &pooled);
 			if (p == NULL)
 				return 1;
-			if (c->output_capacity) {
-				memcpy(p, c->output_buffer, c->output_count);
-				free(c->output_buffer);
+			if (c->input_capacity) {
+				memcpy(p, c->input_buffer, c->input_count);
+				free_buffer(w, c->input_buffer, c->input_pooled);
 			}
-			c->output_buffer = p;
-			c->output_capacity = x;
+			c->input_buffer = p;
+			c->input_pooled = pooled;
+			c->input_capacity = x;
 		}
 
 		int num = recv(c->sock_fd,
 			c->input_buffer + c->input_count,
 			c->input_capacity - c->input_count, 0);
 
+		if (num == 0)
+			return 1; // Peer closed the connection
+
 		if (num < 0) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK)
 				break;
+			if (errno == EINTR)
+				continue;
 			return 1;
 		}
 
 		c->input_count += num;
+		c->input_total += num;
 	}
 	return 0;
 }
 
-static int send_to_conn(Connection *c)
+static int send_to_conn(Worker *w, Connection *c)
 {
-	c->last_send_time = current_time;
+	c->last_send_time = w->current_time;
 
 	int sent = 0;
-	for (;;) {
-		int num = send(c->sock_fd, c->output_buffer + sent, c->output_count - sent, 0);
+	while (c->seg_head < c->seg_count) {
+
+		// With MSG_ZEROCOPY the kernel reads the pages after sendmsg
+		// returns. Borrowed memory stays mapped, so completions aren't
+		// waited for, but the output buffer is compacted and reused
+		// right away and pinned spans are released once flushed. So
+		// buffered and borrowed bytes are sent by separate calls, and
+		// only the borrowed ones go without copying.
+		int zerocopy = w->config.zerocopy_send && c->num_pins == 0;
+
+		struct iovec iov[64];
+		int num_iov = 0;
+		int borrowed = 0;
+
+		int buffer_offset = sent;
+		for (int i = c->seg_head; i < c->seg_count && num_iov < COUNT(iov); i++) {
+			struct iovec seg = c->segs[i];
+			if (zerocopy && num_iov > 0 && (seg.iov_base == NULL) != (borrowed == 0))
+				break;
+			if (seg.iov_base == NULL) {
+				seg.iov_base = c->output_buffer + buffer_offset;
+				buffer_offset += seg.iov_len;
+			} else
+				borrowed += seg.iov_len;
+			iov[num_iov++] = seg;
+		}
+
+		// There's a fixed setup cost so it only pays off for large sends
+		int flags = MSG_NOSIGNAL;
+		if (zerocopy && borrowed >= 1<<14)
+			flags |= MSG_ZEROCOPY;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = num_iov;
+
+		ssize_t num = sendmsg(c->sock_fd, &msg, flags);
 		if (num < 0) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK)
 				break;
+			if (errno == EINTR)
+				continue;
 			return 1;
 		}
 
-		sent += num;
+		while (num > 0) {
+			struct iovec *seg = &c->segs[c->seg_head];
+			size_t n = MIN((size_t) num, seg->iov_len);
+			if (seg->iov_base == NULL)
+				sent += n;
+			else
+				seg->iov_base = (char*) seg->iov_base + n;
+			seg->iov_len -= n;
+			num -= n;
+			if (seg->iov_len == 0)
+				c->seg_head++;
+		}
 	}
 
-	memcpy(c->output_buffer, c->output_buffer + sent, c->output_count - sent);
+	memmove(c->output_buffer, c->output_buffer + sent, c->output_count - sent);
 	c->output_count -= sent;
 
-	if (c->output_count == 0 && c->close_when_flushed)
-		return 1;
+	memmove(c->segs, c->segs + c->seg_head, (c->seg_count - c->seg_head) * sizeof(struct iovec));
+	c->seg_count -= c->seg_head;
+	c->seg_head = 0;
+
+	if (c->seg_count == 0)
+		release_pins(c);
+
+	if (c->seg_count == 0 && c->stream.callback == NULL && c->close_when_flushed)
+		return 1;
+	return 0;
+}
+
+static void mark_ready(Worker *w, Connection *c)
+{
+	if (c->ready) return;
+	c->ready = 1;
+	c->ready_next = NULL;
+	c->ready_prev = w->ready_tail;
+	if (w->ready_tail)
+		w->ready_tail->ready_next = c;
+	else
+		w->ready_head = c;
+	w->ready_tail = c;
+}
+
+static void unmark_ready(Worker *w, Connection *c)
+{
+	if (!c->ready) return;
+	if (c->ready_prev)
+		c->ready_prev->ready_next = c->ready_next;
+	else
+		w->ready_head = c->ready_next;
+	if (c->ready_next)
+		c->ready_next->ready_prev = c->ready_prev;
+	else
+		w->ready_tail = c->ready_prev;
+	c->ready = 0;
+}
+
+// Runs the callbacks for the queued requests and the active stream
+static int do_work(Worker *w, Connection *c)
+{
+	if (process_queued_requests(w, c))
+		return 1;
+
+	if (c->stream.callback && !c->stream_waiting && pump_stream(w, c))
+		return 1;
+
+	return 0;
+}
+
+// Tells whether do_work would make progress, so that the pool
+// is only involved when there's something to run.
+static int has_work(Worker *w, Connection *c)
+{
+	if (c->close_when_flushed)
+		return 0;
+
+	if (c->stream_waiting)
+		return 0;
+
+	if (c->stream.callback)
+		return pending_output(c) < w->config.output_window;
+
+	if (c->upload.callback)
+		return pending_input(c) > 0;
+
+	return c->input_total != c->input_checked;
+}
+
+static void submit_job(Worker *w, Connection *c)
+{
+	Pool *pool = w->pool;
+	c->busy = 1;
+	c->job_next = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->tail)
+		pool->tail->job_next = c;
+	else
+		pool->head = c;
+	pool->tail = c;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void *pool_loop(void *arg)
+{
+	Pool *pool = arg;
+
+	for (;;) {
+
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->head == NULL && !pool->stop)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+		Connection *c = pool->head;
+		pool->head = c->job_next;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->mutex);
+
+		Worker *w = c->worker;
+		c->job_result = do_work(w, c);
+
+		pthread_mutex_lock(&w->done_mutex);
+		c->job_next = w->done_head;
+		w->done_head = c;
+		pthread_mutex_unlock(&w->done_mutex);
+
+		u64 one = 1;
+		write(w->event_fd, &one, sizeof(one));
+	}
+
+	return NULL;
+}
+
+static int pool_init(Pool *pool, int num_threads)
+{
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->stop = 0;
+	pool->num_threads = 0;
+	pool->threads = malloc(num_threads * sizeof(pthread_t));
+	if (pool->threads == NULL)
+		return -1;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	while (pool->num_threads < num_threads) {
+		if (pthread_create(&pool->threads[pool->num_threads], NULL, pool_loop, pool))
+			break;
+		pool->num_threads++;
+	}
+
+	if (pool->num_threads == 0) {
+		pthread_mutex_destroy(&pool->mutex);
+		pthread_cond_destroy(&pool->cond);
+		free(pool->threads);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void pool_free(Pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (int i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->threads);
+}
+
+// Gives the buffers of a connection with nothing in flight back to
+// the slab, so idle keep-alive connections don't hold any memory.
+static void release_idle_buffers(Worker *w, Connection *c)
+{
+	if (c->input_buffer && c->input_count == 0) {
+		free_buffer(w, c->input_buffer, c->input_pooled);
+		c->input_buffer = NULL;
+		c->input_capacity = 0;
+	}
+
+	if (c->output_buffer && c->output_count == 0 && c->seg_count == 0) {
+		free_buffer(w, c->output_buffer, c->output_pooled);
+		c->output_buffer = NULL;
+		c->output_capacity = 0;
+	}
+}
+
+static Connection **parked_list(Worker *w, HTTPChannel *channel)
+{
+	return &w->parked[((size_t) channel / sizeof(HTTPChannel)) % PARK_BUCKETS];
+}
+
+// Called once a waiting stream flushed its output. If a wake came
+// in since the stream was last called, it runs again right away.
+static void park_stream(Worker *w, Connection *c)
+{
+	if (c->parked) return;
+
+	if (__atomic_load_n(&wake_epoch, __ATOMIC_ACQUIRE) != c->park_epoch
+		|| (c->park_channel && __atomic_load_n(&c->park_channel->epoch, __ATOMIC_ACQUIRE) != c->park_channel_epoch)) {
+		c->stream_waiting = 0;
+		mark_ready(w, c);
+		return;
+	}
+
+	Connection **list = parked_list(w, c->park_channel);
+	c->parked = 1;
+	c->park_prev = NULL;
+	c->park_next = *list;
+	if (*list)
+		(*list)->park_prev = c;
+	*list = c; // The timer moves away when its slot comes up
+}
+
+static void unpark_stream(Worker *w, Connection *c)
+{
+	if (!c->parked) return;
+	if (c->park_prev)
+		c->park_prev->park_next = c->park_next;
+	else
+		*parked_list(w, c->park_channel) = c->park_next;
+	if (c->park_next)
+		c->park_next->park_prev = c->park_prev;
+	c->parked = 0;
+	c->stream_waiting = 0;
+}
+
+// Runs requests and flushes responses until the connection
+// needs to wait for the socket. Streams are pumped for a
+// limited number of rounds so a fast reader of a large file
+// can't starve the other connections of this worker.
+static int serve_conn(Worker *w, Connection *c)
+{
+	// Resumed by complete_jobs once the pool is done with it
+	if (c->busy)
+		return 0;
+
+	for (int rounds = 0;; rounds++) {
+
+		if (w->pool) {
+			if (has_work(w, c)) {
+				submit_job(w, c);
+				return 0;
+			}
+		} else if (do_work(w, c))
+			return 1;
+
+		if (send_to_conn(w, c))
+			return 1;
+
+		if (pending_output(c) > 0)
+			return 0; // Wait for the socket to drain
+
+		if (c->stream_waiting) {
+			park_stream(w, c);
+			return 0;
+		}
+
+		if (c->stream.callback == NULL && !c->stream_done) {
+			release_idle_buffers(w, c);
+			return 0; // Nothing left to do
+		}
+
+		// Edge-triggered sockets won't notify us again, so
+		// resume from the ready list
+		if (rounds == 16) {
+			mark_ready(w, c);
+			return 0;
+		}
+
+		c->stream_done = 0;
+	}
+}
+
+// With SO_ZEROCOPY the kernel reports send completions on the
+// error queue, which shows up as EPOLLERR. Drain it and only
+// treat the event as fatal if the socket has a real error.
+static int drain_error_queue(Connection *c)
+{
+	for (;;) {
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(c->sock_fd, &msg, MSG_ERRQUEUE) < 0)
+			break;
+	}
+
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (getsockopt(c->sock_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		return 1;
+	return 0;
+}
+
+static u64 timeout_of(Worker *w, Connection *c)
+{
+	// Parked streams are only dropped when the peer goes away.
+	// The timer is rechecked once per rotation of the wheel.
+	if (c->parked)
+		return (u64) -1 / 2;
+
+	// Streams may outlive the connection timeout, as long
+	// as the output keeps moving
+	if (c->stream.callback)
+		return c->last_send_time + (u64) w->config.send_timeout_sec * 1000;
+
+	u64 timeout_ms = c->accept_time + (u64) w->config.conn_timeout_sec * 1000;
+	timeout_ms = MIN(timeout_ms, c->last_recv_time + (u64) w->config.recv_timeout_sec * 1000);
+	timeout_ms = MIN(timeout_ms, c->last_send_time + (u64) w->config.send_timeout_sec * 1000);
+	return timeout_ms;
+}
+
+static void unschedule_timer(Worker *w, Connection *c)
+{
+	if (c->timer_slot == NULL) return;
+	if (c->timer_prev)
+		c->timer_prev->timer_next = c->timer_next;
+	else
+		*c->timer_slot = c->timer_next;
+	if (c->timer_next)
+		c->timer_next->timer_prev = c->timer_prev;
+	c->timer_slot = NULL;
+	w->num_timers--;
+}
+
+static void schedule_timer(Worker *w, Connection *c)
+{
+	unschedule_timer(w, c);
+
+	u64 tick = (timeout_of(w, c) + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	if (tick <= w->wheel_tick)
+		tick = w->wheel_tick + 1;
+
+	// Timers beyond the second level are parked in its last
+	// slot and rescheduled from there.
+	Connection **slot;
+	u64 delta = tick - w->wheel_tick;
+	if (delta < WHEEL_SLOTS)
+		slot = &w->wheel[0][tick & WHEEL_MASK];
+	else {
+		u64 rotation = tick >> WHEEL_BITS;
+		u64 last_rotation = (w->wheel_tick >> WHEEL_BITS) + WHEEL_SLOTS - 1;
+		slot = &w->wheel[1][MIN(rotation, last_rotation) & WHEEL_MASK];
+	}
+
+	c->timer_prev = NULL;
+	c->timer_next = *slot;
+	if (*slot)
+		(*slot)->timer_prev = c;
+	*slot = c;
+	c->timer_slot = slot;
+	w->num_timers++;
+}
+
+// Returns the tick of the first non-empty slot, or -1 if
+// there are no timers
+static u64 next_timer_tick(Worker *w)
+{
+	if (w->num_timers == 0)
+		return (u64) -1;
+
+	for (u64 tick = w->wheel_tick + 1; tick <= w->wheel_tick + WHEEL_SLOTS; tick++) {
+		if (w->wheel[0][tick & WHEEL_MASK])
+			return tick;
+		if ((tick & WHEEL_MASK) == 0)
+			return tick; // The second level cascades here
+	}
+	return (u64) -1; // Unreachable
+}
+
+static u64 get_current_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int listen_reuseport(const char *addr, int port)
+{
+	int accept_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (accept_fd < 0)
+		return -1;
+
+	int one = 1;
+	setsockopt(accept_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (setsockopt(accept_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		CLOSE_SOCKET(accept_fd);
+		return -1;
+	}
+
+	struct sockaddr_in bind_buf;
+	memset(&bind_buf, 0, sizeof(bind_buf));
+	bind_buf.sin_family = AF_INET;
+	bind_buf.sin_port = htons(port);
+	bind_buf.sin_addr.s_addr = inet_addr(addr);
+	if (bind(accept_fd, (struct sockaddr*) &bind_buf, sizeof(bind_buf)) < 0) {
+		CLOSE_SOCKET(accept_fd);
+		return -1;
+	}
+
+	if (listen(accept_fd, SOMAXCONN) < 0) {
+		CLOSE_SOCKET(accept_fd);
+		return -1;
+	}
+
+	return accept_fd;
+}
+
+static void close_conn(Worker *w, Connection *c)
+{
+	// The job is still using the buffers
+	if (c->busy) {
+		c->dropped = 1;
+		return;
+	}
+
+	// Closing the descriptor also removes it from the epoll set
+	CLOSE_SOCKET(c->sock_fd);
+	end_stream(c);
+	end_upload(c);
+	unmark_ready(w, c);
+	unpark_stream(w, c);
+	unschedule_timer(w, c);
+	if (c->input_buffer)
+		free_buffer(w, c->input_buffer, c->input_pooled);
+	if (c->output_buffer)
+		free_buffer(w, c->output_buffer, c->output_pooled);
+	free(c->segs);
+	release_pins(c);
+	free(c->pins);
+	c->sock_fd = -1;
+
+	w->free_list[w->max_conns - w->num_conns] = c - w->conns;
+	w->num_conns--;
+}
+
+// Moves the wheel forward to the current time, closing the
+// connections that timed out. Each tick only touches the timers
+// in its slot, so idle connections cost nothing until they expire.
+static void expire_timers(Worker *w)
+{
+	u64 now_tick = w->current_time / TIMER_TICK_MS;
+	while (w->wheel_tick < now_tick && w->num_timers > 0) {
+
+		w->wheel_tick++;
+
+		if ((w->wheel_tick & WHEEL_MASK) == 0) {
+			// Spread the next rotation's timers over the first level
+			Connection **slot = &w->wheel[1][(w->wheel_tick >> WHEEL_BITS) & WHEEL_MASK];
+			while (*slot)
+				schedule_timer(w, *slot);
+		}
+
+		Connection **slot = &w->wheel[0][w->wheel_tick & WHEEL_MASK];
+		while (*slot) {
+			Connection *c = *slot;
+			if (!c->busy && w->current_time > timeout_of(w, c))
+				close_conn(w, c);
+			else
+				schedule_timer(w, c);
+		}
+	}
+	w->wheel_tick = MAX(w->wheel_tick, now_tick);
+}
+
+// Hands the connections back to the reactor once the pool ran their
+// jobs. Socket events that came in meanwhile were ignored, and since
+// sockets are edge-triggered, they must be polled again.
+static void complete_jobs(Worker *w)
+{
+	u64 count;
+	read(w->event_fd, &count, sizeof(count));
+
+	pthread_mutex_lock(&w->done_mutex);
+	Connection *done = w->done_head;
+	w->done_head = NULL;
+	pthread_mutex_unlock(&w->done_mutex);
+
+	while (done) {
+		Connection *c = done;
+		done = c->job_next;
+		c->busy = 0;
+
+		int remove = c->dropped || c->job_result;
+		if (!remove)
+			remove = recv_from_conn(w, c);
+		if (!remove)
+			remove = serve_conn(w, c);
+		if (remove)
+			close_conn(w, c);
+	}
+}
+
+static void resume_stream(Worker *w, Connection *c)
+{
+	unpark_stream(w, c);
+	c->last_send_time = w->current_time;
+	schedule_timer(w, c);
+	mark_ready(w, c);
+}
+
+// Moves parked streams to the ready list after http_wake_streams,
+// or only those of the woken channels after http_wake_channel
+static void wake_streams(Worker *w)
+{
+	u64 epoch = __atomic_load_n(&wake_epoch, __ATOMIC_ACQUIRE);
+	int all = (epoch != w->wake_epoch);
+	w->wake_epoch = epoch;
+
+	HTTPChannel *woken[WOKEN_MAX];
+	pthread_mutex_lock(&w->woken_mutex);
+	int num_woken = w->num_woken;
+	memcpy(woken, w->woken, num_woken * sizeof(woken[0]));
+	if (w->woken_overflow)
+		all = 1;
+	w->num_woken = 0;
+	w->woken_overflow = 0;
+	pthread_mutex_unlock(&w->woken_mutex);
+
+	if (all) {
+		for (int i = 0; i < PARK_BUCKETS; i++)
+			while (w->parked[i])
+				resume_stream(w, w->parked[i]);
+		return;
+	}
+
+	// Channels are only compared, since they may have been
+	// freed along with their last stream by now
+	for (int i = 0; i < num_woken; i++) {
+		Connection *c = *parked_list(w, woken[i]);
+		while (c) {
+			Connection *next = c->park_next;
+			if (c->park_channel == woken[i])
+				resume_stream(w, c);
+			c = next;
+		}
+	}
+}
+
+static void accept_conns(Worker *w)
+{
+	w->accept_pending = 0;
+	for (;;) {
+
+		if (w->num_conns == w->max_conns) {
+			// Leave the rest in the backlog until a slot frees up
+			w->accept_pending = 1;
+			break;
+		}
+
+		int client_fd = accept4(w->accept_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		w->num_conns++;
+		__atomic_store_n(&w->num_accepted, w->num_accepted + 1, __ATOMIC_RELAXED);
+		Connection *c = &w->conns[w->free_list[w->max_conns - w->num_conns]];
+		c->sock_fd = client_fd;
+		c->input_buffer = NULL;
+		c->input_head = 0;
+		c->input_scan = 0;
+		c->input_count = 0;
+		c->input_capacity = 0;
+		c->output_buffer = NULL;
+		c->output_count = 0;
+		c->output_capacity = 0;
+		c->segs = NULL;
+		c->seg_head = 0;
+		c->seg_count = 0;
+		c->seg_capacity = 0;
+		c->span_bytes = 0;
+		c->pins = NULL;
+		c->num_pins = 0;
+		c->pin_capacity = 0;
+		c->stream = (HTTPStream) {0};
+		c->stream_done = 0;
+		c->upload = (HTTPUpload) {0};
+		c->upload_remaining = 0;
+		c->body_mode = BODY_BUFFERED;
+		c->minor = 1; // Until a request says otherwise, for early errors
+		c->ready = 0;
+		c->parked = 0;
+		c->stream_waiting = 0;
+		c->park_channel = NULL;
+		c->num_requests = 0;
+		c->state = 0;
+		c->error = 0;
+		c->close_when_flushed = 0;
+		c->accept_time = w->current_time;
+		c->last_recv_time = w->current_time;
+		c->last_send_time = w->current_time;
+		c->timer_slot = NULL;
+		schedule_timer(w, c);
+		c->worker = w;
+		c->busy = 0;
+		c->dropped = 0;
+		c->input_total = 0;
+		c->input_checked = 0;
+
+		if (w->config.zerocopy_send) {
+			int one = 1;
+			setsockopt(client_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+			close_conn(w, c);
+	}
+}
+
+static int worker_init(Worker *w, HTTPServerConfig config, HTTPCallback callback, void *userptr, Pool *pool)
+{
+	w->config    = config;
+	w->callback  = callback;
+	w->userptr   = userptr;
+	w->pool      = pool;
+	w->done_head = NULL;
+	w->num_conns = 0;
+	w->max_conns = config.max_conns_per_worker;
+	w->num_accepted = 0;
+	w->num_requests = 0;
+	w->accept_pending = 0;
+	w->current_time = get_current_time();
+	w->wheel_tick = w->current_time / TIMER_TICK_MS;
+	w->num_timers = 0;
+	memset(w->wheel, 0, sizeof(w->wheel));
+	w->ready_head = NULL;
+	w->ready_tail = NULL;
+	memset(w->parked, 0, sizeof(w->parked));
+	w->wake_epoch = __atomic_load_n(&wake_epoch, __ATOMIC_ACQUIRE);
+	w->num_woken = 0;
+	w->woken_overflow = 0;
+
+	w->conns     = malloc(w->max_conns * sizeof(Connection));
+	w->free_list = malloc(w->max_conns * sizeof(int));
+	if (w->conns == NULL || w->free_list == NULL) {
+		free(w->conns);
+		free(w->free_list);
+		return -1;
+	}
+
+	// The free list is a stack of the (max_conns - num_conns)
+	// unused slots. It's filled so that low indices pop first.
+	for (int i = 0; i < w->max_conns; i++) {
+		w->conns[i].sock_fd = -1;
+		w->free_list[i] = w->max_conns - i - 1;
+	}
+
+	w->accept_fd = listen_reuseport(config.addr, config.port);
+	if (w->accept_fd < 0) {
+		free(w->conns);
+		free(w->free_list);
+		return -1;
+	}
+
+	w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epoll_fd < 0) {
+		CLOSE_SOCKET(w->accept_fd);
+		free(w->conns);
+		free(w->free_list);
+		return -1;
+	}
+
+	w->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w->event_fd < 0) {
+		close(w->epoll_fd);
+		CLOSE_SOCKET(w->accept_fd);
+		free(w->conns);
+		free(w->free_list);
+		return -1;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL; // NULL marks the listening socket
+	int ok = epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->accept_fd, &ev) == 0;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = w; // The worker itself marks job completions
+	if (ok)
+		ok = epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev) == 0;
+
+	if (!ok) {
+		close(w->event_fd);
+		close(w->epoll_fd);
+		CLOSE_SOCKET(w->accept_fd);
+		free(w->conns);
+		free(w->free_list);
+		return -1;
+	}
+
+	pthread_mutex_init(&w->done_mutex, NULL);
+	pthread_mutex_init(&w->woken_mutex, NULL);
+	slab_init(&w->slab);
+	return 0;
+}
+
+// The pool must be stopped first
+static void worker_free(Worker *w)
+{
+	for (int i = 0; i < w->max_conns; i++)
+		if (w->conns[i].sock_fd != -1) {
+			w->conns[i].busy = 0;
+			close_conn(w, &w->conns[i]);
+		}
+	pthread_mutex_destroy(&w->done_mutex);
+	pthread_mutex_destroy(&w->woken_mutex);
+	close(w->event_fd);
+	close(w->epoll_fd);
+	CLOSE_SOCKET(w->accept_fd);
+	free(w->conns);
+	free(w->free_list);
+	slab_free(&w->slab);
+}
+
+static void *worker_loop(void *arg)
+{
+	Worker *w = arg;
+
+	for (;;) {
+
+		u64 next_tick = next_timer_tick(w);
+
+		int timeout_ms = -1;
+		if (w->ready_head)
+			timeout_ms = 0;
+		else if (next_tick != (u64) -1) {
+			u64 next_timeout = next_tick * TIMER_TICK_MS;
+			if (next_timeout <= w->current_time)
+				timeout_ms = 0;
+			else
+				timeout_ms = MIN(next_timeout - w->current_time, INT_MAX);
+		}
+
+		struct epoll_event events[256];
+		int num = epoll_wait(w->epoll_fd, events, COUNT(events), timeout_ms);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		w->current_time = get_current_time();
+
+		for (int i = 0; i < num; i++) {
+
+			if (events[i].data.ptr == NULL) {
+				accept_conns(w);
+				continue;
+			}
+
+			if (events[i].data.ptr == w) {
+				complete_jobs(w);
+				wake_streams(w);
+				continue;
+			}
+
+			Connection *c = events[i].data.ptr;
+			int remove = 0;
+
+			if (events[i].events & EPOLLHUP)
+				remove = 1;
+
+			if (!remove && (events[i].events & EPOLLERR))
+				remove = w->config.zerocopy_send ? drain_error_queue(c) : 1;
+
+			if (!remove && !c->busy && (events[i].events & (EPOLLIN | EPOLLRDHUP)))
+				remove = recv_from_conn(w, c);
+
+			// Also flush when no EPOLLOUT was reported: the responses
+			// we just produced won't generate a new writable edge.
+			if (!remove)
+				remove = serve_conn(w, c);
+
+			if (remove)
+				close_conn(w, c);
+		}
+
+		// Connections that yielded go back in the ready list
+		// as they run, so detach the current list first.
+		Connection *ready = w->ready_head;
+		w->ready_head = NULL;
+		w->ready_tail = NULL;
+		while (ready) {
+			Connection *c = ready;
+			ready = c->ready_next;
+			c->ready = 0;
+			if (serve_conn(w, c))
+				close_conn(w, c);
+		}
+
+		expire_timers(w);
+
+		if (w->accept_pending && w->num_conns < w->max_conns)
+			accept_conns(w);
+	}
+
+	return NULL;
+}
+
+static int serve(HTTPServerConfig config, HTTPCallback callback, void *userptr)
+{
+	if (config.port < 0 || config.port >= 1<<16)
+		return -1;
+
+	int num_workers = config.num_workers;
+	if (num_workers <= 0)
+		num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_workers <= 0)
+		num_workers = 1;
+
+	Pool pool;
+	Pool *pool_ptr = NULL;
+	if (config.num_pool_threads > 0) {
+		if (pool_init(&pool, config.num_pool_threads) < 0)
+			return -1;
+		pool_ptr = &pool;
+	}
+
+	Worker *workers = malloc(num_workers * sizeof(Worker));
+	if (workers == NULL) {
+		if (pool_ptr) pool_free(pool_ptr);
+		return -1;
+	}
+
+	for (int i = 0; i < num_workers; i++) {
+		if (worker_init(&workers[i], config, callback, userptr, pool_ptr) < 0) {
+			if (pool_ptr) pool_free(pool_ptr);
+			for (int j = 0; j < i; j++)
+				worker_free(&workers[j]);
+			free(workers);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&registry_mutex);
+	for (int i = 0; i < num_workers; i++) {
+		workers[i].registry_next = registry;
+		registry = &workers[i];
+	}
+	pthread_mutex_unlock(&registry_mutex);
+
+	// Worker 0 runs on the calling thread
+	int num_threads = 1;
+	while (num_threads < num_workers) {
+		Worker *w = &workers[num_threads];
+		if (pthread_create(&w->thread, NULL, worker_loop, w))
+			break;
+		num_threads++;
+	}
+	worker_loop(&workers[0]);
+
+	for (int i = 1; i < num_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	pthread_mutex_lock(&registry_mutex);
+	Worker **prev = &registry;
+	while (*prev) {
+		if (*prev >= workers && *prev < workers + num_workers)
+			*prev = (*prev)->registry_next;
+		else
+			prev = &(*prev)->registry_next;
+	}
+	pthread_mutex_unlock(&registry_mutex);
+
+	if (pool_ptr) pool_free(pool_ptr);
+
+	for (int i = 0; i < num_workers; i++)
+		worker_free(&workers[i]);
+	free(workers);
+	return -1;
+}
+
+//////////////////////////////////////////////////////////////////
+
+int http_serve(HTTPServerConfig config, HTTPCallback callback, void *userptr)
+{
+	return serve(config, callback, userptr);
+}
+
+void http_write_head(HTTPResponse *res, int status)
+{
+	write_head((Connection*) res, status);
+}
+
+void http_write_header(HTTPResponse *res, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	write_header((Connection*) res, fmt, args);
+	va_end(args);
+}
+
+void http_write_body(HTTPResponse *res, const char *str, int len)
+{
+	write_body((Connection*) res, (string) {(char*) str, len});
+}
+
+void *http_write_body_ptr(HTTPResponse *res, int mincap, int *cap)
+{
+	return write_body_ptr((Connection*) res, mincap, cap);
+}
+
+void http_write_body_ack(HTTPResponse *res, int num)
+{
+	write_body_ack((Connection*) res, num);
+}
+
+void http_write_body_span(HTTPResponse *res, const void *ptr, int len)
+{
+	write_body_span((Connection*) res, ptr, len);
+}
+
+void http_write_body_span_release(HTTPResponse *res, const void *ptr, int len, void (*release)(void*), void *data)
+{
+	write_body_span_release((Connection*) res, ptr, len, release, data);
+}
+
+void http_write_body_stream(HTTPResponse *res, long long length, HTTPStream stream)
+{
+	write_body_stream((Connection*) res, length, stream);
+}
+
+void http_read_body_stream(HTTPResponse *res, HTTPUpload upload)
+{
+	read_body_stream((Connection*) res, upload);
+}
+
+void http_restart_response(HTTPResponse *res)
+{
+	restart_response((Connection*) res);
+}
+
+void http_wake_streams(void)
+{
+	__atomic_add_fetch(&wake_epoch, 1, __ATOMIC_ACQ_REL);
+
+	pthread_mutex_lock(&registry_mutex);
+	for (Worker *w = registry; w; w = w->registry_next) {
+		u64 one = 1;
+		write(w->event_fd, &one, sizeof(one));
+	}
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+void http_wake_channel(HTTPChannel *channel)
+{
+	__atomic_add_fetch(&channel->epoch, 1, __ATOMIC_ACQ_REL);
+
+	pthread_mutex_lock(&registry_mutex);
+	for (Worker *w = registry; w; w = w->registry_next) {
+
+		pthread_mutex_lock(&w->woken_mutex);
+		int queued = 0;
+		for (int i = 0; i < w->num_woken && !queued; i++)
+			queued = (w->woken[i] == channel);
+		if (!queued) {
+			if (w->num_woken < WOKEN_MAX)
+				w->woken[w->num_woken++] = channel;
+			else
+				w->woken_overflow = 1;
+		}
+		pthread_mutex_unlock(&w->woken_mutex);
+
+		u64 one = 1;
+		write(w->event_fd, &one, sizeof(one));
+	}
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+void http_server_stats(HTTPServerStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&registry_mutex);
+	for (Worker *w = registry; w; w = w->registry_next) {
+		stats->num_workers++;
+		stats->open_conns += __atomic_load_n(&w->num_conns, __ATOMIC_RELAXED);
+		stats->accepted   += __atomic_load_n(&w->num_accepted, __ATOMIC_RELAXED);
+		stats->requests   += __atomic_load_n(&w->num_requests, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+//////////////////////////////////////////////////////////////////
+
+#define MAX_RANGES 16
+#define BOUNDARY "cozyfs-byteranges-boundary"
+
+typedef struct {
+	long long first;
+	long long last; // Inclusive
+} ByteRange;
+
+// Serves a list of ranges of a file, using multipart/byteranges
+// framing when there is more than one.
+//
+// The body is sent straight from the file's pages. Those are only
+// freed once the file is unlinked and closed, and appends never touch
+// the bytes before the end, so the ones the head describes stay put
+// for as long as the engine handle is open. Each batch of spans holds
+// a reference that keeps it open until the connection is done with it.
+typedef struct {
+	CozyFS   *fs; // Shared, see thread_fs
+	int       fd;
+	int       refs; // The stream and the batches not sent yet
+	long long size;
+	int       multipart;
+	int       num_ranges;
+	int       cur_range;
+	long long range_remaining;
+	ByteRange ranges[MAX_RANGES];
+} FileStream;
+
+static int parse_number(const char *src, int len, int *i, long long *out)
+{
+	if (*i == len || !is_digit(src[*i]))
+		return -1;
+	long long result = 0;
+	do {
+		int d = src[(*i)++] - '0';
+		if (result > (LLONG_MAX - d) / 10)
+			return -1;
+		result = result * 10 + d;
+	} while (*i < len && is_digit(src[*i]));
+	*out = result;
+	return 0;
+}
+
+// Parses the value of a Range header against a file of "size" bytes.
+// Returns the number of satisfiable ranges, which is zero if none are,
+// or -1 if the header should be ignored.
+static int parse_ranges(const char *src, int len, long long size, ByteRange *ranges, int max)
+{
+	int i = 0;
+	while (i < len && src[i] == ' ')
+		i++;
+
+	string unit = S("bytes=");
+	if (len - i < unit.len || !streq_case_insensitive((string) { (char*) src + i, unit.len }, unit))
+		return -1;
+	i += unit.len;
+
+	int num = 0;
+	for (;;) {
+
+		while (i < len && src[i] == ' ')
+			i++;
+
+		long long first;
+		long long last;
+		if (i < len && src[i] == '-') {
+			// Suffix range
+			i++;
+			long long suffix;
+			if (parse_number(src, len, &i, &suffix))
+				return -1;
+			first = MAX(size - suffix, 0);
+			last  = suffix > 0 ? size-1 : -1;
+		} else {
+			if (parse_number(src, len, &i, &first))
+				return -1;
+			if (i == len || src[i] != '-')
+				return -1;
+			i++;
+			if (i < len && is_digit(src[i])) {
+				if (parse_number(src, len, &i, &last))
+					return -1;
+				if (last < first)
+					return -1;
+				last = MIN(last, size-1);
+			} else
+				last = size-1;
+		}
+
+		// Unsatisfiable ranges are dropped
+		if (first < size && first <= last) {
+			if (num == max)
+				return -1;
+			ranges[num++] = (ByteRange) { first, last };
+		}
+
+		while (i < len && src[i] == ' ')
+			i++;
+
+		if (i == len)
+			break;
+
+		if (src[i] != ',')
+			return -1;
+		i++;
+	}
+
+	return num;
+}
+
+// Strong validator for the current contents of an entity. The
+// engine never reuses generations so the pair is never repeated.
+static void format_etag(char *dst, int cap, CozyFSStat stat)
+{
+	snprintf(dst, cap, "\"%x-%x\"", stat.id, stat.gen);
+}
+
+static void format_http_date(char *dst, int cap, time_t t)
+{
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(dst, cap, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// Only the IMF-fixdate format is accepted
+static int parse_http_date(const char *src, int len, time_t *out)
+{
+	char buf[64];
+	if (len >= (int) sizeof(buf))
+		return -1;
+	memcpy(buf, src, len);
+	buf[len] = '\0';
+
+	struct tm tm = {0};
+	char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (end == NULL || *end != '\0')
+		return -1;
+	*out = timegm(&tm);
+	return 0;
+}
+
+// Checks an If-None-Match list against "etag". The comparison
+// is weak, so tags with the W/ prefix match too.
+static int etag_list_matches(const char *src, int len, const char *etag)
+{
+	int etag_len = strlen(etag);
+	int i = 0;
+	for (;;) {
+
+		while (i < len && (src[i] == ' ' || src[i] == ','))
+			i++;
+		if (i == len)
+			return 0;
+
+		int start = i;
+		while (i < len && src[i] != ',' && src[i] != ' ')
+			i++;
+		string tag = { (char*) src + start, i - start };
+
+		if (tag.len == 1 && tag.ptr[0] == '*')
+			return 1;
+
+		if (tag.len > 2 && tag.ptr[0] == 'W' && tag.ptr[1] == '/') {
+			tag.ptr += 2;
+			tag.len -= 2;
+		}
+
+		if (tag.len == etag_len && !memcmp(tag.ptr, etag, etag_len))
+			return 1;
+	}
+}
+
+static int not_modified(HTTPRequest *req, const char *etag, time_t mtime)
+{
+	// If-Modified-Since is ignored when If-None-Match is present
+	HTTPHeader *header = find_header(req, S("If-None-Match"));
+	if (header)
+		return etag_list_matches(header->value, header->value_len, etag);
+
+	header = find_header(req, S("If-Modified-Since"));
+	if (header) {
+		time_t since;
+		if (parse_http_date(header->value, header->value_len, &since) == 0)
+			return mtime <= since;
+	}
+
 	return 0;
 }
 
-static int timeout_of(Connection *c)
+// A Range is only honored if the If-Range validator, when
+// present, still matches. Tags are compared strongly.
+static int if_range_matches(HTTPRequest *req, const char *etag, time_t mtime)
+{
+	HTTPHeader *header = find_header(req, S("If-Range"));
+	if (header == NULL)
+		return 1;
+
+	if (header->value_len > 0 && header->value[0] == '"') {
+		int etag_len = strlen(etag);
+		return header->value_len == etag_len && !memcmp(header->value, etag, etag_len);
+	}
+
+	time_t date;
+	if (parse_http_date(header->value, header->value_len, &date))
+		return 0;
+	return date == mtime;
+}
+
+static int write_part_header(HTTPResponse *res, FileStream *stream, ByteRange range)
+{
+	char buf[256];
+	int len = snprintf(buf, sizeof(buf),
+		"\r\n--" BOUNDARY "\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Content-Range: bytes %lld-%lld/%lld\r\n"
+		"\r\n", range.first, range.last, stream->size);
+	if (res) http_write_body(res, buf, len);
+	return len;
+}
+
+static int write_closing_boundary(HTTPResponse *res)
+{
+	string s = S("\r\n--" BOUNDARY "--\r\n");
+	if (res) http_write_body(res, s.ptr, s.len);
+	return s.len;
+}
+
+// Drops a reference. Batches are released by the worker, which may
+// run at the same time as a pool thread ending the stream.
+static void file_stream_free(void *data)
+{
+	FileStream *stream = data;
+	if (__atomic_sub_fetch(&stream->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	cozyfs_close(thread_fs(stream->fs), stream->fd);
+	free(stream);
+}
+
+static int file_stream_callback(HTTPResponse *res, int max, void *data)
+{
+	FileStream *stream = data;
+
+	for (;;) {
+
+		if (stream->range_remaining == 0) {
+
+			if (stream->cur_range+1 == stream->num_ranges) {
+				if (stream->multipart)
+					write_closing_boundary(res);
+				return HTTP_STREAM_DONE;
+			}
+
+			if (max <= 0)
+				break;
+
+			ByteRange range = stream->ranges[++stream->cur_range];
+			if (stream->multipart)
+				max -= write_part_header(res, stream, range);
+
+			if (cozyfs_seek(thread_fs(stream->fs), stream->fd, range.first) < 0)
+				return HTTP_STREAM_ERROR;
+			stream->range_remaining = range.last - range.first + 1;
+			continue;
+		}
+
+		if (max <= 0)
+			break;
+
+		CozyFSSpan spans[64];
+		int num = cozyfs_read_spans(thread_fs(stream->fs), stream->fd, spans, MIN(COUNT(spans), max / 4096 + 1));
+		if (num <= 0)
+			return HTTP_STREAM_ERROR; // The file is shorter than advertised
+
+		// The cursor may move past the end of the range,
+		// but the next one starts with a seek anyway.
+		for (int i = 0; i < num && stream->range_remaining > 0; i++) {
+			int len = MIN(spans[i].len, stream->range_remaining);
+			if (i == 0) {
+				__atomic_add_fetch(&stream->refs, 1, __ATOMIC_RELAXED);
+				http_write_body_span_release(res, spans[i].ptr, len, file_stream_free, stream);
+			} else
+				http_write_body_span(res, spans[i].ptr, len);
+			stream->range_remaining -= len;
+			max -= len;
+		}
+	}
+
+	return HTTP_STREAM_MORE;
+}
+
+// Returns the number of body bytes the stream will produce
+static long long file_stream_length(FileStream *stream)
+{
+	long long total = 0;
+	for (int i = 0; i < stream->num_ranges; i++) {
+		ByteRange range = stream->ranges[i];
+		if (stream->multipart)
+			total += write_part_header(NULL, stream, range);
+		total += range.last - range.first + 1;
+	}
+	if (stream->multipart)
+		total += write_closing_boundary(NULL);
+	return total;
+}
+
+// Uploads are staged here, named after the process receiving them.
+// The directory is left out of listings of the root.
+#define UPLOAD_DIR "/.uploads"
+
+// Lists a directory as a JSON object. Entries are fetched in small
+// batches so the file system lock is never held for long.
+typedef struct {
+	CozyFS      *fs; // Shared, see thread_fs
+	unsigned int cursor;
+	long long    remaining; // Entries left before the limit
+	int          count;     // Entries written so far
+	int          started;
+	char         path[1<<10];
+} DirStream;
+
+// Looks for "name=<digits>" in a query string
+static int query_number(string query, string name, long long *out)
+{
+	int i = 0;
+	while (i < query.len) {
+
+		int start = i;
+		while (i < query.len && query.ptr[i] != '&')
+			i++;
+		string param = { query.ptr + start, i - start };
+		if (i < query.len)
+			i++;
+
+		if (param.len <= name.len || param.ptr[name.len] != '=' || memcmp(param.ptr, name.ptr, name.len))
+			continue;
+
+		int j = name.len + 1;
+		long long value;
+		if (parse_number(param.ptr, param.len, &j, &value) || j != param.len)
+			return -1;
+		*out = value;
+		return 0;
+	}
+	return -1;
+}
+
+static void write_json_string(HTTPResponse *res, const char *src)
+{
+	int len = strlen(src);
+	int cap;
+	char *dst = http_write_body_ptr(res, 6 * len + 2, &cap);
+	if (dst == NULL) return;
+
+	int num = 0;
+	dst[num++] = '"';
+	for (int i = 0; i < len; i++) {
+		unsigned char c = src[i];
+		if (c == '"' || c == '\\') {
+			dst[num++] = '\\';
+			dst[num++] = c;
+		} else if (c < 0x20)
+			num += snprintf(dst + num, cap - num, "\\u%04x", c);
+		else
+			dst[num++] = c;
+	}
+	dst[num++] = '"';
+	http_write_body_ack(res, num);
+}
+
+static int dir_stream_callback(HTTPResponse *res, int max, void *data)
+{
+	DirStream *stream = data;
+	CozyFS *fs = thread_fs(stream->fs);
+
+	if (!stream->started) {
+		http_write_body(res, "{\"entries\":[", 12);
+		stream->started = 1;
+	}
+
+	while (max > 0 && stream->remaining > 0) {
+
+		CozyFSDirEntry entries[32];
+		int num = cozyfs_readdir(fs, stream->path, &stream->cursor, entries, MIN(COUNT(entries), stream->remaining));
+		if (num < 0)
+			return HTTP_STREAM_ERROR;
+
+		if (num == 0) {
+			http_write_body(res, "],\"next\":null}\n", 16);
+			return HTTP_STREAM_DONE;
+		}
+
+		for (int i = 0; i < num; i++) {
+			CozyFSStat stat = entries[i].stat;
+			char buf[256];
+			int len;
+
+			if (!strcmp(stream->path, "/") && !strcmp(entries[i].name, UPLOAD_DIR + 1))
+				continue;
+
+			if (stream->count++ > 0)
+				http_write_body(res, ",", 1);
+			http_write_body(res, "{\"name\":", 8);
+			write_json_string(res, entries[i].name);
+			len = snprintf(buf, sizeof(buf), ",\"type\":\"%s\",\"id\":%u,\"size\":%u,\"gen\":%u,\"mtime\":%u}",
+				stat.is_dir ? "dir" : "file", stat.id, stat.size, stat.gen, stat.mtime);
+			http_write_body(res, buf, len);
+
+			max -= len + strlen(entries[i].name) + 16;
+		}
+		stream->remaining -= num;
+	}
+
+	if (stream->remaining == 0) {
+		char buf[64];
+		int len = snprintf(buf, sizeof(buf), "],\"next\":%u}\n", stream->cursor);
+		http_write_body(res, buf, len);
+		return HTTP_STREAM_DONE;
+	}
+
+	return HTTP_STREAM_MORE;
+}
+
+// Answers GET on a directory. The "offset" and "limit" query
+// parameters select a page of the listing, and the response
+// tells where the next one starts.
+static void list_directory(HTTPResponse *res, CozyFS *shared, const char *path, string query)
+{
+	long long offset = 0;
+	long long limit  = 1000;
+	query_number(query, S("offset"), &offset);
+	query_number(query, S("limit"),  &limit);
+	if (offset > UINT_MAX || limit <= 0) {
+		http_write_head(res, 400);
+		return;
+	}
+
+	DirStream *stream = malloc(sizeof(DirStream));
+	if (stream == NULL) {
+		http_write_head(res, 500);
+		return;
+	}
+	stream->fs = shared;
+	stream->cursor = offset;
+	stream->remaining = limit;
+	stream->count = 0;
+	stream->started = 0;
+	strcpy(stream->path, path);
+
+	// Report missing directories before committing to a 200
+	CozyFSDirEntry entry;
+	unsigned int cursor = 0;
+	int code = cozyfs_readdir(thread_fs(shared), path, &cursor, &entry, 0);
+	if (code < 0) {
+		free(stream);
+		http_write_head(res, code == -COZYFS_ENOENT ? 404 : 500);
+		return;
+	}
+
+	http_write_head(res, 200);
+	http_write_header(res, "Content-Type: application/json");
+	http_write_body_stream(res, -1, (HTTPStream) { dir_stream_callback, free, stream, NULL });
+}
+
+// Watches are Server-Sent Events streams that park between changes.
+// The streams of a path share an entry of the table below. A single
+// thread blocks on the engine's change counter, stats each watched
+// path once per change and only wakes the streams of the paths that
+// changed. Those report the state found by the thread, so they don't
+// take the lock themselves.
+
+#define WATCH_HEARTBEAT_SEC 15
+#define WATCH_BUCKETS       1024
+
+typedef struct WatchedPath WatchedPath;
+struct WatchedPath {
+	CozyFS      *fs;   // Shared, see thread_fs
+	int          refs; // One per stream, plus one while being checked
+	int          exists;
+	CozyFSStat   stat;
+	HTTPChannel  channel;
+	WatchedPath *hash_next;
+	char         path[];
+};
+
+// The mutex protects the buckets and the state of the entries
+static struct {
+	pthread_mutex_t mutex;
+	WatchedPath *buckets[WATCH_BUCKETS];
+} watched = { .mutex=PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int hash_path(const char *path)
+{
+	unsigned int hash = 2166136261u; // FNV-1a
+	for (int i = 0; path[i]; i++)
+		hash = (hash ^ (unsigned char) path[i]) * 16777619u;
+	return hash;
+}
+
+// Returns the entry of "path" with a new reference. New entries
+// are stated under the mutex, so a check of the table can't run
+// between the stat and the entry becoming visible.
+static WatchedPath *watched_acquire(CozyFS *shared, const char *path)
+{
+	pthread_mutex_lock(&watched.mutex);
+
+	WatchedPath **bucket = &watched.buckets[hash_path(path) % WATCH_BUCKETS];
+	WatchedPath *entry = *bucket;
+	while (entry && (entry->fs != shared || strcmp(entry->path, path)))
+		entry = entry->hash_next;
+
+	if (entry == NULL) {
+		int len = strlen(path);
+		entry = malloc(sizeof(WatchedPath) + len + 1);
+		if (entry) {
+			int code = cozyfs_stat(thread_fs(shared), path, &entry->stat);
+			if (code < 0 && code != -COZYFS_ENOENT) {
+				free(entry);
+				entry = NULL;
+			} else {
+				entry->fs = shared;
+				entry->refs = 0;
+				entry->exists = (code == 0);
+				entry->channel = (HTTPChannel) {0};
+				memcpy(entry->path, path, len+1);
+				entry->hash_next = *bucket;
+				*bucket = entry;
+			}
+		}
+	}
+	if (entry)
+		entry->refs++;
+
+	pthread_mutex_unlock(&watched.mutex);
+	return entry;
+}
+
+static void watched_release(WatchedPath *entry)
+{
+	pthread_mutex_lock(&watched.mutex);
+	if (--entry->refs == 0) {
+		WatchedPath **prev = &watched.buckets[hash_path(entry->path) % WATCH_BUCKETS];
+		while (*prev != entry)
+			prev = &(*prev)->hash_next;
+		*prev = entry->hash_next;
+		free(entry);
+	}
+	pthread_mutex_unlock(&watched.mutex);
+}
+
+// Stats every path watched on "shared" and wakes the streams of
+// those whose entity, contents or existence changed. The entries
+// are collected first so the table isn't locked during the stats.
+static void check_watched(CozyFS *shared)
+{
+	CozyFS *fs = thread_fs(shared);
+
+	pthread_mutex_lock(&watched.mutex);
+	int num = 0;
+	for (int i = 0; i < WATCH_BUCKETS; i++)
+		for (WatchedPath *entry = watched.buckets[i]; entry; entry = entry->hash_next)
+			if (entry->fs == shared)
+				num++;
+	WatchedPath **list = NULL;
+	if (num > 0)
+		list = malloc(num * sizeof(WatchedPath*));
+	if (list) {
+		num = 0;
+		for (int i = 0; i < WATCH_BUCKETS; i++)
+			for (WatchedPath *entry = watched.buckets[i]; entry; entry = entry->hash_next)
+				if (entry->fs == shared) {
+					entry->refs++;
+					list[num++] = entry;
+				}
+	}
+	pthread_mutex_unlock(&watched.mutex);
+
+	if (list == NULL) {
+		if (num > 0)
+			http_wake_streams(); // Let the streams find out
+		return;
+	}
+
+	for (int i = 0; i < num; i++) {
+		WatchedPath *entry = list[i];
+
+		CozyFSStat stat;
+		int code = cozyfs_stat(fs, entry->path, &stat);
+		if (code == 0 || code == -COZYFS_ENOENT) {
+			int exists = (code == 0);
+
+			pthread_mutex_lock(&watched.mutex);
+			int changed = exists != entry->exists
+				|| (exists && (stat.id != entry->stat.id || stat.gen != entry->stat.gen));
+			if (changed) {
+				entry->exists = exists;
+				if (exists)
+					entry->stat = stat;
+			}
+			pthread_mutex_unlock(&watched.mutex);
+
+			if (changed)
+				http_wake_channel(&entry->channel);
+		}
+		watched_release(entry);
+	}
+	free(list);
+}
+
+typedef struct {
+	WatchedPath *entry;
+	int          started;
+	int          exists;
+	CozyFSStat   stat;
+	time_t       last_write;
+} WatchStream;
+
+static void write_watch_event(HTTPResponse *res, WatchStream *watch, const char *event)
 {
-	int timeout_ms = INT_MAX;
-	timeout_ms = MIN(timeout_ms, c->accept_time    + CONN_TIMEOUT * 1000);
-	timeout_ms = MIN(timeout_ms, c->last_recv_time + RECV_TIMEOUT * 1000);
-	timeout_ms = MIN(timeout_ms, c->last_send_time + SEND_TIMEOUT * 1000);
-	return timeout_ms;
+	char buf[128];
+	char etag[32] = "null";
+	if (watch->exists)
+		format_etag(etag, sizeof(etag), watch->stat);
+
+	int len = snprintf(buf, sizeof(buf), "event: %s\ndata: {\"path\":", event);
+	http_write_body(res, buf, len);
+	write_json_string(res, watch->entry->path);
+	len = snprintf(buf, sizeof(buf), ",\"size\":%u,\"etag\":", watch->exists ? watch->stat.size : 0);
+	http_write_body(res, buf, len);
+	if (watch->exists)
+		write_json_string(res, etag);
+	else
+		http_write_body(res, etag, strlen(etag));
+	http_write_body(res, "}\n\n", 3);
 }
 
-static int serve(const char *addr, int port)
+static int watch_stream_callback(HTTPResponse *res, int max, void *data)
 {
-	if (port < 0 || port >= 1<<16)
-		return -1;
+	(void) max;
+	WatchStream *watch = data;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&watched.mutex);
+	int exists = watch->entry->exists;
+	CozyFSStat stat = watch->entry->stat;
+	pthread_mutex_unlock(&watched.mutex);
+
+	const char *event = NULL;
+	if (!watch->started)
+		event = "open";
+	else if (exists && !watch->exists)
+		event = "create";
+	else if (!exists && watch->exists)
+		event = "delete";
+	else if (exists && (stat.id != watch->stat.id || stat.gen != watch->stat.gen)) {
+		// Replacing the file changes the id, so growth of
+		// the same entity is the only case known to append
+		if (stat.id == watch->stat.id && stat.size > watch->stat.size)
+			event = "append";
+		else
+			event = "modify";
+	}
 
-	int accept_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (accept_fd < 0)
-		return -1;
+	watch->started = 1;
+	watch->exists = exists;
+	if (exists)
+		watch->stat = stat;
 
-	// TODO: Make accept_fd non-blocking
+	if (event) {
+		write_watch_event(res, watch, event);
+		watch->last_write = now;
+	}
 
-	struct sockaddr_in bind_buf;
-	bind_buf.sin_family = AF_INET;
-	bind_buf.sin_port = htons(port);
-	bind_buf.sin_addr.s_addr = inet_addr(addr);
-	int code = bind(accept_fd, (struct sockaddr*) &bind_buf, sizeof(bind_buf));
-	if (code < 0)
-		return -1;
+	// Comments keep intermediaries from closing idle streams
+	if (now - watch->last_write >= WATCH_HEARTBEAT_SEC) {
+		http_write_body(res, ":\n\n", 3);
+		watch->last_write = now;
+	}
 
-	code = listen(accept_fd, 32);
-	if (code < 0)
-		return -1;
+	return HTTP_STREAM_WAIT;
+}
+
+static void watch_stream_free(void *data)
+{
+	WatchStream *watch = data;
+	watched_release(watch->entry);
+	free(watch);
+}
+
+// Answers GET with the "watch" query. The first event describes
+// the current state of the path and the following ones its changes.
+static void watch_path(HTTPResponse *res, CozyFS *shared, const char *path)
+{
+	WatchStream *watch = malloc(sizeof(WatchStream));
+	if (watch == NULL) {
+		http_write_head(res, 500);
+		return;
+	}
+	watch->entry = watched_acquire(shared, path);
+	if (watch->entry == NULL) {
+		free(watch);
+		http_write_head(res, 500);
+		return;
+	}
+	watch->started = 0;
+	watch->exists = 0;
+	watch->last_write = time(NULL);
+
+	http_write_head(res, 200);
+	http_write_header(res, "Content-Type: text/event-stream");
+	http_write_header(res, "Cache-Control: no-cache");
+	http_write_body_stream(res, -1, (HTTPStream) { watch_stream_callback, watch_stream_free, watch, &watch->entry->channel });
+}
 
-	int num_conns = 0;
-	Connection conns[1<<10];
+typedef struct {
+	CozyFS *fs;
+	volatile int stop;
+} Watcher;
 
-	for (int i = 0; i < COUNT(conns); i++)
-		conns[i].sock_fd = -1;
+// Checks the watched paths whenever the file system changes, and
+// wakes every stream once per heartbeat period
+static void *watcher_loop(void *arg)
+{
+	Watcher *watcher = arg;
+	CozyFS *fs = thread_fs(watcher->fs);
+
+	unsigned long long seen = cozyfs_changes(fs);
+	time_t last_beat = time(NULL);
+	while (!watcher->stop) {
+		int timeout = MAX(0, last_beat + WATCH_HEARTBEAT_SEC - time(NULL)) * 1000;
+		int code = cozyfs_wait_change(fs, seen, timeout);
+		if (code != COZYFS_OK && code != -COZYFS_ETIMEDOUT)
+			sleep(1); // Don't spin if waiting isn't supported
+
+		unsigned long long changes = cozyfs_changes(fs);
+		if (changes != seen) {
+			seen = changes;
+			check_watched(watcher->fs);
+		}
 
-	for (;;) {
+		time_t now = time(NULL);
+		if (now - last_beat >= WATCH_HEARTBEAT_SEC) {
+			http_wake_streams();
+			last_beat = now;
+		}
+	}
+	return NULL;
+}
 
-		struct pollfd pollarr[1024];
-		int pollnum = 0;
+typedef struct {
+	CozyFS *fs; // Shared, see thread_fs
+	int     fd;
+	int     error;
+	char    path[1<<10];
+	char    temp[64];
+} Upload;
+
+// Creates the staging directory and removes the uploads left behind
+// by servers that died while receiving them. Those of live servers
+// sharing the arena are left alone.
+static void clean_uploads(CozyFS *fs)
+{
+	int code = cozyfs_mkdir(fs, UPLOAD_DIR);
+	if (code != -COZYFS_EEXIST)
+		return;
 
-		int timeout_ms = INT_MAX;
-		for (int i = 0; i < num_conns; i++) {
-			Connection *c = &conns[i];
+	unsigned int cursor = 0;
+	for (;;) {
+		CozyFSDirEntry entries[32];
+		int num = cozyfs_readdir(fs, UPLOAD_DIR, &cursor, entries, COUNT(entries));
+		if (num <= 0)
+			break;
 
-			int events = 0;
-			if (!c->close_when_flushed)
-				events |= POLLIN;
-			if (c->output_count > 0)
-				events |= POLLOUT;
+		for (int i = 0; i < num; i++) {
+			int pid = atoi(entries[i].name);
+			if (pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH))
+				continue;
 
-			timeout_ms = MIN(timeout_ms, timeout_of(c));
+			char temp[sizeof(UPLOAD_DIR) + sizeof(entries[i].name)];
+			snprintf(temp, sizeof(temp), UPLOAD_DIR "/%s", entries[i].name);
+			if (cozyfs_unlink(fs, temp) == 0)
+				cursor--; // The following entries moved back by one
 		}
-		if (timeout_ms == INT_MAX)
-			timeout_ms = -1;
+	}
+}
 
-		pollarr[pollnum++] = (struct pollfd) { .fd=accept_fd, .events=POLLIN, .revents=0 };
+// Atomically replaces "path" with "temp"
+static int replace_file(CozyFS *fs, const char *temp, const char *path)
+{
+	int code = cozyfs_transaction_begin(fs);
+	if (code < 0)
+		return code;
 
-		int num = POLL(pollarr, pollnum, timeout_ms);
-		if (num < 0) continue;
+	code = cozyfs_unlink(fs, path);
+	if (code < 0 && code != -COZYFS_ENOENT)
+		goto error;
 
-		int current_time = ???;
+	code = cozyfs_link(fs, temp, path);
+	if (code < 0)
+		goto error;
 
-		if (pollarr[pollnum-1].revents & POLLIN) {
-			while (num_conns < COUNT(conns)) {
+	code = cozyfs_unlink(fs, temp);
+	if (code < 0)
+		goto error;
 
-				int i = 0;
-				while (conns[i].sock_fd != -1)
-					i++;
+	return cozyfs_transaction_commit(fs);
 
-				int client_fd = accept(accept_fd, NULL, NULL);
-				if (client_fd < 0) {
-					if (errno == EAGAIN || errno == EWOULDBLOCK)
-						break;
-					continue;
-				}
+error:
+	cozyfs_transaction_rollback(fs);
+	return code;
+}
 
-				// TODO: Mark client_fd as non-blocking
-
-				Connection *c = &conns[num_conns];
-				c->sock_fd = client_fd;
-				c->input_buffer = NULL;
-				c->input_count = 0;
-				c->input_capacity = 0;
-				c->output_buffer = NULL;
-				c->output_count = 0;
-				c->output_capacity = 0;
-				c->num_requests = 0;
-				c->state = 0;
-				c->error = 0;
-				c->close_when_flushed = 0;
-				c->accept_time = current_time;
-				c->last_recv_time = current_time;
-				c->last_send_time = current_time;
-
-				num_conns++;
+static int upload_callback(HTTPResponse *res, const char *src, int len, void *data)
+{
+	Upload *upload = data;
+
+	if (src) {
+		// Keep consuming the body after an error so the
+		// connection stays in sync, but drop the bytes.
+		while (upload->error == 0 && len > 0) {
+			int num = cozyfs_write(thread_fs(upload->fs), upload->fd, src, len);
+			if (num < 0)
+				upload->error = num;
+			else {
+				src += num;
+				len -= num;
 			}
 		}
+		return HTTP_STREAM_MORE;
+	}
 
-		for (int i = 0; i < pollnum-1; i++) {
-
-			struct pollfd *pollitem = &pollarr[i];
-			Connection *c = &conns[i];
-			int remove = 0;
+	cozyfs_close(thread_fs(upload->fs), upload->fd);
+	upload->fd = -1;
 
-			if (current_time > timeout_of(c))
-				remove = 1;
+	if (upload->error == 0)
+		upload->error = replace_file(thread_fs(upload->fs), upload->temp, upload->path);
 
-			if (!remove && (pollitem->revents & POLLIN)) {
-				remove = recv_from_conn(c);
-				if (!remove)
-					remove = process_queued_requests(c);
-			}
+	if (upload->error) {
+		cozyfs_unlink(thread_fs(upload->fs), upload->temp);
+		http_write_head(res, upload->error == -COZYFS_ENOMEM ? 507 : 500);
+	} else
+		http_write_head(res, 204);
 
-			if (!remove && (pollitem->revents & POLLOUT))
-				remove = send_to_conn(c);
+	return HTTP_STREAM_DONE;
+}
 
-			if (remove) {
-				CLOSE_SOCKET(c->sock_fd);
-				free(c->input_buffer);
-				free(c->output_buffer);
-				c->sock_fd = -1;
-			}
-		}
+static void upload_free(void *data)
+{
+	Upload *upload = data;
+	if (upload->fd >= 0) {
+		// The connection was dropped mid-upload
+		cozyfs_close(thread_fs(upload->fs), upload->fd);
+		cozyfs_unlink(thread_fs(upload->fs), upload->temp);
 	}
-
-	CLOSE_SOCKET(accept_fd);
+	free(upload);
 }
 
-//////////////////////////////////////////////////////////////////
+#define BATCH_MAX_PATHS 1024
+#define BATCH_MAX_BYTES (16<<20)
 
-int http_serve(HTTPServerConfig config, HTTPCallback callback, void *userptr)
+static void write_batch_part(HTTPResponse *res, CozyFS *fs, const char *path, long long *budget)
 {
-	return serve(addr, port, ???);
+	int status = 200;
+	CozyFSStat stat;
+
+	int code = cozyfs_stat(fs, path, &stat);
+	if (code == 0 && stat.is_dir)
+		status = 400;
+	else if (code == 0 && stat.size > *budget)
+		status = 413; // Should be fetched on its own
+	else if (code < 0)
+		status = code == -COZYFS_ENOENT ? 404 : 500;
+
+	char buf[1<<11];
+	string text = status_text(status);
+	int len = snprintf(buf, sizeof(buf),
+		"\r\n--" BOUNDARY "\r\n"
+		"Content-Location: %s\r\n"
+		"Status: %d %.*s\r\n",
+		path, status, text.len, text.ptr);
+	http_write_body(res, buf, len);
+
+	if (status != 200) {
+		http_write_body(res, "\r\n", 2);
+		return;
+	}
+
+	char etag[32];
+	format_etag(etag, sizeof(etag), stat);
+	len = snprintf(buf, sizeof(buf),
+		"ETag: %s\r\n"
+		"Content-Length: %u\r\n"
+		"\r\n", etag, stat.size);
+	http_write_body(res, buf, len);
+
+	// The contents are copied since the pages may change as soon
+	// as the lock is released. Reading by path doesn't take a
+	// handle, so the transaction doesn't patch anything.
+	int cap;
+	char *dst = http_write_body_ptr(res, stat.size, &cap);
+	if (dst) {
+		int copied = cozyfs_read_path(fs, path, dst, stat.size);
+		if (copied < 0)
+			copied = 0;
+
+		// The length was already sent, so pad if the read fell short
+		memset(dst + copied, 0, stat.size - copied);
+		http_write_body_ack(res, stat.size);
+	}
+	*budget -= stat.size;
 }
 
-void http_write_head(HTTPResponse *res, int status)
+// Answers POST /?batch. The body lists one path per line, and the
+// response has a multipart/mixed part for each, in the same order.
+// All paths are read in a single critical section, so the files are
+// consistent with each other. The transaction is rolled back at the
+// end since nothing was modified.
+static void batch_get(HTTPRequest *req, HTTPResponse *res, CozyFS *fs)
 {
-	write_head((Connection*) res, status);
+	// Bodies too large for the input buffer aren't buffered
+	if (req->body == NULL) {
+		http_write_head(res, 413);
+		return;
+	}
+
+	int num_paths = 0;
+	for (int i = 0; i < req->body_len; i++)
+		if (req->body[i] == '\n')
+			num_paths++;
+	if (num_paths >= BATCH_MAX_PATHS) {
+		http_write_head(res, 413);
+		return;
+	}
+
+	if (cozyfs_transaction_begin(fs) < 0) {
+		http_write_head(res, 500);
+		return;
+	}
+
+	http_write_head(res, 200);
+	http_write_header(res, "Content-Type: multipart/mixed; boundary=" BOUNDARY);
+
+	long long budget = BATCH_MAX_BYTES;
+
+	int i = 0;
+	while (i < req->body_len) {
+
+		int start = i;
+		while (i < req->body_len && req->body[i] != '\n')
+			i++;
+		int len = i - start;
+		if (i < req->body_len)
+			i++;
+
+		if (len > 0 && req->body[start + len - 1] == '\r')
+			len--;
+		if (len <= 0)
+			continue;
+
+		char path[1<<10];
+		if (len >= (int) sizeof(path))
+			len = sizeof(path)-1;
+		memcpy(path, req->body + start, len);
+		path[len] = '\0';
+
+		// Paths end up in the part headers
+		for (int j = 0; j < len; j++)
+			if ((unsigned char) path[j] < 0x20)
+				path[j] = '?';
+
+		write_batch_part(res, fs, path, &budget);
+	}
+
+	cozyfs_transaction_rollback(fs);
+	write_closing_boundary(res);
 }
 
-void http_write_header(HTTPResponse *res, const char *fmt, ...)
+// Metrics are rendered in the Prometheus text format straight into
+// the output buffer, so they aren't copied. A scrape is larger than a
+// slab block, so that buffer is malloc'd for the response. Output that
+// doesn't fit is cut after the last line that did.
+#define METRICS_BUFFER (1<<16)
+
+typedef struct {
+	char *buf;
+	int   len;
+	int   cap;
+	int   full;
+} Metrics;
+
+static const char *op_names[COZYFS_OP_COUNT] = {
+	[COZYFS_OP_LINK]                 = "link",
+	[COZYFS_OP_UNLINK]               = "unlink",
+	[COZYFS_OP_MKDIR]                = "mkdir",
+	[COZYFS_OP_RMDIR]                = "rmdir",
+	[COZYFS_OP_MKUSR]                = "mkusr",
+	[COZYFS_OP_RMUSR]                = "rmusr",
+	[COZYFS_OP_CHOWN]                = "chown",
+	[COZYFS_OP_CHMOD]                = "chmod",
+	[COZYFS_OP_OPEN]                 = "open",
+	[COZYFS_OP_CREATE]               = "create",
+	[COZYFS_OP_CLOSE]                = "close",
+	[COZYFS_OP_READ]                 = "read",
+	[COZYFS_OP_WRITE]                = "write",
+	[COZYFS_OP_READ_SPANS]           = "read_spans",
+	[COZYFS_OP_SEEK]                 = "seek",
+	[COZYFS_OP_FSTAT]                = "fstat",
+	[COZYFS_OP_STAT]                 = "stat",
+	[COZYFS_OP_READDIR]              = "readdir",
+	[COZYFS_OP_TRANSACTION_BEGIN]    = "transaction_begin",
+	[COZYFS_OP_TRANSACTION_COMMIT]   = "transaction_commit",
+	[COZYFS_OP_TRANSACTION_ROLLBACK] = "transaction_rollback",
+	[COZYFS_OP_INSPECT]              = "inspect",
+	[COZYFS_OP_READ_PATH]            = "read_path",
+};
+
+static void metric(Metrics *m, const char *fmt, ...)
 {
+	if (m->full)
+		return;
+
 	va_list args;
 	va_start(args, fmt);
-	write_head((Connection*) res, args);
+	int num = vsnprintf(m->buf + m->len, m->cap - m->len, fmt, args);
 	va_end(args);
+
+	if (num < 0 || num >= m->cap - m->len) {
+		m->full = 1;
+		return;
+	}
+	m->len += num;
 }
 
-void http_write_body(HTTPResponse *res, const char *str, int len)
+// Engine histograms have a bucket per power of two. Every other
+// boundary from "first" is reported, converted by "scale". Counters
+// are summed without the lock while processes keep adding to them,
+// so the totals are taken from the buckets themselves to keep the
+// series cumulative and "+Inf" equal to "_count".
+static void metric_histogram(Metrics *m, const char *name, const char *labels,
+	CozyFSHistogram *hist, int first, int last, double scale)
 {
-	write_body(res, (string) {str, len});
+	const char *sep = labels[0] ? "," : "";
+	const char *lbrace = labels[0] ? "{" : "";
+	const char *rbrace = labels[0] ? "}" : "";
+
+	unsigned long long total = 0;
+	for (int i = 0; i < COZYFS_HIST_BUCKETS; i++)
+		total += hist->buckets[i];
+
+	unsigned long long cumulative = 0;
+	for (int i = 0; i <= last; i++) {
+		cumulative = MIN(cumulative + hist->buckets[i], total);
+		if (i >= first && (i - first) % 2 == 0)
+			metric(m, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+				(double) ((1ULL << i) - 1) * scale, cumulative);
+	}
+	metric(m, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, total);
+	metric(m, "%s_sum%s%s%s %g\n", name, lbrace, labels, rbrace, (double) hist->sum * scale);
+	metric(m, "%s_count%s%s%s %llu\n", name, lbrace, labels, rbrace, total);
 }
 
-void *http_write_body_ptr(HTTPResponse *res, int mincap, int *cap)
+// Answers GET with the "metrics" query
+static void serve_metrics(HTTPResponse *res, CozyFS *fs)
 {
-	return write_body_ptr((Connection*) res, mincap, cap);
+	http_write_head(res, 200);
+	http_write_header(res, "Content-Type: text/plain; version=0.0.4");
+	http_write_header(res, "Cache-Control: no-cache");
+
+	int cap;
+	char *buf = http_write_body_ptr(res, METRICS_BUFFER, &cap);
+	if (buf == NULL)
+		return;
+	Metrics m = { buf, 0, cap, 0 };
+
+	// Latencies from 1us to 17s
+	CozyFSStats stats;
+	if (cozyfs_stats(fs, &stats) == 0) {
+
+		metric(&m, "# TYPE cozyfs_op_duration_seconds histogram\n");
+		for (int i = 0; i < COZYFS_OP_COUNT; i++) {
+			char labels[48];
+			snprintf(labels, sizeof(labels), "op=\"%s\"", op_names[i]);
+			metric_histogram(&m, "cozyfs_op_duration_seconds", labels, &stats.ops[i], 10, 34, 1e-9);
+		}
+
+		metric(&m, "# TYPE cozyfs_op_errors_total counter\n");
+		for (int i = 0; i < COZYFS_OP_COUNT; i++)
+			metric(&m, "cozyfs_op_errors_total{op=\"%s\"} %llu\n", op_names[i], stats.errors[i]);
+
+		metric(&m, "# TYPE cozyfs_lock_wait_seconds histogram\n");
+		metric_histogram(&m, "cozyfs_lock_wait_seconds", "", &stats.lock_wait, 10, 34, 1e-9);
+		metric(&m, "# TYPE cozyfs_lock_hold_seconds histogram\n");
+		metric_histogram(&m, "cozyfs_lock_hold_seconds", "", &stats.lock_hold, 10, 34, 1e-9);
+		metric(&m, "# TYPE cozyfs_lock_crashes_total counter\n");
+		metric(&m, "cozyfs_lock_crashes_total %llu\n", stats.crashes);
+
+		metric(&m, "# TYPE cozyfs_transaction_patches histogram\n");
+		metric_histogram(&m, "cozyfs_transaction_patches", "", &stats.patches, 0, 8, 1);
+
+		metric(&m, "# TYPE cozyfs_backup_duration_seconds histogram\n");
+		metric_histogram(&m, "cozyfs_backup_duration_seconds", "", &stats.backup_time, 10, 34, 1e-9);
+		metric(&m, "# TYPE cozyfs_backup_bytes_total counter\n");
+		metric(&m, "cozyfs_backup_bytes_total %llu\n", stats.backup_bytes);
+	}
+
+	CozyFSUsage usage;
+	if (cozyfs_usage(fs, &usage) == 0) {
+		metric(&m, "# TYPE cozyfs_pages_total gauge\n");
+		metric(&m, "cozyfs_pages_total %d\n", usage.tot_pages);
+		metric(&m, "# TYPE cozyfs_pages_used gauge\n");
+		metric(&m, "cozyfs_pages_used %d\n", usage.num_pages - usage.free_pages);
+		metric(&m, "# TYPE cozyfs_pages_free gauge\n");
+		metric(&m, "cozyfs_pages_free %d\n", usage.tot_pages - usage.num_pages + usage.free_pages);
+	}
+
+	HTTPServerStats server;
+	http_server_stats(&server);
+	metric(&m, "# TYPE http_workers gauge\n");
+	metric(&m, "http_workers %d\n", server.num_workers);
+	metric(&m, "# TYPE http_connections_open gauge\n");
+	metric(&m, "http_connections_open %d\n", server.open_conns);
+	metric(&m, "# TYPE http_connections_accepted_total counter\n");
+	metric(&m, "http_connections_accepted_total %llu\n", server.accepted);
+	metric(&m, "# TYPE http_requests_total counter\n");
+	metric(&m, "http_requests_total %llu\n", server.requests);
+
+	http_write_body_ack(res, m.len);
 }
 
-void http_write_body_ack(HTTPResponse *res, int num)
+// Compressed variants of hot files are kept in memory so repeated
+// GETs cost a lookup and a copy instead of a deflate. Entries are
+// keyed by entity id and generation, so a write makes the old ones
+// unreachable and they age out of the LRU.
+
+#define CACHE_MAX_BYTES   (64<<20)
+#define CACHE_MAX_ENTRIES 4096
+#define CACHE_BUCKETS     1024
+#define CACHE_MIN_FILE    256
+#define CACHE_MAX_FILE    (4<<20)
+#define CACHE_HOT_HITS    2
+
+typedef enum {
+	ENCODING_GZIP,
+	ENCODING_DEFLATE,
+	NUM_ENCODINGS,
+} Encoding;
+
+static const struct {
+	string name;
+	int    window_bits;
+} encodings[NUM_ENCODINGS] = {
+	[ENCODING_GZIP]    = { {"gzip", 4},    15+16 },
+	[ENCODING_DEFLATE] = { {"deflate", 7}, 15    }, // Zlib framing, as HTTP expects
+};
+
+typedef enum {
+	CACHE_COLD,    // Counting hits
+	CACHE_BUSY,    // Being compressed by a request
+	CACHE_READY,
+	CACHE_USELESS, // Doesn't compress well
+} CacheState;
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+	unsigned int id;
+	unsigned int gen;
+	Encoding     encoding;
+	CacheState   state;
+	int          hits;
+	int          refs; // One for the table plus one per user
+	int          linked;
+	char        *data;
+	int          len;
+	CacheEntry  *hash_next;
+	CacheEntry  *lru_prev;
+	CacheEntry  *lru_next;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	CacheEntry *buckets[CACHE_BUCKETS];
+	CacheEntry *lru_head;
+	CacheEntry *lru_tail;
+	long long   bytes;
+	int         count;
+} cache = { .mutex=PTHREAD_MUTEX_INITIALIZER };
+
+// The following cache_* helpers expect the mutex to be held
+
+static void cache_release(CacheEntry *entry)
 {
-	write_body_ack((Connection*) res, num);
+	if (--entry->refs == 0) {
+		free(entry->data);
+		free(entry);
+	}
 }
 
-void http_restart_response(HTTPResponse *res)
+static void cache_lru_remove(CacheEntry *entry)
 {
-	restart_response((Connection*) res);
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache.lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache.lru_tail = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
 }
 
-//////////////////////////////////////////////////////////////////
+static void cache_lru_push(CacheEntry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache.lru_head;
+	if (cache.lru_head)
+		cache.lru_head->lru_prev = entry;
+	else
+		cache.lru_tail = entry;
+	cache.lru_head = entry;
+}
+
+static void cache_unlink(CacheEntry *entry)
+{
+	CacheEntry **prev = &cache.buckets[entry->id % CACHE_BUCKETS];
+	while (*prev != entry)
+		prev = &(*prev)->hash_next;
+	*prev = entry->hash_next;
+
+	cache_lru_remove(entry);
+	cache.bytes -= entry->len;
+	cache.count--;
+	entry->linked = 0;
+	cache_release(entry);
+}
+
+static void cache_evict(void)
+{
+	while (cache.lru_tail && (cache.bytes > CACHE_MAX_BYTES || cache.count > CACHE_MAX_ENTRIES))
+		cache_unlink(cache.lru_tail);
+}
+
+// Counts a hit for the variant of the file and returns its entry
+// if it's ready to be served or, once the file is hot, if the caller
+// should compress it. The caller then owns a reference to it.
+static CacheEntry *cache_get(CozyFSStat stat, Encoding encoding)
+{
+	pthread_mutex_lock(&cache.mutex);
+
+	CacheEntry *found = NULL;
+	CacheEntry *entry = cache.buckets[stat.id % CACHE_BUCKETS];
+	while (entry) {
+		CacheEntry *next = entry->hash_next;
+		if (entry->id == stat.id) {
+			if (entry->gen != stat.gen)
+				cache_unlink(entry); // Stale
+			else if (entry->encoding == encoding)
+				found = entry;
+		}
+		entry = next;
+	}
+
+	if (found == NULL) {
+		found = malloc(sizeof(CacheEntry));
+		if (found == NULL) {
+			pthread_mutex_unlock(&cache.mutex);
+			return NULL;
+		}
+		*found = (CacheEntry) { .id=stat.id, .gen=stat.gen, .encoding=encoding, .state=CACHE_COLD, .refs=1, .linked=1 };
+		CacheEntry **bucket = &cache.buckets[stat.id % CACHE_BUCKETS];
+		found->hash_next = *bucket;
+		*bucket = found;
+		cache.count++;
+	} else
+		cache_lru_remove(found);
+	cache_lru_push(found);
+
+	found->hits++;
+	if (found->state == CACHE_COLD && found->hits >= CACHE_HOT_HITS)
+		found->state = CACHE_BUSY;
+	else if (found->state != CACHE_READY)
+		found = NULL;
+
+	if (found)
+		found->refs++;
+	cache_evict();
+	pthread_mutex_unlock(&cache.mutex);
+	return found;
+}
+
+// Stores the result of compressing a busy entry. A NULL "data"
+// means the variant isn't worth serving.
+static void cache_fill(CacheEntry *entry, char *data, int len)
+{
+	pthread_mutex_lock(&cache.mutex);
+	entry->state = data ? CACHE_READY : CACHE_USELESS;
+	entry->data = data;
+	entry->len = len;
+	if (entry->linked) {
+		cache.bytes += len;
+		cache_evict();
+	}
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+static void cache_put(CacheEntry *entry)
+{
+	pthread_mutex_lock(&cache.mutex);
+	cache_release(entry);
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+// Drops the reference held by a response once its body was sent
+static void cache_put_pinned(void *data)
+{
+	cache_put(data);
+}
+
+// Returns whether "coding" is listed in Accept-Encoding without
+// a zero weight. A "*" counts unless the coding is listed.
+static int accepts_encoding(HTTPRequest *req, string coding)
+{
+	HTTPHeader *header = find_header(req, S("Accept-Encoding"));
+	if (header == NULL)
+		return 0;
+
+	const char *src = header->value;
+	int len = header->value_len;
+	int wildcard = 0;
+	int i = 0;
+	for (;;) {
+
+		while (i < len && (src[i] == ' ' || src[i] == ','))
+			i++;
+		if (i == len)
+			return wildcard;
+
+		int start = i;
+		while (i < len && src[i] != ',' && src[i] != ';' && src[i] != ' ')
+			i++;
+		string name = { (char*) src + start, i - start };
+
+		// Only the weight parameter matters
+		int accepted = 1;
+		while (i < len && src[i] != ',') {
+			if (src[i] == 'q' && i+1 < len && src[i+1] == '=') {
+				i += 2;
+				accepted = 0;
+				while (i < len && ((src[i] >= '0' && src[i] <= '9') || src[i] == '.')) {
+					if (src[i] >= '1' && src[i] <= '9')
+						accepted = 1;
+					i++;
+				}
+				continue;
+			}
+			i++;
+		}
+
+		if (streq_case_insensitive(name, coding))
+			return accepted;
+		if (name.len == 1 && name.ptr[0] == '*')
+			wildcard = accepted;
+	}
+}
+
+static void format_encoded_etag(char *dst, int cap, CozyFSStat stat, Encoding encoding)
+{
+	string name = encodings[encoding].name;
+	snprintf(dst, cap, "\"%x-%x-%.*s\"", stat.id, stat.gen, name.len, name.ptr);
+}
+
+// Compresses the file from the current cursor of "fd". Returns NULL
+// if the output isn't at least a tenth smaller than the input.
+static char *compress_file(CozyFS *fs, int fd, CozyFSStat stat, Encoding encoding, int *out_len)
+{
+	z_stream z = {0};
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, encodings[encoding].window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	int cap = stat.size - stat.size / 10;
+	char *dst = malloc(cap);
+	if (dst == NULL) {
+		deflateEnd(&z);
+		return NULL;
+	}
+	z.next_out  = (Bytef*) dst;
+	z.avail_out = cap;
+
+	// The pages are compressed in place. The bytes up to the size
+	// in "stat" don't change while "fd" is open (see FileStream).
+	unsigned int remaining = stat.size;
+	while (remaining > 0 && z.avail_out > 0) {
+		CozyFSSpan spans[16];
+		int num = cozyfs_read_spans(fs, fd, spans, COUNT(spans));
+		if (num <= 0)
+			break;
+		for (int i = 0; i < num && remaining > 0 && z.avail_out > 0; i++) {
+			int len = MIN((unsigned int) spans[i].len, remaining);
+			remaining -= len;
+			z.next_in  = (Bytef*) spans[i].ptr;
+			z.avail_in = len;
+			while (z.avail_in > 0 && z.avail_out > 0)
+				deflate(&z, Z_NO_FLUSH);
+		}
+	}
+
+	int ret = Z_OK;
+	if (remaining == 0 && z.avail_out > 0)
+		ret = deflate(&z, Z_FINISH);
+	deflateEnd(&z);
+
+	if (ret != Z_STREAM_END) {
+		free(dst);
+		return NULL;
+	}
+
+	*out_len = cap - z.avail_out;
+	return dst;
+}
+
+// Serves the file compressed with the first coding the client
+// accepts, compressing it if it just became hot. Returns 0 if
+// the caller should send it uncompressed instead.
+static int serve_compressed(HTTPRequest *req, HTTPResponse *res, CozyFS *fs, int fd, CozyFSStat stat, const char *last_modified)
+{
+	Encoding encoding = 0;
+	while (encoding < NUM_ENCODINGS && !accepts_encoding(req, encodings[encoding].name))
+		encoding++;
+	if (encoding == NUM_ENCODINGS)
+		return 0;
+
+	CacheEntry *entry = cache_get(stat, encoding);
+	if (entry == NULL)
+		return 0;
+
+	if (entry->state == CACHE_BUSY) {
+		int len = 0;
+		char *data = compress_file(fs, fd, stat, encoding, &len);
+		cache_fill(entry, data, len);
+		if (data == NULL) {
+			cache_put(entry);
+			return cozyfs_seek(fs, fd, 0) < 0 ? -1 : 0;
+		}
+	}
+
+	// Ready entries never change, so they can be read without the mutex
+	char etag[48];
+	format_encoded_etag(etag, sizeof(etag), stat, encoding);
+	http_write_head(res, 200);
+	http_write_header(res, "Content-Encoding: %.*s", encodings[encoding].name.len, encodings[encoding].name.ptr);
+	http_write_header(res, "Vary: Accept-Encoding");
+	http_write_header(res, "ETag: %s", etag);
+	http_write_header(res, "Last-Modified: %s", last_modified);
+	http_write_body_span_release(res, entry->data, entry->len, cache_put_pinned, entry);
+	return 1;
+}
 
 static void http_callback(HTTPRequest *req, HTTPResponse *res, void *userptr)
 {
-	CozyFS *fs = userptr;
+	CozyFS *fs = thread_fs(userptr);
+
+	// Split the query string from the path
+	int path_len = 0;
+	while (path_len < req->path_len && req->path[path_len] != '?')
+		path_len++;
+	string query = { req->path + path_len, req->path_len - path_len };
+	if (query.len > 0) {
+		query.ptr++;
+		query.len--;
+	}
 
 	char path[1<<10];
-	if (req->path_len >= sizeof(path)) {
+	if (path_len >= (int) sizeof(path)) {
 		http_write_head(res, 500);
 		return;
 	}
-	memcpy(path, req->path, req->path_len);
-	path[req->path_len] = '\0';
+	memcpy(path, req->path, path_len);
+	path[path_len] = '\0';
 
 	switch (req->method) {
 
+		case M_POST:
+		if (query.len == 5 && !memcmp(query.ptr, "batch", 5)) {
+			batch_get(req, res, fs);
+			break;
+		}
+		// fallthrough
 		case M_TRACE:
 		case M_CONNECT:
-		case M_POST:
 		http_write_head(res, 405); // 405 Method Not Allowed
-		http_write_header(res, "Allow: OPTIONS, GET, HEAD, PUT, DELETE, PATCH");
+		http_write_header(res, "Allow: OPTIONS, GET, HEAD, PUT, DELETE, PATCH, POST");
 		break;
 
 		case M_OPTIONS:
 		http_write_head(res, 200); // 200 OK
-		http_write_header(res, "Allow: OPTIONS, GET, HEAD, PUT, DELETE, PATCH");
+		http_write_header(res, "Allow: OPTIONS, GET, HEAD, PUT, DELETE, PATCH, POST");
 		break;
 
+		case M_HEAD:
 		case M_GET:
 		{
+			if (query.len == 7 && !memcmp(query.ptr, "metrics", 7)) {
+				serve_metrics(res, fs);
+				return;
+			}
+
+			if (query.len == 5 && !memcmp(query.ptr, "watch", 5)) {
+				watch_path(res, userptr, path);
+				return;
+			}
+
+			CozyFSStat stat;
+			int code = cozyfs_stat(fs, path, &stat);
+			if (code < 0) {
+				http_write_head(res, code == -COZYFS_ENOENT ? 404 : 500);
+				return;
+			}
+			if (stat.is_dir) {
+				list_directory(res, userptr, path, query);
+				return;
+			}
+
+			char etag[32];
+			char last_modified[32];
+			format_etag(etag, sizeof(etag), stat);
+			format_http_date(last_modified, sizeof(last_modified), stat.mtime);
+
+			int compressible = stat.size >= CACHE_MIN_FILE && stat.size <= CACHE_MAX_FILE;
+
+			// Validators come from the entity so a conditional GET
+			// is answered without opening the file. Clients may
+			// hold any of the variants.
+			char encoded_etag[48];
+			const char *matched = NULL;
+			if (not_modified(req, etag, stat.mtime))
+				matched = etag;
+			for (Encoding e = 0; matched == NULL && compressible && e < NUM_ENCODINGS; e++) {
+				format_encoded_etag(encoded_etag, sizeof(encoded_etag), stat, e);
+				if (not_modified(req, encoded_etag, stat.mtime))
+					matched = encoded_etag;
+			}
+			if (matched) {
+				http_write_head(res, 304); // 304 Not Modified
+				if (compressible)
+					http_write_header(res, "Vary: Accept-Encoding");
+				http_write_header(res, "ETag: %s", matched);
+				http_write_header(res, "Last-Modified: %s", last_modified);
+				return;
+			}
+
 			int fd = cozyfs_open(fs, path);
+			if (fd == -COZYFS_EISDIR) {
+				list_directory(res, userptr, path, query);
+				return;
+			}
 			if (fd < 0) {
 				http_write_head(res, fd == -COZYFS_ENOENT ? 404 : 500);
 				return;
 			}
 
-			http_write_head(res, 200);
-			for (;;) {
-
-				int cap;
-				char * dst = http_write_body_ptr(res, 1<<9, &cap);
-				if (dst)
-					break;
+			// The file may have been written or replaced since
+			// it was looked up, and the body must match the head
+			CozyFSStat opened;
+			if (cozyfs_fstat(fs, fd, &opened) < 0) {
+				cozyfs_close(fs, fd);
+				http_write_head(res, 500);
+				return;
+			}
+			if (opened.id != stat.id || opened.gen != stat.gen) {
+				stat = opened;
+				format_etag(etag, sizeof(etag), stat);
+				format_http_date(last_modified, sizeof(last_modified), stat.mtime);
+				compressible = stat.size >= CACHE_MIN_FILE && stat.size <= CACHE_MAX_FILE;
+			}
 
-				int num = cozyfs_read(fs, fd, dst, cap, 0);
-				if (num < 0) {
-					http_restart_response(res);
-					http_write_head(res, 500);
+			HTTPHeader *range = find_header(req, S("Range"));
+			if (compressible && range == NULL) {
+				int ret = serve_compressed(req, res, fs, fd, stat, last_modified);
+				if (ret != 0) {
+					cozyfs_close(fs, fd);
+					if (ret < 0)
+						http_write_head(res, 500);
 					return;
 				}
-				if (num == 0)
-					break;
+			}
 
-				http_write_body_ack(res, num);
+			FileStream *stream = malloc(sizeof(FileStream));
+			if (stream == NULL) {
+				cozyfs_close(fs, fd);
+				http_write_head(res, 500);
+				return;
+			}
+			stream->fs = userptr;
+			stream->fd = fd;
+			stream->refs = 1;
+			stream->size = stat.size;
+			stream->multipart = 0;
+			stream->cur_range = -1;
+			stream->range_remaining = 0;
+
+			int num_ranges = -1;
+			if (range && if_range_matches(req, etag, stat.mtime))
+				num_ranges = parse_ranges(range->value, range->value_len, stream->size, stream->ranges, MAX_RANGES);
+
+			if (num_ranges == 0) {
+				file_stream_free(stream);
+				http_write_head(res, 416); // 416 Range Not Satisfiable
+				http_write_header(res, "Content-Range: bytes */%lld", (long long) stat.size);
+				return;
 			}
 
-			cozyfs_close(fs, fd);
+			if (num_ranges < 0) {
+				stream->num_ranges = 0;
+				if (stream->size > 0)
+					stream->ranges[stream->num_ranges++] = (ByteRange) { 0, stream->size-1 };
+				http_write_head(res, 200);
+			} else {
+				stream->num_ranges = num_ranges;
+				http_write_head(res, 206);
+				if (num_ranges == 1) {
+					ByteRange r = stream->ranges[0];
+					http_write_header(res, "Content-Range: bytes %lld-%lld/%lld", r.first, r.last, stream->size);
+				} else {
+					stream->multipart = 1;
+					http_write_header(res, "Content-Type: multipart/byteranges; boundary=" BOUNDARY);
+				}
+			}
+			http_write_header(res, "Accept-Ranges: bytes");
+			if (compressible)
+				http_write_header(res, "Vary: Accept-Encoding");
+			http_write_header(res, "ETag: %s", etag);
+			http_write_header(res, "Last-Modified: %s", last_modified);
+			http_write_body_stream(res, file_stream_length(stream), (HTTPStream) { file_stream_callback, file_stream_free, stream, NULL });
 		}
 		break;
 
-		case M_HEAD:
-		{
-			// TODO
-		}
-
 		case M_PUT:
 		{
-			// TODO
+			// The body is written to a temporary file which replaces
+			// the target once complete, so partial uploads are never
+			// visible and the lock isn't held while receiving.
+			Upload *upload = malloc(sizeof(Upload));
+			if (upload == NULL) {
+				http_write_head(res, 500);
+				return;
+			}
+			upload->fs = userptr;
+			upload->error = 0;
+			strcpy(upload->path, path);
+			snprintf(upload->temp, sizeof(upload->temp), UPLOAD_DIR "/%d-%p", (int) getpid(), (void*) upload);
+
+			upload->fd = cozyfs_create(fs, upload->temp);
+			if (upload->fd < 0) {
+				free(upload);
+				http_write_head(res, 500);
+				return;
+			}
+
+			http_read_body_stream(res, (HTTPUpload) { upload_callback, upload_free, upload });
 		}
 		break;
 
 		case M_DELETE:
 		{
-			cozyfs_unlink(fs, path);
-			// TODO
+			int code = cozyfs_unlink(fs, path);
+			if (code == -COZYFS_EISDIR)
+				code = cozyfs_rmdir(fs, path);
+
+			int status = 500;
+			switch (-code) {
+				case COZYFS_OK:        status = 204; break; // 204 No Content
+				case COZYFS_ENOENT:    status = 404; break;
+				case COZYFS_EPERM:     status = 403; break; // The root can't be removed
+				case COZYFS_ENOTEMPTY: status = 409; break; // 409 Conflict
+			}
+			http_write_head(res, status);
 		}
 		break;
 
 		case M_PATCH:
-		{
-			// TODO
-		}
+		http_write_head(res, 501); // 501 Not Implemented
 		break;
 	}
 }
@@ -888,5 +4110,19 @@ int cozyfs_http_serve(const char *addr, int port, CozyFS *fs)
 	HTTPServerConfig config = HTTP_SERVER_DEFAULT_CONFIG;
 	config.addr = addr;
 	config.port = port;
-	return http_serve(config, http_callback, fs);
+
+	clean_uploads(fs);
+
+	// Without the watcher, watches only report the initial state
+	pthread_t thread;
+	Watcher watcher = { fs, 0 };
+	int watching = !pthread_create(&thread, NULL, watcher_loop, &watcher);
+
+	int ret = http_serve(config, http_callback, fs);
+
+	if (watching) {
+		watcher.stop = 1;
+		pthread_join(thread, NULL);
+	}
+	return ret;
 }
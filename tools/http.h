@@ -48,12 +48,64 @@ typedef struct {
 	int        minor;
 	int        num_headers;
 	HTTPHeader headers[MAX_HEADERS];
+
+	// The body is only available here if it fits in the input
+	// buffer. Otherwise it must be read with http_read_body_stream.
+	char      *body;
+	int        body_len;
+	long long  content_length;
 } HTTPRequest;
 
 typedef struct HTTPResponse HTTPResponse;
 
+// Callbacks run on a pool thread unless "num_pool_threads" is zero.
+// Calls for the same connection never overlap.
 typedef void (*HTTPCallback)(HTTPRequest *req, HTTPResponse *res, void *userptr);
 
+enum {
+	HTTP_STREAM_ERROR = -1,
+	HTTP_STREAM_MORE  =  0,
+	HTTP_STREAM_DONE  =  1,
+	HTTP_STREAM_WAIT  =  2,
+};
+
+// Called whenever the connection has room for more body bytes. It
+// should write around "max" bytes with the http_write_body* functions
+// and return one of HTTP_STREAM_*. Once the stream is over, or if the
+// connection is dropped, "free" is called on "data".
+//
+// Streams with nothing to send return HTTP_STREAM_WAIT. They are parked
+// once their output is flushed, and only called again after the next
+// http_wake_streams. Parked streams use no CPU and don't time out.
+//
+// Streams with a channel are also resumed by http_wake_channel on it,
+// which leaves the others parked. The channel must be zeroed before
+// use and outlive the streams waiting on it.
+typedef int  (*HTTPStreamCallback)(HTTPResponse *res, int max, void *data);
+typedef void (*HTTPStreamFree)(void *data);
+
+typedef struct {
+	unsigned long long epoch;
+} HTTPChannel;
+
+typedef struct {
+	HTTPStreamCallback callback;
+	HTTPStreamFree     free;
+	void*              data;
+	HTTPChannel*       channel; // Optional
+} HTTPStream;
+
+// Receives the request body as it arrives, then once more with a NULL
+// "src" when it's complete. The response can only be written during that
+// last call. Returning HTTP_STREAM_ERROR drops the connection.
+typedef int (*HTTPUploadCallback)(HTTPResponse *res, const char *src, int len, void *data);
+
+typedef struct {
+	HTTPUploadCallback callback;
+	HTTPStreamFree     free;
+	void*              data;
+} HTTPUpload;
+
 typedef struct {
 	const char *addr;
 	int port;
@@ -62,6 +114,11 @@ typedef struct {
 	int send_timeout_sec;
 	int input_buffer_limit;
 	int connection_reuse_limit;
+	int num_workers; // Zero means one per CPU
+	int max_conns_per_worker;
+	int zerocopy_send; // Use MSG_ZEROCOPY for large borrowed bodies
+	int output_window; // Bytes a streamed response can queue at a time
+	int num_pool_threads; // Threads running callbacks off the event loop. Zero runs them inline
 } HTTPServerConfig;
 
 #define HTTP_SERVER_DEFAULT_CONFIG (HTTPServerConfig) {	\
@@ -72,6 +129,11 @@ typedef struct {
 	.send_timeout_sec=5,								\
 	.input_buffer_limit=(1<<20),						\
 	.connection_reuse_limit=100,						\
+	.num_workers=0,										\
+	.max_conns_per_worker=(1<<15),						\
+	.zerocopy_send=0,									\
+	.output_window=(1<<18),								\
+	.num_pool_threads=16,								\
 }
 
 int   http_serve(HTTPServerConfig config, HTTPCallback callback, void *userptr);
@@ -80,8 +142,38 @@ void  http_write_header(HTTPResponse *res, const char *fmt, ...);
 void  http_write_body(HTTPResponse *res, const char *str, int len);
 void* http_write_body_ptr(HTTPResponse *res, int mincap, int *cap);
 void  http_write_body_ack(HTTPResponse *res, int num);
+// Spans are sent without copying, so they must stay valid until flushed.
+// With "zerocopy_send" the kernel may read them later still, so spans
+// sent without a release must not change while the server runs.
+void  http_write_body_span(HTTPResponse *res, const void *ptr, int len);
+// Like http_write_body_span, but "release" is called with "data" once
+// the span was sent or dropped, so the memory can be freed from there
+void  http_write_body_span_release(HTTPResponse *res, const void *ptr, int len, void (*release)(void *data), void *data);
+
+// Negative lengths mean unknown. Those are sent with chunked encoding,
+// or to HTTP/1.0 clients by closing the connection at the end.
+void  http_write_body_stream(HTTPResponse *res, long long length, HTTPStream stream);
+void  http_read_body_stream(HTTPResponse *res, HTTPUpload upload);
 void  http_restart_response(HTTPResponse *res);
 
+// Resumes the parked streams of every running server. Safe to call
+// from any thread.
+void  http_wake_streams(void);
+
+// Resumes only the parked streams waiting on "channel"
+void  http_wake_channel(HTTPChannel *channel);
+
+typedef struct {
+	int                num_workers;
+	int                open_conns;
+	unsigned long long accepted;
+	unsigned long long requests;
+} HTTPServerStats;
+
+// Sums the counters of the workers of every running server. Safe to
+// call from any thread.
+void  http_server_stats(HTTPServerStats *stats);
+
 int   cozyfs_http_serve(const char *addr, int port, CozyFS *fs);
 
 #endif // COZYFS_HTTP_H
\ No newline at end of file
@@ -15,6 +15,8 @@
 // Inclusions
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #if OS_WINDOWS
 #define WIN32_MEAN_AND_LEAN
@@ -22,11 +24,18 @@
 #endif
 
 #if OS_LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <pthread.h>
 #endif
 
 #include "http.h"
+#include "fuse.h"
+#include "bulk.h"
+#include "trace.h"
 #include <cozyfs.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -41,6 +50,16 @@ typedef struct {
 } string;
 
 #define S(X) ((string) { (X), sizeof(X)-1 })
+#define COUNT(X) (int) (sizeof(X) / sizeof((X)[0]))
+
+// Where the state lives with --shared and --persist, and its size
+#if OS_WINDOWS
+#define SHARED_NAME "cozyfs"
+#else
+#define SHARED_NAME "/cozyfs"
+#endif
+#define PERSIST_NAME "cozyfs.dat"
+#define FILE_SIZE    (64ULL << 20)
 
 #if OS_WINDOWS
 typedef HANDLE Thread;
@@ -71,6 +90,8 @@ static void   thread_join          (Thread thread);
 
 static int    shared_memory_flush  (SharedMemory shm);
 static void   shared_memory_delete (SharedMemory shm);
+// Returns 1 if the memory was just created and must be initialized,
+// 0 if it already existed, or -1. Without a name it's anonymous.
 static int    shared_memory_create (SharedMemory *shm, const char *name, u64 len, int is_file);
 
 static void   run_shell            (CozyFS *fs);
@@ -91,35 +112,53 @@ static int streq(string a, string b)
 ////////////////////////////////////////////////////////////////////////////////////////////
 // Entry point
 
-static void http(void *ptr)
+static TReturn http_thread_main(void *ptr)
 {
 	CozyFS *fs = ptr;
 	cozyfs_http_serve("127.0.0.1", 8080, fs);
+	return 0;
 }
 
-static void fuse(void *ptr)
+static const char *mountpoint = NULL;
+
+static TReturn fuse_thread_main(void *ptr)
 {
 	CozyFS *fs = ptr;
-	cozyfs_fuse();
+	cozyfs_fuse(fs, mountpoint);
+	return 0;
 }
 
 static void usage(char *self, FILE *stream)
 {
 	fprintf(stream, "Usage: %s ..options..\n", self);
 	fprintf(stream, "OPTIONS:\n"
-		"  --shared   Map the state into shared memory\n"
-		"  --persist  Map the state to a file\n"
-		"  --http     Expose the state over HTTP\n"
-		"  --shell    Start a shell into cozyfs\n");
+		"  --shared     Map the state into shared memory\n"
+		"  --persist    Map the state to a file\n"
+		"  --http       Expose the state over HTTP\n"
+		"  --fuse DIR   Mount the state at DIR\n"
+		"  --import DIR Copy the host directory DIR into the root\n"
+		"  --export DIR Copy the root into the host directory DIR\n"
+		"  --record F   Record every call into the trace file F\n"
+		"  --replay F   Issue the calls of the trace file F at their original pace\n"
+		"  --replay-fast F\n"
+		"               Issue the calls of the trace file F as fast as possible\n"
+		"  --shell      Start a shell into cozyfs\n");
 }
 
 int main(int argc, char **argv)
 {
 	// OPTIONS:
-	//   --shared   Map the state into shared memory
-	//   --persist  Map the state to a file
-	//   --http     Expose the state over HTTP
-	//   --shell    Start a shell into cozyfs
+	//   --shared     Map the state into shared memory
+	//   --persist    Map the state to a file
+	//   --http       Expose the state over HTTP
+	//   --fuse DIR   Mount the state at DIR
+	//   --import DIR Copy the host directory DIR into the root
+	//   --export DIR Copy the root into the host directory DIR
+	//   --record F   Record every call into the trace file F
+	//   --replay F   Issue the calls of the trace file F at their original pace
+	//   --replay-fast F
+	//                Issue the calls of the trace file F as fast as possible
+	//   --shell      Start a shell into cozyfs
 
 	int shared  = 0;
 	int persist = 0;
@@ -127,6 +166,12 @@ int main(int argc, char **argv)
 	int shell   = 0;
 	int fuse    = 0;
 
+	const char *import_dir = NULL;
+	const char *export_dir = NULL;
+	const char *record_file = NULL;
+	const char *replay_file = NULL;
+	int replay_realtime = 0;
+
 	for (int i = 1; i < argc; i++) {
 
 		if (!strcmp("-h", argv[i]) || !strcmp("--help", argv[i])) {
@@ -142,8 +187,21 @@ int main(int argc, char **argv)
 			http = 1;
 		} else if (!strcmp("--shell", argv[i])) {
 			shell = 1;
-		} else if (!strcmp("--fuse", argv[i])) {
+		} else if (!strcmp("--fuse", argv[i]) && i+1 < argc) {
 			fuse = 1;
+			mountpoint = argv[++i];
+		} else if (!strcmp("--import", argv[i]) && i+1 < argc) {
+			import_dir = argv[++i];
+		} else if (!strcmp("--export", argv[i]) && i+1 < argc) {
+			export_dir = argv[++i];
+		} else if (!strcmp("--record", argv[i]) && i+1 < argc) {
+			record_file = argv[++i];
+		} else if (!strcmp("--replay", argv[i]) && i+1 < argc) {
+			replay_file = argv[++i];
+			replay_realtime = 1;
+		} else if (!strcmp("--replay-fast", argv[i]) && i+1 < argc) {
+			replay_file = argv[++i];
+			replay_realtime = 0;
 		} else {
 			usage(argv[0], stderr);
 			return -1;
@@ -152,26 +210,70 @@ int main(int argc, char **argv)
 
 	CozyFS fs;
 	SharedMemory shm;
-	Thread http_thread;
-	Thread fuse_thread;
-
-	int code = shared_memory_create(&shm, name, len, persist);
-	if (code < 0) {
-		// TODO
+	Thread http_thread = 0;
+	Thread fuse_thread = 0;
+
+	// Without --shared or --persist the state is private to the process
+	const char *name = persist ? PERSIST_NAME : (shared ? SHARED_NAME : NULL);
+	int created = shared_memory_create(&shm, name, FILE_SIZE, persist);
+	if (created < 0) {
+		fprintf(stderr, "Error: Couldn't map the state\n");
 		return -1;
 	}
 
-	// TODO: prepare the cozyfs instance
-	cozyfs_attach(&fs, shm.ptr, ???, cozyfs_callback_impl, NULL);
+	// State that outlives the process keeps a backup to recover
+	// from processes crashing while holding the lock
+	if (created) {
+		int code = cozyfs_init(shm.ptr, shm.len, shared || persist, 0);
+		if (code < 0) {
+			fprintf(stderr, "Error: Couldn't initialize the state (error %d)\n", -code);
+			shared_memory_delete(shm);
+			return -1;
+		}
+	}
 
-	if (http) http_thread = thread_spawn(http, &fs);
-	if (fuse) fuse_thread = thread_spawn(fuse, &fs);
+	// The recorder sits between the engine and the system callback
+	cozyfs_callback callback = cozyfs_callback_impl;
+	void *userptr = NULL;
+	CozyFSRecorder *recorder = NULL;
+	if (record_file) {
+		recorder = cozyfs_record_start(record_file, callback, userptr);
+		if (recorder == NULL)
+			fprintf(stderr, "Error: Couldn't record into '%s'\n", record_file);
+		else {
+			callback = cozyfs_record_callback;
+			userptr  = recorder;
+		}
+	}
+
+	cozyfs_attach(&fs, shm.ptr, NULL, callback, userptr);
+
+	if (replay_file) {
+		CozyFSReplay replay;
+		if (cozyfs_replay(&fs, replay_file, replay_realtime, &replay) < 0)
+			fprintf(stderr, "Error: Replay of '%s' incomplete\n", replay_file);
+		fprintf(stderr, "Replayed %llu calls in %.3fs (%llu skipped, %llu returned differently)\n",
+			replay.num_calls, replay.elapsed_ns / 1e9, replay.num_skipped, replay.num_diverged);
+	}
+
+	if (import_dir && cozyfs_import(&fs, import_dir, "/", 0) < 0)
+		fprintf(stderr, "Error: Import from '%s' incomplete\n", import_dir);
+	if (export_dir && cozyfs_export(&fs, "/", export_dir, 0) < 0)
+		fprintf(stderr, "Error: Export to '%s' incomplete\n", export_dir);
+
+	if (http) http_thread = thread_spawn(http_thread_main, &fs);
+	if (fuse) fuse_thread = thread_spawn(fuse_thread_main, &fs);
 
 	if (shell) run_shell(&fs);
 
 	if (http) thread_join(http_thread);
 	if (fuse) thread_join(fuse_thread);
 
+	if (recorder && cozyfs_record_stop(recorder) < 0)
+		fprintf(stderr, "Error: Trace '%s' incomplete\n", record_file);
+
+	if (persist && shared_memory_flush(shm) < 0)
+		fprintf(stderr, "Error: Couldn't flush '%s'\n", PERSIST_NAME);
 	shared_memory_delete(shm);
 	return 0;
 }
@@ -215,6 +317,7 @@ static int shared_memory_create(SharedMemory *shm, const char *name, u64 len, in
 	HANDLE hFile;
 	HANDLE hMapFile;
 	void *ptr;
+	int created;
 	if (is_file) {
 		hFile = CreateFile(
 			name,
@@ -227,6 +330,7 @@ static int shared_memory_create(SharedMemory *shm, const char *name, u64 len, in
 		);
 		if (hFile == INVALID_HANDLE_VALUE)
 			return -1;
+		created = GetFileSize(hFile, NULL) < len;
 
 		DWORD dwFileSize = len;
 		SetFilePointer(hFile, dwFileSize, NULL, FILE_BEGIN);
@@ -271,6 +375,7 @@ static int shared_memory_create(SharedMemory *shm, const char *name, u64 len, in
 		);
 		if (hFile == NULL)
 			return -1;
+		created = GetLastError() != ERROR_ALREADY_EXISTS;
 
 		ptr = MapViewOfFile(
 			hMapFile,
@@ -289,42 +394,53 @@ static int shared_memory_create(SharedMemory *shm, const char *name, u64 len, in
 	shm->hMapFile = hMapFile;
 	shm->ptr = ptr;
 	shm->len = len;
-	return 0;
+	return created;
 #elif OS_LINUX
-	int fd;
-	
-	if (is_file) {
+	int fd = -1;
+	int created = 1;
+
+	if (name == NULL) {
+		// Anonymous, so always new
+	} else if (is_file) {
 		fd = open(name, O_CREAT | O_RDWR, 0666);
 		if (fd == -1)
 			return -1;
-		if (lseek(fd, FILE_SIZE-1, SEEK_SET) == -1) {
+		struct stat buf;
+		if (fstat(fd, &buf) == -1) {
 			close(fd);
 			return -1;
 		}
-		if (write(fd, "", 1) == -1) {
+		created = (u64) buf.st_size < len;
+		if (created && ftruncate(fd, len) == -1) {
 			close(fd);
 			return -1;
 		}
 	} else {
-		fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+		if (fd == -1 && errno == EEXIST) {
+			created = 0;
+			fd = shm_open(name, O_RDWR, 0666);
+		}
 		if (fd == -1)
 			return -1;
-		if (ftruncate(fd, len) == -1) {
+		if (created && ftruncate(fd, len) == -1) {
 			close(fd);
 			return -1;
 		}
 	}
 
-	void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int flags = fd == -1 ? (MAP_PRIVATE | MAP_ANONYMOUS) : MAP_SHARED;
+	void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, fd, 0);
 	if (ptr == MAP_FAILED) {
-		close(fd);
+		if (fd != -1)
+			close(fd);
 		return -1;
 	}
 
 	shm->fd = fd;
 	shm->ptr = ptr;
 	shm->len = len;
-	return 0;
+	return created;
 #else
 	return -1;
 #endif
@@ -339,7 +455,8 @@ static void shared_memory_delete(SharedMemory shm)
 	CloseHandle(shm.hMapFile);
 #elif OS_LINUX
 	munmap(shm.ptr, shm.len);
-	close(shm.fd);
+	if (shm.fd != -1)
+		close(shm.fd);
 #endif
 }
 
@@ -361,16 +478,60 @@ static int shared_memory_flush(SharedMemory shm)
 ////////////////////////////////////////////////////////////////////////////////////////////77
 // Shell
 
-static void run_ls(string args, CozyFS *fs)
+// Copies an argument into "dst" as a C string
+static int arg_path(string arg, char *dst, int max)
 {
-	printf("running ls\n");
-	// TODO
+	if (arg.len >= max)
+		return -1;
+	memcpy(dst, arg.ptr, arg.len);
+	dst[arg.len] = '\0';
+	return 0;
+}
+
+static void run_ls(string *args, int num_args, CozyFS *fs)
+{
+	char path[1<<10] = "/";
+	if (num_args > 1 && arg_path(args[1], path, sizeof(path)) < 0) {
+		printf("Error: Path too long\n");
+		return;
+	}
+
+	unsigned int cursor = 0;
+	for (;;) {
+		CozyFSDirEntry entries[32];
+		int num = cozyfs_readdir(fs, path, &cursor, entries, COUNT(entries));
+		if (num < 0) {
+			printf("Error: Couldn't list '%s' (error %d)\n", path, -num);
+			return;
+		}
+		if (num == 0)
+			break;
+		for (int i = 0; i < num; i++)
+			printf("%s%s\n", entries[i].name, entries[i].stat.is_dir ? "/" : "");
+	}
 }
 
-static void run_cat(string args, CozyFS *fs)
+static void run_cat(string *args, int num_args, CozyFS *fs)
 {
-	printf("running cat\n");
-	// TODO
+	char path[1<<10];
+	if (num_args < 2 || arg_path(args[1], path, sizeof(path)) < 0) {
+		printf("Usage: cat PATH\n");
+		return;
+	}
+
+	int fd = cozyfs_open(fs, path);
+	if (fd < 0) {
+		printf("Error: Couldn't open '%s' (error %d)\n", path, -fd);
+		return;
+	}
+	for (;;) {
+		char buf[1<<12];
+		int num = cozyfs_read(fs, fd, buf, sizeof(buf));
+		if (num <= 0)
+			break;
+		fwrite(buf, 1, num, stdout);
+	}
+	cozyfs_close(fs, fd);
 }
 
 static void run_shell(CozyFS *fs)
@@ -378,18 +539,18 @@ static void run_shell(CozyFS *fs)
 	for (;;) {
 
 		char cmd[1<<13];
-		int  len;
+		int  len = 0;
 
-		for (;;) {
-			char c = getc(stdin);
-			if (c == '\n') break;
-
-			if (len < cmd)
+		int c;
+		while ((c = getc(stdin)) != EOF && c != '\n') {
+			if (len < (int) sizeof(cmd))
 				cmd[len] = c;
 			len++;
 		}
+		if (c == EOF && len == 0)
+			break;
 
-		if (len > sizeof(cmd)) {
+		if (len > (int) sizeof(cmd)) {
 			printf("Error: Command too long\n");
 			continue;
 		}
@@ -400,19 +561,18 @@ static void run_shell(CozyFS *fs)
 		int i = 0;
 		for (;;) {
 
-			while (i < len && (cmd[i] == ' ' || cmd[i] == '\t' || cmd[i] == '\r' || cmd[i] == '\n'))
+			while (i < len && (cmd[i] == ' ' || cmd[i] == '\t' || cmd[i] == '\r'))
 				i++;
 
 			if (i == len)
 				break;
 
 			int off = i;
-			while (i < len && cmd[i] != ' ' && cmd[i] != '\t' &&  cmd[i] != '\r' || cmd[i] != '\n')
+			while (i < len && cmd[i] != ' ' && cmd[i] != '\t' && cmd[i] != '\r')
 				i++;
 
-			if (num_args == COUNT(args)) {
-				// TODO
-			}
+			if (num_args == COUNT(args))
+				break; // Extra arguments are ignored
 			args[num_args++] = (string) { cmd + off, i - off };
 		}
 
@@ -421,22 +581,22 @@ static void run_shell(CozyFS *fs)
 
 		struct {
 			string str;
-			void (*fun)(string*);
+			void (*fun)(string*, int, CozyFS*);
 		} table[] = {
 			{ S("ls"),  run_ls  },
 			{ S("cat"), run_cat }
 		};
 
 		int found = 0;
-		for (int i = 0; i < COUNT(table); i++)
-			if (streq(args[0], table[i].str)) {
-				table[i].fun(args, fs);
+		for (int j = 0; j < COUNT(table); j++)
+			if (streq(args[0], table[j].str)) {
+				table[j].fun(args, num_args, fs);
 				found = 1;
 				break;
 			}
 		if (!found)
 			printf("Error: Unknown command '%.*s'\n",
-				args[i].len, args[i].ptr);
+				args[0].len, args[0].ptr);
 	}
 }
 
@@ -0,0 +1,39 @@
+// Copyright (c) 2025 Francesco Cozzuto
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this
+// software and associated documentation files (the "Software"), to deal in the Software
+// without restriction, including without limitation the rights to use, copy, modify, merge,
+// publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons
+// to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+// OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+#ifndef COZYFS_THREAD_FS_H
+#define COZYFS_THREAD_FS_H
+#include <cozyfs.h>
+
+// Handles hold per-process state (lock ticket, transaction patches)
+// so each thread operates on its own copy of the shared one. The copy
+// is made on first use and lives as long as the thread. A thread that
+// moves to another handle gets a fresh copy of it. State that may be
+// resumed by other threads keeps the shared handle and calls this on
+// every use.
+static inline CozyFS *thread_fs(CozyFS *shared)
+{
+	static _Thread_local CozyFS  copy;
+	static _Thread_local CozyFS *source = NULL;
+	if (source != shared) {
+		copy = *shared;
+		source = shared;
+	}
+	return &copy;
+}
+
+#endif // COZYFS_THREAD_FS_H
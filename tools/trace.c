@@ -0,0 +1,554 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+typedef unsigned char      u8;
+typedef unsigned long long u64;
+typedef long long          s64;
+
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+
+// A trace is a header followed by one record per call, in the order
+// the calls returned:
+//
+//   u8      op (COZYFS_OP_*)
+//   svarint start, in nanoseconds from the start of the previous record
+//   varint  duration, in nanoseconds
+//   svarint result
+//   ...     the arguments the op takes, in the order of "op_args"
+//
+// Strings are a varint length followed by the bytes. Varints are
+// LEB128, and signed ones are zigzag encoded first.
+#define TRACE_MAGIC "CZTRACE1"
+
+#define MAX_STRING   (1<<12)
+#define MAX_RECORD   (2 * MAX_STRING + 64)
+#define RECORD_BUF   (1<<16)
+#define MAX_OPEN_FDS (1<<10)
+#define MAX_IO       (1<<24) // Largest read or write issued by the replayer
+
+enum {
+	ARG_PATH   = 1 << 0,
+	ARG_PATH2  = 1 << 1,
+	ARG_FD     = 1 << 2,
+	ARG_NUM    = 1 << 3,
+	ARG_CURSOR = 1 << 4,
+};
+
+static const int op_args[COZYFS_OP_COUNT] = {
+	[COZYFS_OP_LINK]       = ARG_PATH | ARG_PATH2,
+	[COZYFS_OP_UNLINK]     = ARG_PATH,
+	[COZYFS_OP_MKDIR]      = ARG_PATH,
+	[COZYFS_OP_RMDIR]      = ARG_PATH,
+	[COZYFS_OP_MKUSR]      = ARG_PATH,
+	[COZYFS_OP_RMUSR]      = ARG_PATH,
+	[COZYFS_OP_CHOWN]      = ARG_PATH | ARG_PATH2,
+	[COZYFS_OP_CHMOD]      = ARG_PATH | ARG_NUM,
+	[COZYFS_OP_OPEN]       = ARG_PATH,
+	[COZYFS_OP_CREATE]     = ARG_PATH,
+	[COZYFS_OP_CLOSE]      = ARG_FD,
+	[COZYFS_OP_READ]       = ARG_FD | ARG_NUM,
+	[COZYFS_OP_WRITE]      = ARG_FD | ARG_NUM,
+	[COZYFS_OP_READ_SPANS] = ARG_FD | ARG_NUM,
+	[COZYFS_OP_SEEK]       = ARG_FD | ARG_NUM,
+	[COZYFS_OP_FSTAT]      = ARG_FD,
+	[COZYFS_OP_STAT]       = ARG_PATH,
+	[COZYFS_OP_READDIR]    = ARG_PATH | ARG_NUM | ARG_CURSOR,
+	[COZYFS_OP_READ_PATH]  = ARG_PATH | ARG_NUM,
+};
+
+struct CozyFSRecorder {
+	cozyfs_callback callback;
+	void           *userptr;
+	int             forward; // The wrapped callback wants trace events too
+
+	pthread_mutex_t mutex;
+	FILE *stream;
+	int   failed;
+	u64   last_start;
+	int   len;
+	u8    buf[RECORD_BUF];
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Encoding
+
+static int put_varint(u8 *dst, u64 value)
+{
+	int len = 0;
+	while (value >= 0x80) {
+		dst[len++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	dst[len++] = value;
+	return len;
+}
+
+static int put_svarint(u8 *dst, s64 value)
+{
+	return put_varint(dst, ((u64) value << 1) ^ (u64) (value >> 63));
+}
+
+static int put_string(u8 *dst, const char *str)
+{
+	int len = str ? strnlen(str, MAX_STRING-1) : 0;
+	int num = put_varint(dst, len);
+	if (len > 0)
+		memcpy(dst + num, str, len);
+	return num + len;
+}
+
+static int get_varint(FILE *stream, u64 *value)
+{
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int c = getc(stream);
+		if (c == EOF)
+			return -1;
+		*value |= (u64) (c & 0x7F) << shift;
+		if ((c & 0x80) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+static int get_svarint(FILE *stream, s64 *value)
+{
+	u64 raw;
+	if (get_varint(stream, &raw) < 0)
+		return -1;
+	*value = (s64) (raw >> 1) ^ -(s64) (raw & 1);
+	return 0;
+}
+
+static int get_string(FILE *stream, char *dst)
+{
+	u64 len;
+	if (get_varint(stream, &len) < 0 || len >= MAX_STRING)
+		return -1;
+	if (fread(dst, 1, len, stream) != len)
+		return -1;
+	dst[len] = '\0';
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Recorder
+
+static void flush_records(CozyFSRecorder *rec)
+{
+	if (rec->len > 0 && fwrite(rec->buf, 1, rec->len, rec->stream) != (size_t) rec->len)
+		rec->failed = 1;
+	rec->len = 0;
+}
+
+// Called as operations return, possibly from several threads at once
+static void record_call(CozyFSRecorder *rec, const CozyFSTraceEvent *event)
+{
+	const CozyFSTraceArgs *args = event->args;
+	const CozyFSTraceArgs none = {0};
+	if (args == NULL)
+		args = &none;
+
+	// Everything but the start time is encoded out of the lock
+	u8  tail[MAX_RECORD];
+	int len = 0;
+	len += put_varint(tail + len, event->value);
+	len += put_svarint(tail + len, event->code);
+
+	int mask = op_args[event->op];
+	if (mask & ARG_PATH)   len += put_string(tail + len, args->path);
+	if (mask & ARG_PATH2)  len += put_string(tail + len, args->path2);
+	if (mask & ARG_FD)     len += put_svarint(tail + len, args->fd);
+	if (mask & ARG_NUM)    len += put_svarint(tail + len, args->num);
+	if (mask & ARG_CURSOR) len += put_varint(tail + len, args->cursor);
+
+	u64 start = event->time - event->value;
+
+	pthread_mutex_lock(&rec->mutex);
+
+	if (rec->len + len + 16 > RECORD_BUF)
+		flush_records(rec);
+
+	rec->buf[rec->len++] = event->op;
+	rec->len += put_svarint(rec->buf + rec->len, (s64) (start - rec->last_start));
+	memcpy(rec->buf + rec->len, tail, len);
+	rec->len += len;
+	rec->last_start = start;
+
+	pthread_mutex_unlock(&rec->mutex);
+}
+
+CozyFSRecorder *cozyfs_record_start(const char *file, cozyfs_callback callback, void *userptr)
+{
+	CozyFSRecorder *rec = malloc(sizeof(CozyFSRecorder));
+	if (rec == NULL)
+		return NULL;
+
+	rec->stream = fopen(file, "wb");
+	if (rec->stream == NULL) {
+		free(rec);
+		return NULL;
+	}
+	fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC)-1, rec->stream);
+
+	rec->callback   = callback;
+	rec->userptr    = userptr;
+	rec->forward    = callback(COZYFS_SYSOP_TRACE, userptr, NULL, 0) == 1;
+	rec->failed     = 0;
+	rec->last_start = 0;
+	rec->len        = 0;
+	pthread_mutex_init(&rec->mutex, NULL);
+	return rec;
+}
+
+unsigned long long cozyfs_record_callback(int sysop, void *userptr, void *p, int n)
+{
+	CozyFSRecorder *rec = userptr;
+
+	if (sysop != COZYFS_SYSOP_TRACE)
+		return rec->callback(sysop, rec->userptr, p, n);
+
+	if (p == NULL)
+		return 1; // Asked when attaching
+
+	const CozyFSTraceEvent *event = p;
+	if (event->type == COZYFS_TRACE_OP_END && event->op >= 0 && event->op < COZYFS_OP_COUNT)
+		record_call(rec, event);
+
+	if (rec->forward)
+		rec->callback(sysop, rec->userptr, p, n);
+	return 0;
+}
+
+int cozyfs_record_stop(CozyFSRecorder *rec)
+{
+	pthread_mutex_lock(&rec->mutex);
+	flush_records(rec);
+	pthread_mutex_unlock(&rec->mutex);
+
+	if (fclose(rec->stream))
+		rec->failed = 1;
+	int failed = rec->failed;
+
+	pthread_mutex_destroy(&rec->mutex);
+	free(rec);
+	return failed ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Replayer
+
+typedef struct {
+	int op;
+	s64 start; // Relative to the previous call
+	u64 duration;
+	s64 result;
+	char path[MAX_STRING];
+	char path2[MAX_STRING];
+	s64 fd;
+	s64 num;
+	u64 cursor;
+} Call;
+
+// Handles are recorded with the numbers they had in the live process
+// and issued with the ones opened during the replay
+typedef struct {
+	int recorded;
+	int replayed;
+} FDPair;
+
+typedef struct {
+	FDPair pairs[MAX_OPEN_FDS];
+	int    count;
+} FDMap;
+
+typedef struct {
+	void           *io;
+	int             io_len;
+	CozyFSDirEntry *entries;
+	int             max_entries;
+} Buffers;
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns 1 if a call was read, 0 at the end of the trace and -1
+// if the trace is malformed
+static int read_call(FILE *stream, Call *call)
+{
+	int op = getc(stream);
+	if (op == EOF)
+		return 0;
+	if (op >= COZYFS_OP_COUNT)
+		return -1;
+	call->op = op;
+
+	if (get_svarint(stream, &call->start) < 0)   return -1;
+	if (get_varint(stream, &call->duration) < 0) return -1;
+	if (get_svarint(stream, &call->result) < 0)  return -1;
+
+	int mask = op_args[op];
+	if ((mask & ARG_PATH)   && get_string(stream, call->path) < 0)    return -1;
+	if ((mask & ARG_PATH2)  && get_string(stream, call->path2) < 0)   return -1;
+	if ((mask & ARG_FD)     && get_svarint(stream, &call->fd) < 0)    return -1;
+	if ((mask & ARG_NUM)    && get_svarint(stream, &call->num) < 0)   return -1;
+	if ((mask & ARG_CURSOR) && get_varint(stream, &call->cursor) < 0) return -1;
+	return 1;
+}
+
+static int map_fd(FDMap *map, int recorded, int *replayed)
+{
+	for (int i = 0; i < map->count; i++)
+		if (map->pairs[i].recorded == recorded) {
+			*replayed = map->pairs[i].replayed;
+			return 0;
+		}
+	return -1;
+}
+
+static void add_fd(FDMap *map, int recorded, int replayed)
+{
+	for (int i = 0; i < map->count; i++)
+		if (map->pairs[i].recorded == recorded) {
+			map->pairs[i].replayed = replayed;
+			return;
+		}
+	if (map->count < MAX_OPEN_FDS)
+		map->pairs[map->count++] = (FDPair) { recorded, replayed };
+}
+
+static void remove_fd(FDMap *map, int recorded)
+{
+	for (int i = 0; i < map->count; i++)
+		if (map->pairs[i].recorded == recorded) {
+			map->pairs[i] = map->pairs[--map->count];
+			return;
+		}
+}
+
+static void *io_buffer(Buffers *bufs, int len)
+{
+	if (len > bufs->io_len) {
+		void *io = realloc(bufs->io, len);
+		if (io == NULL)
+			return NULL;
+		memset(io, 0, len);
+		bufs->io = io;
+		bufs->io_len = len;
+	}
+	return bufs->io;
+}
+
+static CozyFSDirEntry *entry_buffer(Buffers *bufs, int num)
+{
+	if (num > bufs->max_entries) {
+		CozyFSDirEntry *entries = realloc(bufs->entries, num * sizeof(CozyFSDirEntry));
+		if (entries == NULL)
+			return NULL;
+		bufs->entries = entries;
+		bufs->max_entries = num;
+	}
+	return bufs->entries;
+}
+
+// Returns the result of the call, or 1 if it couldn't be issued
+static int issue_call(CozyFS *fs, Call *call, FDMap *fds, Buffers *bufs, int *skipped)
+{
+	*skipped = 0;
+
+	int fd = -1;
+	if (op_args[call->op] & ARG_FD) {
+		if (map_fd(fds, call->fd, &fd) < 0) {
+			*skipped = 1;
+			return 1;
+		}
+	}
+
+	int num = (int) MIN(call->num < 0 ? 0 : call->num, MAX_IO);
+
+	switch (call->op) {
+		case COZYFS_OP_LINK:   return cozyfs_link(fs, call->path, call->path2);
+		case COZYFS_OP_UNLINK: return cozyfs_unlink(fs, call->path);
+		case COZYFS_OP_MKDIR:  return cozyfs_mkdir(fs, call->path);
+		case COZYFS_OP_RMDIR:  return cozyfs_rmdir(fs, call->path);
+		case COZYFS_OP_MKUSR:  return cozyfs_mkusr(fs, call->path);
+		case COZYFS_OP_RMUSR:  return cozyfs_rmusr(fs, call->path);
+		case COZYFS_OP_CHOWN:  return cozyfs_chown(fs, call->path, call->path2);
+		case COZYFS_OP_CHMOD:  return cozyfs_chmod(fs, call->path, call->num);
+		case COZYFS_OP_SEEK:   return cozyfs_seek(fs, fd, call->num);
+
+		case COZYFS_OP_OPEN:
+		case COZYFS_OP_CREATE:
+		{
+			int code = call->op == COZYFS_OP_OPEN
+				? cozyfs_open(fs, call->path)
+				: cozyfs_create(fs, call->path);
+			if (code >= 0 && call->result >= 0)
+				add_fd(fds, call->result, code);
+			return code;
+		}
+
+		case COZYFS_OP_CLOSE:
+		{
+			int code = cozyfs_close(fs, fd);
+			remove_fd(fds, call->fd);
+			return code;
+		}
+
+		case COZYFS_OP_READ:
+		case COZYFS_OP_WRITE:
+		{
+			void *io = io_buffer(bufs, num);
+			if (io == NULL) {
+				*skipped = 1;
+				return 1;
+			}
+			if (call->op == COZYFS_OP_READ)
+				return cozyfs_read(fs, fd, io, num);
+			return cozyfs_write(fs, fd, io, num);
+		}
+
+		case COZYFS_OP_READ_SPANS:
+		{
+			CozyFSSpan *spans = io_buffer(bufs, num * sizeof(CozyFSSpan));
+			if (spans == NULL) {
+				*skipped = 1;
+				return 1;
+			}
+			return cozyfs_read_spans(fs, fd, spans, num);
+		}
+
+		case COZYFS_OP_READ_PATH:
+		{
+			void *io = io_buffer(bufs, num);
+			if (io == NULL) {
+				*skipped = 1;
+				return 1;
+			}
+			return cozyfs_read_path(fs, call->path, io, num);
+		}
+
+		case COZYFS_OP_FSTAT:
+		{
+			CozyFSStat stat;
+			return cozyfs_fstat(fs, fd, &stat);
+		}
+
+		case COZYFS_OP_STAT:
+		{
+			CozyFSStat stat;
+			return cozyfs_stat(fs, call->path, &stat);
+		}
+
+		case COZYFS_OP_READDIR:
+		{
+			CozyFSDirEntry *entries = entry_buffer(bufs, num);
+			if (entries == NULL) {
+				*skipped = 1;
+				return 1;
+			}
+			unsigned int cursor = call->cursor;
+			return cozyfs_readdir(fs, call->path, &cursor, entries, num);
+		}
+
+		case COZYFS_OP_TRANSACTION_BEGIN:    return cozyfs_transaction_begin(fs);
+		case COZYFS_OP_TRANSACTION_COMMIT:   return cozyfs_transaction_commit(fs);
+		case COZYFS_OP_TRANSACTION_ROLLBACK: return cozyfs_transaction_rollback(fs);
+
+		case COZYFS_OP_INSPECT:
+		{
+			CozyFSReport report;
+			return cozyfs_inspect(fs, &report, NULL, NULL);
+		}
+	}
+
+	*skipped = 1;
+	return 1;
+}
+
+int cozyfs_replay(CozyFS *fs, const char *file, int realtime, CozyFSReplay *result)
+{
+	memset(result, 0, sizeof(CozyFSReplay));
+
+	FILE *stream = fopen(file, "rb");
+	if (stream == NULL)
+		return -1;
+
+	char magic[sizeof(TRACE_MAGIC)-1];
+	if (fread(magic, 1, sizeof(magic), stream) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+		fclose(stream);
+		return -1;
+	}
+
+	Buffers bufs = {0};
+	Call  *call = malloc(sizeof(Call));
+	FDMap *fds  = malloc(sizeof(FDMap));
+	if (call == NULL || fds == NULL) {
+		free(call);
+		free(fds);
+		fclose(stream);
+		return -1;
+	}
+	fds->count = 0;
+
+	int code = 0;
+	s64 offset = 0; // Start of the current call relative to the first one
+	u64 begin = now_ns();
+	for (int first = 1;; first = 0) {
+
+		int status = read_call(stream, call);
+		if (status <= 0) {
+			code = status;
+			break;
+		}
+
+		if (!first)
+			offset += call->start;
+
+		if (realtime && offset > 0) {
+			u64 target = begin + offset;
+			u64 now = now_ns();
+			if (target > now) {
+				u64 wait = target - now;
+				struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		int skipped;
+		s64 ret = issue_call(fs, call, fds, &bufs, &skipped);
+		if (skipped) {
+			result->num_skipped++;
+			continue;
+		}
+		result->num_calls++;
+
+		// Handles differ between runs, so opens only need to agree on failing
+		int same;
+		if (call->op == COZYFS_OP_OPEN || call->op == COZYFS_OP_CREATE)
+			same = (ret < 0) == (call->result < 0);
+		else
+			same = ret == call->result;
+		if (!same)
+			result->num_diverged++;
+	}
+	result->elapsed_ns = now_ns() - begin;
+
+	free(call);
+	free(fds);
+	free(bufs.io);
+	free(bufs.entries);
+	fclose(stream);
+	return code;
+}
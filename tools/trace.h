@@ -0,0 +1,50 @@
+// Copyright (c) 2025 Francesco Cozzuto
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this
+// software and associated documentation files (the "Software"), to deal in the Software
+// without restriction, including without limitation the rights to use, copy, modify, merge,
+// publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons
+// to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or
+// substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+// OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+#ifndef COZYFS_TRACE_H
+#define COZYFS_TRACE_H
+#include <cozyfs.h>
+
+typedef struct CozyFSRecorder CozyFSRecorder;
+
+// Starts recording the public calls made through handles attached with
+// cozyfs_record_callback and the recorder as "userptr". System calls
+// are forwarded to "callback". Returns NULL if "file" can't be created.
+CozyFSRecorder *cozyfs_record_start(const char *file, cozyfs_callback callback, void *userptr);
+
+unsigned long long cozyfs_record_callback(int sysop, void *userptr, void *p, int n);
+
+// Writes out what's still buffered and closes the trace. No handle
+// may use the recorder afterwards. Returns 0 on success and -1 if any
+// part of the trace couldn't be written.
+int cozyfs_record_stop(CozyFSRecorder *rec);
+
+typedef struct {
+	unsigned long long num_calls;
+	unsigned long long num_skipped;  // Used handles opened before the recording started
+	unsigned long long num_diverged; // Returned something else than when recorded
+	unsigned long long elapsed_ns;
+} CozyFSReplay;
+
+// Issues the calls of a trace through "fs", one after the other in
+// the order they completed. With "realtime" they start with the same
+// spacing as when recorded, otherwise as fast as possible. Written
+// bytes aren't recorded, so writes store zeros. Returns 0 on success
+// and -1 if the trace couldn't be read.
+int cozyfs_replay(CozyFS *fs, const char *file, int realtime, CozyFSReplay *result);
+
+#endif // COZYFS_TRACE_H